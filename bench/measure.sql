@@ -0,0 +1,56 @@
+-- Measure analysis and merge throughput on bench_idx
+--
+-- Prints one line of comma-separated values:
+--   index pages, leaf pages, analysis seconds, leaf pages/s,
+--   merges, merge seconds, merges/s, WAL bytes per merge, live leaf
+--   pages afterwards
+--
+-- Variables: max_pct, max_merges
+
+\set ON_ERROR_STOP on
+\pset format unaligned
+\pset tuples_only on
+\pset fieldsep ','
+SET client_min_messages = warning;
+
+SELECT pg_relation_size('bench_idx') / current_setting('block_size')::int AS index_pages,
+       leaf_pages
+FROM reclaim_space_summary('bench_idx', :max_pct) \gset
+
+-- Warm the cache the same way for every configuration
+SELECT count(*) AS warm FROM reclaim_space('bench_idx', :max_pct) \gset
+
+SELECT clock_timestamp() AS t0 \gset
+SELECT count(*) AS candidates FROM reclaim_space('bench_idx', :max_pct) \gset
+SELECT extract(epoch FROM clock_timestamp() - :'t0') AS analyze_secs \gset
+
+-- Merge until nothing is left; merges and their cost come from the
+-- cumulative statistics of the freshly created index.  psql does not
+-- substitute variables in the DO body, so pass them as settings.
+SELECT set_config('bench.max_pct', :'max_pct', false) AS bench_max_pct,
+       set_config('bench.max_merges', :'max_merges', false) AS bench_max_merges \gset
+DO $$
+DECLARE
+    n bigint;
+BEGIN
+    LOOP
+        SELECT pages_merged INTO n
+        FROM reclaim_space_execute('bench_idx',
+                                   current_setting('bench.max_pct')::int,
+                                   current_setting('bench.max_merges')::int);
+        EXIT WHEN n = 0;
+    END LOOP;
+END
+$$;
+
+SELECT :index_pages,
+       :leaf_pages,
+       round(:analyze_secs, 3),
+       round(:leaf_pages / greatest(:analyze_secs, 0.000001)),
+       s.merges,
+       round((s.merge_time / 1000)::numeric, 3),
+       round((s.merges / greatest(s.merge_time / 1000, 0.000001))::numeric),
+       s.wal_bytes / greatest(s.merges, 1),
+       (SELECT leaf_pages FROM reclaim_space_summary('bench_idx', :max_pct))
+FROM pg_stat_index_reclaim s
+WHERE s.indexrelid = 'bench_idx'::regclass;
@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Benchmark driver for pg_index_reclaim
+#
+# For every combination of index size, key type, deduplication setting and
+# delete pattern, builds a bloated index and prints one CSV line with the
+# analysis throughput (leaf pages/s of reclaim_space()), the merge
+# throughput (merges/s and WAL bytes per merge of reclaim_space_execute()),
+# and, unless LATENCY_SECS=0, the average latency of a concurrent
+# read/write workload without and with merges running.
+#
+# Usage: ./run_bench.sh > results.csv
+#
+# The database given by the usual PG* environment variables must have
+# pg_index_reclaim installed.  The matrix and the run lengths can be changed
+# with the variables below.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+
+SIZES=${SIZES:-"100000 1000000 10000000"}
+KEYTYPES=${KEYTYPES:-"int4 numeric text"}
+DEDUPS=${DEDUPS:-"on off"}
+PATTERNS=${PATTERNS:-"random range skewed"}
+DELETE_FRAC=${DELETE_FRAC:-0.8}	# fraction of rows deleted
+DUPS=${DUPS:-8}					# rows per distinct key
+TEXT_WIDTH=${TEXT_WIDTH:-32}	# width of text keys
+MAX_PCT=${MAX_PCT:-20}
+MAX_MERGES=${MAX_MERGES:-100}
+LATENCY_SECS=${LATENCY_SECS:-30}
+CLIENTS=${CLIENTS:-4}
+
+# Key expression for a key type, in terms of the placeholder ID
+key_expr()
+{
+	case "$1" in
+		int4)		echo "(ID / $DUPS)::int4" ;;
+		numeric)	echo "(ID / $DUPS)::numeric(20,10)" ;;
+		text)		echo "lpad((ID / $DUPS)::text, $TEXT_WIDTH, 'k')" ;;
+		*)			echo "unknown key type $1" >&2; exit 1 ;;
+	esac
+}
+
+setup()
+{
+	local rows=$1 keytype=$2 dedup=$3 pattern=$4
+	local keyexpr
+
+	keyexpr=$(key_expr "$keytype")
+	$PSQL -X -q -v rows="$rows" -v keytype="$keytype" \
+		-v keyexpr="${keyexpr//ID/id}" -v dedup="$dedup" \
+		-v pattern="$pattern" -v frac="$DELETE_FRAC" \
+		-f "$BENCH_DIR/setup.sql" > /dev/null
+}
+
+# Average latency in ms of a pgbench run of the workload
+workload_latency()
+{
+	local rows=$1 script=$2
+
+	$PGBENCH -n -T "$LATENCY_SECS" -c "$CLIENTS" -D rows="$rows" \
+		-f "$script" 2> /dev/null |
+		sed -n 's/^latency average = \([0-9.]*\) ms$/\1/p'
+}
+
+echo "rows,keytype,dedup,pattern,index_pages,leaf_pages,analyze_secs,leaf_pages_per_sec,merges,merge_secs,merges_per_sec,wal_bytes_per_merge,leaf_pages_after,latency_ms,latency_during_merges_ms"
+
+for rows in $SIZES; do
+for keytype in $KEYTYPES; do
+for dedup in $DEDUPS; do
+for pattern in $PATTERNS; do
+	setup "$rows" "$keytype" "$dedup" "$pattern"
+	result=$($PSQL -X -q -v max_pct="$MAX_PCT" -v max_merges="$MAX_MERGES" \
+		-f "$BENCH_DIR/measure.sql")
+
+	latency=
+	latency_merging=
+	if [ "$LATENCY_SECS" -gt 0 ]; then
+		script=$(mktemp)
+		keyexpr=$(key_expr "$keytype")
+		sed "s|@KEYEXPR@|${keyexpr//ID/:id}|g" \
+			"$BENCH_DIR/workload.pgbench.in" > "$script"
+
+		# The merges above used up the bloat; build it again
+		setup "$rows" "$keytype" "$dedup" "$pattern"
+		latency=$(workload_latency "$rows" "$script")
+
+		$PGBENCH -n -T "$LATENCY_SECS" -c 1 -D max_pct="$MAX_PCT" \
+			-D max_merges="$MAX_MERGES" -f "$BENCH_DIR/reclaim.pgbench" \
+			> /dev/null 2>&1 &
+		latency_merging=$(workload_latency "$rows" "$script")
+		wait
+
+		rm -f "$script"
+	fi
+
+	echo "$rows,$keytype,$dedup,$pattern,$result,$latency,$latency_merging"
+done
+done
+done
+done
@@ -0,0 +1,37 @@
+-- Build a bloated index for one benchmark configuration
+--
+-- Variables (set by run_bench.sh with psql -v):
+--   rows      number of rows to load
+--   keytype   SQL type of the indexed column
+--   keyexpr   expression computing the key from the integer column id
+--   dedup     on or off, the deduplicate_items setting of the index
+--   pattern   random, range or skewed
+--   frac      fraction of rows to delete
+
+\set ON_ERROR_STOP on
+SET client_min_messages = warning;
+
+DROP TABLE IF EXISTS bench_table;
+CREATE TABLE bench_table (
+    id int4 PRIMARY KEY,
+    k :keytype
+);
+
+INSERT INTO bench_table
+SELECT id, :keyexpr
+FROM generate_series(1, :rows) id;
+
+CREATE INDEX bench_idx ON bench_table (k) WITH (deduplicate_items = :dedup);
+
+-- random: scattered deletes, the common case
+-- range:  the first part of every block of 10000 ids goes, leaving
+--         stretches of empty and untouched leaves
+-- skewed: low ids are deleted much more often than high ones
+DELETE FROM bench_table
+WHERE CASE :'pattern'
+          WHEN 'random' THEN random() < :frac
+          WHEN 'range' THEN (id % 10000) < :frac * 10000
+          WHEN 'skewed' THEN random() < 2 * :frac * (1 - id::float8 / :rows)
+      END;
+
+VACUUM ANALYZE bench_table;
@@ -0,0 +1,226 @@
+/*-------------------------------------------------------------------------
+ *
+ * candidate_cache.c
+ *	  Shared-memory cache of merge candidates
+ *
+ * Analyzing a large index means reading all of it, while a merge budget
+ * usually covers a small fraction of the candidates found.  The candidates
+ * an analysis did not get to are therefore kept in a small shared-memory
+ * cache, so that the next reclaim_space_execute() on the same index only
+ * has to re-check their pages.  Every candidate records the LSNs of its
+ * two pages; a page whose LSN has not moved has not changed since.
+ *
+ * The cache lives in a segment of the DSM registry and has a fixed number
+ * of slots, each holding the candidates of one index, keyed by database,
+ * index OID, relfilenumber and max_pct_to_merge.  A REINDEX or TRUNCATE
+ * assigns a new relfilenumber and so invalidates the entry.  When all
+ * slots are taken, the least recently used one is recycled.  Candidates
+ * beyond CANDIDATE_CACHE_MAX_CANDIDATES are not kept; once the cached ones
+ * are used up, the next call simply analyzes the index again.
+ *
+ * The cache is only a hint: execute_merge() validates every merge under
+ * lock regardless.  Indexes that are not WAL-logged are never cached, since
+ * their page LSNs do not advance on modification.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/candidate_cache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/dsm_registry.h"
+#include "storage/lwlock.h"
+#include "utils/rel.h"
+
+#include "pg_index_reclaim.h"
+
+#define CANDIDATE_CACHE_SLOTS			8
+#define CANDIDATE_CACHE_MAX_CANDIDATES	2048
+
+typedef struct CandidateCacheSlot
+{
+	Oid			dbid;
+	Oid			indexoid;		/* InvalidOid if the slot is free */
+	RelFileNumber relfilenumber;
+	int			max_pct_to_merge;
+	uint64		last_used;		/* value of the cache clock at last use */
+	int			ncandidates;
+	MergeCandidate candidates[CANDIDATE_CACHE_MAX_CANDIDATES];
+} CandidateCacheSlot;
+
+typedef struct CandidateCache
+{
+	LWLock		lock;			/* protects everything below */
+	uint64		clock;
+	CandidateCacheSlot slots[CANDIDATE_CACHE_SLOTS];
+} CandidateCache;
+
+static CandidateCache *candidate_cache = NULL;
+
+static void
+candidate_cache_init_shmem(void *ptr)
+{
+	CandidateCache *cache = (CandidateCache *) ptr;
+	int			i;
+
+	LWLockInitialize(&cache->lock,
+					 LWLockNewTrancheId("pg_index_reclaim_candidates"));
+	cache->clock = 0;
+	for (i = 0; i < CANDIDATE_CACHE_SLOTS; i++)
+		cache->slots[i].indexoid = InvalidOid;
+}
+
+/*
+ * Attach to the cache, creating it on first use
+ */
+static CandidateCache *
+candidate_cache_attach(void)
+{
+	bool		found;
+
+	if (candidate_cache == NULL)
+		candidate_cache = GetNamedDSMSegment("pg_index_reclaim_candidates",
+											 sizeof(CandidateCache),
+											 candidate_cache_init_shmem,
+											 &found);
+
+	return candidate_cache;
+}
+
+/*
+ * Find the slot of an index, regardless of the rest of its key
+ */
+static CandidateCacheSlot *
+candidate_cache_lookup(CandidateCache *cache, Relation rel)
+{
+	int			i;
+
+	for (i = 0; i < CANDIDATE_CACHE_SLOTS; i++)
+	{
+		CandidateCacheSlot *slot = &cache->slots[i];
+
+		if (slot->indexoid == RelationGetRelid(rel) && slot->dbid == MyDatabaseId)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remember the candidates of an index, replacing what we had for it
+ *
+ * Only the candidates that can be merged are kept; the others would only
+ * stand in the way of a fresh analysis.  Storing none just forgets the
+ * index.
+ */
+void
+candidate_cache_store(Relation rel, int max_pct_to_merge,
+					  const MergeCandidate *candidates, int ncandidates)
+{
+	CandidateCache *cache;
+	CandidateCacheSlot *slot;
+	int			nmergeable = 0;
+	int			n;
+	int			i;
+
+	if (!RelationNeedsWAL(rel))
+		return;
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		if (candidates[i].can_merge)
+			nmergeable++;
+	}
+
+	cache = candidate_cache_attach();
+	LWLockAcquire(&cache->lock, LW_EXCLUSIVE);
+
+	slot = candidate_cache_lookup(cache, rel);
+	if (nmergeable == 0)
+	{
+		if (slot != NULL)
+			slot->indexoid = InvalidOid;
+		LWLockRelease(&cache->lock);
+		return;
+	}
+
+	/* Take a free slot, or else the least recently used one */
+	for (i = 0; slot == NULL && i < CANDIDATE_CACHE_SLOTS; i++)
+	{
+		if (cache->slots[i].indexoid == InvalidOid)
+			slot = &cache->slots[i];
+	}
+	if (slot == NULL)
+	{
+		slot = &cache->slots[0];
+		for (i = 1; i < CANDIDATE_CACHE_SLOTS; i++)
+		{
+			if (cache->slots[i].last_used < slot->last_used)
+				slot = &cache->slots[i];
+		}
+	}
+
+	slot->dbid = MyDatabaseId;
+	slot->indexoid = RelationGetRelid(rel);
+	slot->relfilenumber = rel->rd_locator.relNumber;
+	slot->max_pct_to_merge = max_pct_to_merge;
+	slot->last_used = ++cache->clock;
+
+	n = 0;
+	for (i = 0; i < ncandidates && n < CANDIDATE_CACHE_MAX_CANDIDATES; i++)
+	{
+		if (candidates[i].can_merge)
+			slot->candidates[n++] = candidates[i];
+	}
+	slot->ncandidates = n;
+
+	LWLockRelease(&cache->lock);
+
+	elog(DEBUG1, "pg_index_reclaim: Cached %d of %d merge candidates of index \"%s\"",
+		 n, ncandidates, RelationGetRelationName(rel));
+}
+
+/*
+ * Take the cached candidates of an index out of the cache
+ *
+ * Appends the candidates to cands and returns their number, which is zero
+ * unless the cache has candidates for the index in its current incarnation
+ * and for the same max_pct_to_merge.  The entry is removed, so that two
+ * callers never work from the same candidates; the caller is expected to
+ * store what it does not use.
+ */
+int
+candidate_cache_fetch(Relation rel, int max_pct_to_merge,
+					  MergeCandidates *cands)
+{
+	CandidateCache *cache;
+	CandidateCacheSlot *slot;
+	int			n = 0;
+	int			i;
+
+	if (!RelationNeedsWAL(rel))
+		return 0;
+
+	cache = candidate_cache_attach();
+	LWLockAcquire(&cache->lock, LW_EXCLUSIVE);
+
+	slot = candidate_cache_lookup(cache, rel);
+	if (slot != NULL &&
+		slot->relfilenumber == rel->rd_locator.relNumber &&
+		slot->max_pct_to_merge == max_pct_to_merge)
+	{
+		n = slot->ncandidates;
+		for (i = 0; i < n; i++)
+			*candidates_append(cands) = slot->candidates[i];
+	}
+	if (slot != NULL)
+		slot->indexoid = InvalidOid;
+
+	LWLockRelease(&cache->lock);
+
+	return n;
+}
@@ -6,7 +6,10 @@
 -- Function to reclaim space from B-tree indexes
 CREATE FUNCTION reclaim_space(
     index_name regclass,
-    max_pct_to_merge int DEFAULT 20
+    max_pct_to_merge int DEFAULT 20,
+    sequential boolean DEFAULT false,
+    since_lsn pg_lsn DEFAULT NULL,
+    level int DEFAULT 0
 )
 RETURNS TABLE(
     left_page_block bigint,
@@ -20,10 +23,12 @@ RETURNS TABLE(
 LANGUAGE C
 AS 'MODULE_PATHNAME', 'pg_index_reclaim_analyze';
 
--- Function to actually perform the merge (future implementation)
+-- Function to actually perform the merge
 CREATE FUNCTION reclaim_space_execute(
     index_name regclass,
-    max_pct_to_merge int DEFAULT 20
+    max_pct_to_merge int DEFAULT 20,
+    max_merges int DEFAULT 100,
+    level int DEFAULT 0
 )
 RETURNS TABLE(
     pages_merged bigint,
@@ -32,3 +37,173 @@ RETURNS TABLE(
 LANGUAGE C
 AS 'MODULE_PATHNAME', 'pg_index_reclaim_execute';
 
+-- Variants confined to a key range of the first index column; a NULL
+-- bound leaves that end of the range open
+CREATE FUNCTION reclaim_space_range(
+    index_name regclass,
+    lower_bound anyelement,
+    upper_bound anyelement,
+    max_pct_to_merge int DEFAULT 20
+)
+RETURNS TABLE(
+    left_page_block bigint,
+    right_page_block bigint,
+    left_page_usage_pct numeric,
+    right_page_usage_pct numeric,
+    total_items_to_move bigint,
+    estimated_space_reclaimed bigint,
+    can_merge boolean
+)
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_analyze_range';
+
+CREATE FUNCTION reclaim_space_execute_range(
+    index_name regclass,
+    lower_bound anyelement,
+    upper_bound anyelement,
+    max_pct_to_merge int DEFAULT 20,
+    max_merges int DEFAULT 100
+)
+RETURNS TABLE(
+    pages_merged bigint,
+    space_reclaimed bigint
+)
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_execute_range';
+
+-- Function to merge pages in many indexes under one budget
+CREATE FUNCTION reclaim_space_all(
+    table_name regclass DEFAULT NULL,
+    schema_name name DEFAULT NULL,
+    max_pct_to_merge int DEFAULT 20,
+    max_merges int DEFAULT 100,
+    max_pages bigint DEFAULT NULL,
+    max_wal_bytes bigint DEFAULT NULL
+)
+RETURNS TABLE(
+    index_name regclass,
+    estimated_pages bigint,
+    pages_merged bigint,
+    space_reclaimed bigint
+)
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_all';
+
+-- Function to move pages to the front of an index and truncate its tail
+CREATE FUNCTION reclaim_space_compact(
+    index_name regclass,
+    max_moves int DEFAULT 1000
+)
+RETURNS TABLE(
+    pages_moved bigint,
+    pages_truncated bigint
+)
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_compact';
+
+-- Function to summarize the leaf level of an index in a single row
+CREATE FUNCTION reclaim_space_summary(
+    index_name regclass,
+    max_pct_to_merge int DEFAULT 20,
+    sample_fraction float8 DEFAULT 1.0,
+    OUT leaf_pages bigint,
+    OUT used_bytes bigint,
+    OUT avg_usage_pct numeric,
+    OUT fill_histogram bigint[],
+    OUT mergeable_pairs bigint,
+    OUT reclaimable_pages bigint,
+    OUT reclaimable_bytes bigint,
+    OUT reclaimable_pages_low bigint,
+    OUT reclaimable_pages_high bigint
+)
+RETURNS record
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_summary';
+
+-- Progress of the running analysis and merge commands, one row per backend
+CREATE FUNCTION reclaim_space_progress(
+    OUT pid int,
+    OUT datid oid,
+    OUT indexrelid oid,
+    OUT command text,
+    OUT phase text,
+    OUT pages_total bigint,
+    OUT pages_scanned bigint,
+    OUT candidates_found bigint,
+    OUT merges_done bigint,
+    OUT pages_merged bigint,
+    OUT wal_bytes bigint
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_progress';
+
+CREATE VIEW pg_stat_progress_index_reclaim AS
+    SELECT p.pid, p.datid, d.datname, p.indexrelid, p.command, p.phase,
+           p.pages_total, p.pages_scanned, p.candidates_found,
+           p.merges_done, p.pages_merged, p.wal_bytes
+    FROM reclaim_space_progress() p
+         LEFT JOIN pg_database d ON d.oid = p.datid;
+
+GRANT SELECT ON pg_stat_progress_index_reclaim TO PUBLIC;
+
+-- Cumulative merge statistics, one row per index
+CREATE FUNCTION reclaim_space_stats(
+    OUT datid oid,
+    OUT indexrelid oid,
+    OUT calls bigint,
+    OUT merges bigint,
+    OUT pages_deleted bigint,
+    OUT bytes_moved bigint,
+    OUT wal_bytes bigint,
+    OUT aborted_sibling_mismatch bigint,
+    OUT aborted_parent_mismatch bigint,
+    OUT aborted_out_of_space bigint,
+    OUT aborted_half_dead bigint,
+    OUT aborted_deleted bigint,
+    OUT aborted_not_leaf bigint,
+    OUT aborted_no_items bigint,
+    OUT aborted_lock_busy bigint,
+    OUT aborted_error bigint,
+    OUT lock_wait_time float8,
+    OUT throttle_time float8,
+    OUT analysis_time float8,
+    OUT merge_time float8,
+    OUT descent_time float8,
+    OUT lock_time float8,
+    OUT scan_time float8,
+    OUT pairing_time float8,
+    OUT rewrite_time float8,
+    OUT wal_time float8,
+    OUT last_reclaim timestamptz,
+    OUT stats_reset timestamptz
+)
+RETURNS SETOF record
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_stats';
+
+CREATE FUNCTION reclaim_space_stats_reset()
+RETURNS void
+LANGUAGE C
+AS 'MODULE_PATHNAME', 'pg_index_reclaim_stats_reset';
+
+REVOKE ALL ON FUNCTION reclaim_space_stats_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_index_reclaim AS
+    SELECT s.indexrelid, c.relnamespace::regnamespace AS schemaname,
+           c.relname AS indexname,
+           s.calls, s.merges, s.pages_deleted, s.bytes_moved, s.wal_bytes,
+           s.aborted_sibling_mismatch, s.aborted_parent_mismatch,
+           s.aborted_out_of_space,
+           s.aborted_half_dead, s.aborted_deleted, s.aborted_not_leaf,
+           s.aborted_no_items, s.aborted_lock_busy, s.aborted_error,
+           s.lock_wait_time, s.throttle_time, s.analysis_time, s.merge_time,
+           s.descent_time, s.lock_time, s.scan_time, s.pairing_time,
+           s.rewrite_time, s.wal_time,
+           s.last_reclaim, s.stats_reset
+    FROM reclaim_space_stats() s
+         LEFT JOIN pg_class c ON c.oid = s.indexrelid
+    WHERE s.datid = (SELECT oid FROM pg_database
+                     WHERE datname = current_database());
+
+GRANT SELECT ON pg_stat_index_reclaim TO PUBLIC;
@@ -12,23 +12,56 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
+#include "access/generic_xlog.h"
 #include "access/nbtree.h"
 #include "access/nbtxlog.h"
+#include "access/parallel.h"
 #include "access/relscan.h"
+#include "access/table.h"
 #include "access/tableam.h"
+#include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "access/xloginsert.h"
+#include "access/xlogrecovery.h"
+#include "catalog/index.h"
+#include "catalog/objectaddress.h"
 #include "catalog/pg_am.h"
 #include "catalog/pg_class.h"
+#include "catalog/storage.h"
 #include "commands/vacuum.h"
+#include "common/int.h"
+#include "executor/instrument.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "optimizer/paths.h"
+#include "parser/parse_coerce.h"
+#include "port/atomics.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
 #include "storage/bufmgr.h"
 #include "storage/indexfsm.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/pg_lsn.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/sampling.h"
 #include "utils/snapmgr.h"
+#include "utils/wait_event.h"
+
+#include "pg_index_reclaim.h"
 
 PG_MODULE_MAGIC;
 
@@ -38,32 +71,323 @@ PG_MODULE_MAGIC;
 typedef struct PageAnalysis
 {
 	BlockNumber blockno;
+	BlockNumber prev_blkno;		/* btpo_prev as seen during the scan */
+	BlockNumber next_blkno;		/* btpo_next as seen during the scan */
 	bool		is_leaf;
 	bool		is_rightmost;
 	bool		is_deleted;
 	bool		is_halfdead;
 	Size		used_space;
+	Size		dedup_space;	/* used_space once deduplicated */
 	Size		free_space;
+	Size		hikey_size;		/* high key and its line pointer, if any */
 	int			item_count;
 	double		usage_pct;
+	bool		split_recently; /* btpo_cycleid set by a split */
+	XLogRecPtr	lsn;			/* page LSN when it was analyzed */
 } PageAnalysis;
 
+
+/*
+ * Maximum number of pages folded into one target by a single merge,
+ * including the target.  All of them stay locked for the whole merge.
+ */
+#define MAX_MERGE_RUN	16
+
 /*
- * Structure to hold merge candidate information
+ * Compact per-block summaries collected by the physical-order scan
+ *
+ * The summaries are kept as parallel arrays indexed by block number, 17
+ * bytes per block, all carved out of one allocation at base so that the
+ * whole set can also live in a DSM segment.  The pairing pass only touches
+ * the arrays it needs, which keeps them dense in the CPU caches.  flags
+ * holds the BS_* bits below and is zero for new or unrecognizable pages.
+ * used_space, dedup_space, hikey_size and item_count are only filled in for
+ * live leaf pages.  Page LSNs are not kept, so candidates found this way
+ * carry none.
  */
-typedef struct MergeCandidate
+typedef struct BlockSummaries
 {
-	BlockNumber left_page;
-	BlockNumber right_page;
-	double		left_usage_pct;
-	double		right_usage_pct;
-	int			total_items;
-	Size		estimated_space;
-	bool		can_merge;
-} MergeCandidate;
+	char	   *base;
+	BlockNumber *prev;
+	BlockNumber *next;
+	uint16	   *used_space;
+	uint16	   *dedup_space;
+	uint16	   *hikey_size;
+	uint16	   *item_count;
+	uint8	   *flags;
+} BlockSummaries;
+
+#define BS_LEAF			0x01
+#define BS_DELETED		0x02
+#define BS_HALF_DEAD	0x04
+#define BS_SPLIT		0x08	/* btpo_cycleid was set */
+
+#define BLOCK_SUMMARY_SIZE \
+	(2 * sizeof(BlockNumber) + 4 * sizeof(uint16) + sizeof(uint8))
+
+/*
+ * Shared state of a parallel physical-order scan, stored in the DSM
+ *
+ * Participants claim chunks of PARALLEL_SCAN_CHUNK blocks by advancing
+ * next_block and fill in the summaries of the blocks they read; the
+ * summary arrays for nblocks blocks follow the struct.
+ */
+typedef struct ReclaimParallelShared
+{
+	Oid			indexrelid;
+	BlockNumber nblocks;		/* scan the blocks below this */
+	pg_atomic_uint32 next_block;	/* first block of the next free chunk */
+	char		summaries[FLEXIBLE_ARRAY_MEMBER];
+} ReclaimParallelShared;
+
+#define PARALLEL_KEY_RECLAIM_SHARED		UINT64CONST(0xA000000000000001)
+
+/* Blocks handed to a parallel participant at a time */
+#define PARALLEL_SCAN_CHUNK		64
+
+PGDLLEXPORT void pg_index_reclaim_parallel_main(dsm_segment *seg, shm_toc *toc);
+
+/*
+ * Read-ahead state for the leaf sibling walk
+ *
+ * The sibling chain only reveals the next leaf once the current one has been
+ * read, so the walk cannot prefetch from the leaves themselves.  Instead we
+ * follow the level-1 pages, whose downlinks list the leaves in key order, and
+ * keep up to prefetch_distance of them in flight ahead of the cursor.
+ * Concurrent splits can make the two orders drift apart; that only costs a
+ * useless prefetch, since the walk itself still follows btpo_next.
+ */
+typedef struct LeafPrefetcher
+{
+	BlockNumber next_parent;	/* next level-1 page to harvest, or P_NONE */
+	BlockNumber downlinks[MaxIndexTuplesPerPage];
+	int			ndownlinks;
+	int			next_downlink;	/* next entry of downlinks[] to prefetch */
+	uint64		nissued;		/* leaves prefetched so far */
+} LeafPrefetcher;
+
+/* Buckets of the leaf fill histogram, 10% wide each */
+#define FILL_HISTOGRAM_BUCKETS	10
+
+/*
+ * State of a walk along the leaf level
+ *
+ * The walk can be suspended between any two pages, which lets
+ * reclaim_space() return the candidates as they are found.
+ */
+typedef struct LeafChainScan
+{
+	Relation	rel;
+	BlockNumber num_pages;
+	int			max_pct_to_merge;
+	XLogRecPtr	current_lsn;	/* see hot_page_current_lsn() */
+	uint32		level;			/* level walked, 0 for the leaves */
+	bool		deduplicate;	/* see merge_can_deduplicate() */
+	BufferAccessStrategy strategy;
+	bool		own_strategy;	/* did we create strategy? */
+	LeafPrefetcher *prefetcher;
+	BlockNumber blkno;			/* next leaf to read, or P_NONE */
+	BTScanInsert upper;			/* upper bound of the walk, or NULL */
+	BlockNumber pages_visited;
+	bool		have_prev;
+	PageAnalysis prev_page;		/* last leaf analyzed, if have_prev */
+
+	/* Statistics of the leaves analyzed so far */
+	BlockNumber leaf_pages;
+	uint64		used_space;
+	int64		fill_histogram[FILL_HISTOGRAM_BUCKETS];
+} LeafChainScan;
+
+/*
+ * Range of keys of the first index column that a leaf walk is confined to
+ *
+ * The bounds are insertion scan keys on that column alone: the walk
+ * descends to lower and stops at the first leaf whose high key is above
+ * upper.  Either may be NULL for no bound.  On a descending column, lower
+ * holds the larger value, as it comes first in the index.
+ */
+struct ReclaimKeyRange
+{
+	BTScanInsert lower;
+	BTScanInsert upper;
+};
+
+/* GUC variables */
+static int	prefetch_distance = 32;
+static bool trace_pages = false;
+static bool skip_locked = false;
+static int	max_wal_rate = 0;
+static int	max_replica_lag = 0;
+static int	hot_page_age = 0;
+static bool track_timing = false;
+
+/* Wait events of our sleeps, registered on first use */
+static uint32 wait_event_wal_rate = 0;
+static uint32 wait_event_replica_lag = 0;
+static uint32 wait_event_truncate = 0;
+
+/*
+ * Phases timed with track_timing, as reported in ReclaimIndexCounters
+ *
+ * The phases do not overlap: a page read during the walk counts as scan,
+ * and its pairing with the previous page as pairing only.  Taking the locks
+ * of a merge, waits or not, counts as lock, including the checks made on
+ * each page as it is locked and the parent's search for the downlink.
+ */
+typedef enum ReclaimTimedPhase
+{
+	TIMED_DESCENT,
+	TIMED_LOCK,
+	TIMED_SCAN,
+	TIMED_PAIRING,
+	TIMED_REWRITE,
+	TIMED_WAL,
+} ReclaimTimedPhase;
+
+#define NUM_TIMED_PHASES	(TIMED_WAL + 1)
+
+/* Time spent in each phase since the current reclaim_index() started */
+static instr_time phase_times[NUM_TIMED_PHASES];
+
+static inline void
+phase_timer_start(instr_time *start)
+{
+	if (track_timing)
+		INSTR_TIME_SET_CURRENT(*start);
+	else
+		INSTR_TIME_SET_ZERO(*start);
+}
+
+static inline void
+phase_timer_stop(ReclaimTimedPhase phase, instr_time start)
+{
+	instr_time	end;
+
+	if (!track_timing)
+		return;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(phase_times[phase], end, start);
+}
+
+/*
+ * Copy the phase times into the counters of a reclaim_index() call
+ */
+static void
+phase_times_report(ReclaimIndexCounters *counters)
+{
+	counters->descent_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_DESCENT]);
+	counters->lock_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_LOCK]);
+	counters->scan_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_SCAN]);
+	counters->pairing_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_PAIRING]);
+	counters->rewrite_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_REWRITE]);
+	counters->wal_time = INSTR_TIME_GET_MILLISEC(phase_times[TIMED_WAL]);
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("pg_index_reclaim.prefetch_distance",
+							"Number of leaf pages to prefetch ahead of the analysis scan.",
+							"Zero disables prefetching.",
+							&prefetch_distance,
+							32,
+							0,
+							1024,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_index_reclaim.trace_pages",
+							 "Log the contents of every page before and after a merge.",
+							 "The dumps are emitted at DEBUG1.",
+							 &trace_pages,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_index_reclaim.skip_locked",
+							 "Defer merges that would wait for a page locked by another session.",
+							 "Only the first page a merge locks, its left sibling if it has one, "
+							 "is waited for; merges that find any other page locked are retried "
+							 "once at the end of the call.",
+							 &skip_locked,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.max_wal_rate",
+							"Maximum rate at which merges write WAL, per second.",
+							"Zero disables the limit.",
+							&max_wal_rate,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.max_replica_lag",
+							"Replay lag of a standby at which merges pause.",
+							"Zero disables the check.",
+							&max_replica_lag,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.hot_page_age",
+							"Amount of WAL within which a written page counts as hot.",
+							"Merges of hot pages are expected to split again and are done "
+							"last, if at all.  Zero disables the check.",
+							&hot_page_age,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_index_reclaim.track_timing",
+							 "Collect the time merge runs spend in each of their phases.",
+							 "The times are shown in pg_stat_index_reclaim. Like "
+							 "track_io_timing, this reads the clock very often.",
+							 &track_timing,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	reclaim_worker_init();
+
+	MarkGUCPrefixReserved("pg_index_reclaim");
+}
 
 /*
- * Dump page contents for debugging (only active when DEBUG1 or higher is enabled)
+ * Dump page contents for debugging
+ *
+ * Only active when pg_index_reclaim.trace_pages is on and DEBUG1 messages
+ * would actually be emitted; otherwise the page is not even read, so merges
+ * pay nothing for this.
  */
 static void
 dump_page(Relation rel, BlockNumber blkno, const char *label)
@@ -74,6 +398,9 @@ dump_page(Relation rel, BlockNumber blkno, const char *label)
 	OffsetNumber maxoff;
 	OffsetNumber offnum;
 
+	if (!trace_pages || !message_level_is_interesting(DEBUG1))
+		return;
+
 	elog(DEBUG1, "pg_index_reclaim: ===== PAGE DUMP: %s (block %u) =====", label, blkno);
 
 	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
@@ -100,7 +427,8 @@ dump_page(Relation rel, BlockNumber blkno, const char *label)
 		 blkno, maxoff, ((PageHeader) page)->pd_lower, 
 		 ((PageHeader) page)->pd_upper, PageGetFreeSpace(page));
 
-	if (P_ISLEAF(opaque))
+	/* Deleted pages have no items, just their safexid */
+	if (P_ISLEAF(opaque) && !P_ISDELETED(opaque))
 	{
 		OffsetNumber firstdata = P_FIRSTDATAKEY(opaque);
 		int			item_count = 0;
@@ -128,10 +456,14 @@ dump_page(Relation rel, BlockNumber blkno, const char *label)
 }
 
 /*
- * Find the leftmost leaf page by traversing from root
+ * Find the leftmost page on a level of the tree by traversing from root
+ *
+ * Level 0 is the leaf level.  If parent is not NULL, the page one level up
+ * that the page was reached from is stored there (P_NONE when the page is
+ * the root).  Returns P_NONE if the tree has no such level.
  */
 static BlockNumber
-find_leftmost_leaf(Relation rel)
+find_leftmost_page(Relation rel, uint32 level, BlockNumber *parent)
 {
 	Buffer		metabuf;
 	BTMetaPageData *metad;
@@ -140,7 +472,10 @@ find_leftmost_leaf(Relation rel)
 	BTPageOpaque opaque;
 	BlockNumber blkno;
 
-	elog(DEBUG1, "pg_index_reclaim: Finding leftmost leaf page");
+	elog(DEBUG1, "pg_index_reclaim: Finding leftmost page on level %u", level);
+
+	if (parent)
+		*parent = P_NONE;
 
 	/* Get metapage */
 	metabuf = ReadBufferExtended(rel, MAIN_FORKNUM, BTREE_METAPAGE, RBM_NORMAL, NULL);
@@ -174,13 +509,20 @@ find_leftmost_leaf(Relation rel)
 			return P_NONE;
 		}
 
-		if (P_ISLEAF(opaque))
+		if (opaque->btpo_level == level)
 		{
-			elog(DEBUG1, "pg_index_reclaim: Found leftmost leaf page %u", blkno);
+			elog(DEBUG1, "pg_index_reclaim: Found leftmost page %u on level %u", blkno, level);
 			UnlockReleaseBuffer(buf);
 			return blkno;
 		}
 
+		if (P_ISLEAF(opaque) || opaque->btpo_level < level)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Index has no level %u", level);
+			UnlockReleaseBuffer(buf);
+			return P_NONE;
+		}
+
 		/* Internal page - get leftmost child */
 		/* For internal pages, the leftmost child is at P_FIRSTDATAKEY */
 		{
@@ -218,6 +560,8 @@ find_leftmost_leaf(Relation rel)
 
 			elog(DEBUG1, "pg_index_reclaim: Following downlink from page %u (level %u) to child %u", 
 				 blkno, opaque->btpo_level, child);
+			if (parent && opaque->btpo_level == level + 1)
+				*parent = blkno;
 			UnlockReleaseBuffer(buf);
 			blkno = child;
 		}
@@ -225,906 +569,3935 @@ find_leftmost_leaf(Relation rel)
 }
 
 /*
- * Analyze a B-tree index to find pages that can be merged
- * Traverses from root to leftmost leaf, then follows sibling links
+ * Collect the downlinks of the next live level-1 page into the prefetcher
+ *
+ * Returns false once the level-1 sibling chain is exhausted.
  */
-static void
-analyze_index_pages(Relation rel, List **merge_candidates, int max_pct_to_merge)
+static bool
+prefetch_load_parent(Relation rel, LeafPrefetcher *pf)
 {
-	BlockNumber num_pages;
-	BlockNumber blkno;
-	BufferAccessStrategy strategy;
-	PageAnalysis *pages;
-	int			total_pages = 0;
-	int			leaf_pages = 0;
-	BlockNumber leftmost_leaf;
-
-	elog(DEBUG1, "pg_index_reclaim: Starting page analysis");
-
-	/* Get total number of pages */
-	num_pages = RelationGetNumberOfBlocks(rel);
-	if (num_pages <= 1)		/* Only metapage */
-	{
-		elog(DEBUG1, "pg_index_reclaim: Index has only metapage, nothing to analyze");
-		return;
-	}
-
-	elog(DEBUG1, "pg_index_reclaim: Index has %u pages", num_pages);
-
-	/* Find leftmost leaf by traversing from root */
-	leftmost_leaf = find_leftmost_leaf(rel);
-	if (leftmost_leaf == P_NONE)
-	{
-		elog(WARNING, "pg_index_reclaim: Could not find leftmost leaf page");
-		return;
-	}
-
-	/* Allocate array to hold page analysis */
-	pages = (PageAnalysis *) palloc(sizeof(PageAnalysis) * num_pages);
-
-	/* Use a buffer access strategy for sequential scans */
-	strategy = GetAccessStrategy(BAS_BULKREAD);
-
-	/* Scan leaf pages following sibling links starting from leftmost */
-	blkno = leftmost_leaf;
-	elog(DEBUG1, "pg_index_reclaim: Starting leaf page scan from page %u", blkno);
-	
-	while (blkno != P_NONE && total_pages < num_pages)
+	while (pf->next_parent != P_NONE)
 	{
 		Buffer		buf;
 		Page		page;
 		BTPageOpaque opaque;
 		OffsetNumber maxoff;
-		Size		used_space = 0;
-		Size		free_space;
-		int			item_count = 0;
 		OffsetNumber offnum;
-		BlockNumber next_blkno;
 
-		/* Read the page */
-		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, pf->next_parent,
+								 RBM_NORMAL, NULL);
 		LockBuffer(buf, BT_READ);
-
 		page = BufferGetPage(buf);
-		
-		/* Check if page is new/uninitialized */
-		if (PageIsNew(page))
-		{
-			elog(WARNING, "pg_index_reclaim: Page %u is new/uninitialized, stopping scan", blkno);
-			UnlockReleaseBuffer(buf);
-			break;
-		}
 
-		/* Basic validation - check page header magic */
-		if (PageGetPageSize(page) != BLCKSZ)
+		if (PageIsNew(page))
 		{
-			elog(WARNING, "pg_index_reclaim: Page %u has invalid page size, stopping scan", blkno);
 			UnlockReleaseBuffer(buf);
-			break;
+			pf->next_parent = P_NONE;
+			return false;
 		}
 
 		opaque = BTPageGetOpaque(page);
 
-		/* Skip deleted pages */
-		if (P_ISDELETED(opaque))
-		{
-			elog(DEBUG1, "pg_index_reclaim: Page %u is deleted, skipping", blkno);
-			next_blkno = opaque->btpo_next;
-			UnlockReleaseBuffer(buf);
-			blkno = next_blkno;
-			continue;
-		}
-
-		/* Skip non-leaf pages (shouldn't happen if we started from leaf) */
-		if (!P_ISLEAF(opaque))
-		{
-			elog(WARNING, "pg_index_reclaim: Page %u is not a leaf (level %u), stopping scan", 
-				 blkno, opaque->btpo_level);
-			UnlockReleaseBuffer(buf);
-			break;
-		}
-
-		/* Skip half-dead pages (they'll be handled by VACUUM) */
-		if (P_ISHALFDEAD(opaque))
+		/* Give up if the chain no longer looks like level 1 */
+		if (opaque->btpo_level != 1 && !P_IGNORE(opaque))
 		{
-			elog(DEBUG1, "pg_index_reclaim: Page %u is half-dead, skipping", blkno);
-			next_blkno = opaque->btpo_next;
 			UnlockReleaseBuffer(buf);
-			blkno = next_blkno;
-			continue;
+			pf->next_parent = P_NONE;
+			return false;
 		}
 
-		/* Get next sibling for next iteration */
-		next_blkno = opaque->btpo_next;
-
-		/* Get page statistics */
-		maxoff = PageGetMaxOffsetNumber(page);
-		free_space = PageGetFreeSpace(page);
+		pf->next_parent = opaque->btpo_next;
+		pf->ndownlinks = 0;
+		pf->next_downlink = 0;
 
-		/* Calculate used space by summing item sizes */
-		for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff; offnum++)
+		if (!P_IGNORE(opaque))
 		{
-			ItemId		itemid = PageGetItemId(page, offnum);
-			Size		itemsize = MAXALIGN(ItemIdGetLength(itemid));
-
-			used_space += itemsize;
-			item_count++;
-		}
+			maxoff = PageGetMaxOffsetNumber(page);
+			for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff; offnum++)
+			{
+				IndexTuple	itup;
 
-		/* Store analysis */
-		pages[total_pages].blockno = blkno;
-		pages[total_pages].is_leaf = true;
-		pages[total_pages].is_rightmost = P_RIGHTMOST(opaque);
-		pages[total_pages].is_deleted = false;
-		pages[total_pages].is_halfdead = false;
-		pages[total_pages].item_count = item_count;
-		pages[total_pages].used_space = used_space;
-		pages[total_pages].free_space = free_space;
-		
-		/* Calculate usage percentage */
-		{
-			Size total_space = BLCKSZ - SizeOfPageHeaderData - 
-							   MAXALIGN(sizeof(BTPageOpaqueData));
-			if (total_space > 0)
-				pages[total_pages].usage_pct = 
-					(double) used_space / (double) total_space * 100.0;
-			else
-				pages[total_pages].usage_pct = 0.0;
+				itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offnum));
+				pf->downlinks[pf->ndownlinks++] = BTreeTupleGetDownLink(itup);
+			}
 		}
 
-		elog(DEBUG1, "pg_index_reclaim: Analyzed leaf page %u: %d items, %.2f%% usage, next=%u",
-			 blkno, item_count, pages[total_pages].usage_pct, next_blkno);
+		UnlockReleaseBuffer(buf);
 
-		total_pages++;
-		leaf_pages++;
+		if (pf->ndownlinks > 0)
+			return true;
+	}
 
-		UnlockReleaseBuffer(buf);
+	return false;
+}
 
-		/* Move to next sibling */
-		blkno = next_blkno;
+/*
+ * Keep prefetch_distance leaf reads in flight ahead of the walk
+ *
+ * leaves_read is the number of leaf pages the walk has visited, counting the
+ * one it is about to read.
+ */
+static void
+prefetch_leaves(Relation rel, LeafPrefetcher *pf, uint64 leaves_read)
+{
+	while (pf->nissued < leaves_read + prefetch_distance)
+	{
+		if (pf->next_downlink >= pf->ndownlinks &&
+			!prefetch_load_parent(rel, pf))
+			return;
+
+		/* Leaves the walk has already passed are not worth prefetching */
+		if (pf->nissued >= leaves_read)
+			(void) PrefetchBuffer(rel, MAIN_FORKNUM,
+								  pf->downlinks[pf->next_downlink]);
+		pf->next_downlink++;
+		pf->nissued++;
 	}
+}
 
-	elog(DEBUG1, "pg_index_reclaim: Scanned %d leaf pages", leaf_pages);
+/*
+ * Set up an empty candidate array in a memory context of its own
+ */
+void
+candidates_init(MergeCandidates *cands)
+{
+	cands->mcxt = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_index_reclaim candidates",
+										ALLOCSET_DEFAULT_SIZES);
+	cands->items = NULL;
+	cands->count = 0;
+	cands->capacity = 0;
+}
 
-	/* Now find merge candidates by checking actual sibling relationships */
+/*
+ * Append an uninitialized candidate to the array and return it
+ *
+ * The returned pointer is only valid until the next append.
+ */
+MergeCandidate *
+candidates_append(MergeCandidates *cands)
+{
+	if (cands->count >= cands->capacity)
 	{
-		int			i;
-		PageAnalysis *left_page;
-		PageAnalysis *right_page;
-		Buffer		left_buf;
-		Page		left_page_ptr;
-		BTPageOpaque left_opaque;
-		BlockNumber right_blockno;
-		int			j;
-		Size		combined_used;
-		Size		total_available;
-		Size		avg_item_size;
-		bool		can_merge;
+		int			newcap = cands->capacity > 0 ? cands->capacity * 2 : 256;
 
-		for (i = 0; i < total_pages; i++)
-		{
-			left_page = &pages[i];
+		if (cands->items == NULL)
+			cands->items = (MergeCandidate *)
+				MemoryContextAllocHuge(cands->mcxt, sizeof(MergeCandidate) * newcap);
+		else
+			cands->items = (MergeCandidate *)
+				repalloc_huge(cands->items, sizeof(MergeCandidate) * newcap);
+		cands->capacity = newcap;
+	}
 
-			/* Skip rightmost pages - they can't be merged */
-			if (left_page->is_rightmost)
-				continue;
+	return &cands->items[cands->count++];
+}
 
-			/* Get the actual right sibling from the page */
-			left_buf = ReadBufferExtended(rel, MAIN_FORKNUM, left_page->blockno,
-										  RBM_NORMAL, strategy);
-			LockBuffer(left_buf, BT_READ);
-			left_page_ptr = BufferGetPage(left_buf);
+/*
+ * Release a candidate array
+ */
+void
+candidates_free(MergeCandidates *cands)
+{
+	MemoryContextDelete(cands->mcxt);
+	cands->items = NULL;
+	cands->count = 0;
+	cands->capacity = 0;
+}
 
-			if (PageIsNew(left_page_ptr))
-			{
-				UnlockReleaseBuffer(left_buf);
-				continue;
-			}
+/*
+ * The WAL position that page ages are measured from
+ *
+ * Reading it takes the spinlock every WAL insertion takes, so callers read
+ * it once per walk and score all pages of the walk against it.  Returns
+ * InvalidXLogRecPtr when page ages are not needed, without a hot page age.
+ */
+static XLogRecPtr
+hot_page_current_lsn(void)
+{
+	if (hot_page_age <= 0)
+		return InvalidXLogRecPtr;
+	return RecoveryInProgress() ? GetXLogReplayRecPtr(NULL) :
+		GetXLogInsertRecPtr();
+}
 
-			left_opaque = BTPageGetOpaque(left_page_ptr);
-			right_blockno = left_opaque->btpo_next;
-			UnlockReleaseBuffer(left_buf);
+/*
+ * Estimate the chance that a page splits again soon after a merge fills it
+ *
+ * A page whose btpo_cycleid is still set was split while a VACUUM was
+ * running and has not been visited by one since: a sure sign of insert
+ * activity.  Otherwise, with hot_page_age set, a page written within that
+ * much WAL counts as hot in proportion to how recently it was written.
+ */
+static float
+page_split_risk(const PageAnalysis *pa, XLogRecPtr current_lsn)
+{
+	uint64		hot_bytes = (uint64) hot_page_age * 1024;
+	uint64		age;
+
+	if (pa->split_recently)
+		return 1.0;
+	if (hot_bytes == 0 || XLogRecPtrIsInvalid(pa->lsn))
+		return 0.0;
+	if (pa->lsn >= current_lsn)
+		return 1.0;
+
+	age = current_lsn - pa->lsn;
+	if (age >= hot_bytes)
+		return 0.0;
+	return 1.0 - (float) age / hot_bytes;
+}
 
-			if (right_blockno == P_NONE)
-				continue;
+/*
+ * Evaluate an adjacent pair of leaf pages and record it as a merge candidate
+ *
+ * The pair can be merged if the items of both pages, line pointers
+ * included, fit on the right page next to its high key, filled no fuller
+ * than the index's fillfactor, as a freshly built index would be.  The
+ * caller guarantees that left and right linked to each other when they were
+ * read.  current_lsn is the walk's hot_page_current_lsn().
+ */
+static void
+consider_merge_pair(Relation rel, PageAnalysis *left, PageAnalysis *right,
+					int max_pct_to_merge, XLogRecPtr current_lsn,
+					MergeCandidates *merge_candidates)
+{
+	Size		left_used;
+	Size		right_used;
+	Size		combined_used;
+	Size		total_available;
+	int			fillfactor;
+	bool		can_merge;
+	MergeCandidate *candidate;
+	instr_time	pairing_start;
 
-			/* Find the right page in our analysis array */
-			right_page = NULL;
-			for (j = 0; j < total_pages; j++)
-			{
-				if (pages[j].blockno == right_blockno)
-				{
-					right_page = &pages[j];
-					break;
-				}
-			}
+	/* Skip if either page is deleted or half-dead */
+	if (left->is_deleted || left->is_halfdead ||
+		right->is_deleted || right->is_halfdead)
+		return;
 
-			if (right_page == NULL)
-				continue;	/* Right page not in our analysis (might be new) */
+	/*
+	 * Both pages must be underutilized.  Folding a sparse page into a full
+	 * one frees a page too, but leaves a full page behind that the next
+	 * insert splits again.
+	 */
+	if (left->usage_pct > max_pct_to_merge ||
+		right->usage_pct > max_pct_to_merge)
+		return;
 
-			/* Skip if either page is deleted or half-dead */
-			if (left_page->is_deleted || left_page->is_halfdead ||
-				right_page->is_deleted || right_page->is_halfdead)
-				continue;
+	phase_timer_start(&pairing_start);
 
-			/* Check if both pages are underutilized */
-			if (left_page->usage_pct > max_pct_to_merge &&
-				right_page->usage_pct > max_pct_to_merge)
-				continue;
+	/*
+	 * Check if combined pages would fit.  On a deduplicating index the
+	 * merge folds equal keys into posting lists, so count the pages as
+	 * they would be after that.  Equal keys on both sides of the boundary
+	 * are folded too, but that is left to execute_merge() to find out.
+	 * Deduplication may also need fewer line pointers than item_count,
+	 * which only makes this estimate err on the safe side.
+	 */
+	left_used = left->dedup_space + left->item_count * sizeof(ItemIdData);
+	right_used = right->dedup_space + right->item_count * sizeof(ItemIdData);
+	combined_used = left_used + right_used;
+
+	/* The merged page keeps the right page's high key */
+	total_available = BLCKSZ - SizeOfPageHeaderData -
+		MAXALIGN(sizeof(BTPageOpaqueData)) - right->hikey_size;
+	fillfactor = right->is_leaf ? BTGetFillFactor(rel) : BTREE_NONLEAF_FILLFACTOR;
+	total_available = total_available * fillfactor / 100;
+	can_merge = (combined_used <= total_available);
+
+	/* Create merge candidate */
+	candidate = candidates_append(merge_candidates);
+	reclaim_progress_incr_param(RECLAIM_PROGRESS_CANDIDATES, 1);
+
+	candidate->left_page = left->blockno;
+	candidate->right_page = right->blockno;
+	candidate->left_usage_pct = left->usage_pct;
+	candidate->right_usage_pct = right->usage_pct;
+	candidate->total_items = left->item_count + right->item_count;
+	candidate->estimated_space = combined_used;
+	candidate->left_used = left_used;
+	candidate->right_used = right_used;
+	candidate->right_capacity = total_available;
+	candidate->split_risk = Max(page_split_risk(left, current_lsn),
+								page_split_risk(right, current_lsn));
+	candidate->can_merge = can_merge;
+	candidate->left_lsn = left->lsn;
+	candidate->right_lsn = right->lsn;
+
+	phase_timer_stop(TIMED_PAIRING, pairing_start);
+}
 
-			/* Check if combined pages would fit */
-			combined_used = left_page->used_space + right_page->used_space;
-			total_available = BLCKSZ - SizeOfPageHeaderData -
-				MAXALIGN(sizeof(BTPageOpaqueData));
+/*
+ * Deduplication of merged pages
+ *
+ * On an index that deduplicates, merges fold the tuples with equal keys of
+ * the pages they combine into posting list tuples, the way _bt_dedup_pass()
+ * does when a leaf page fills up.  This also catches duplicates that meet
+ * at the page boundary, so pages too full to be merged by raw size often
+ * fit once consolidated, and the merged page has room to spare left.
+ */
+typedef struct MergeDedupSpace
+{
+	Size		size;			/* aligned size of the tuples */
+	int			ntuples;
+} MergeDedupSpace;
 
-			/* Need space for high key if not rightmost */
-			if (!right_page->is_rightmost)
-			{
-				/* Estimate high key size - use average item size as approximation */
-				avg_item_size = right_page->item_count > 0 ?
-					right_page->used_space / right_page->item_count : 0;
-				total_available -= MAXALIGN(avg_item_size);
-			}
+static bool
+merge_can_deduplicate(Relation rel)
+{
+	bool		heapkeyspace;
+	bool		allequalimage;
 
-			/* Use 90% threshold to leave some headroom */
-			can_merge = (combined_used <= total_available * 0.9);
+	if (!BTGetDeduplicateItems(rel))
+		return false;
 
-			/* Create merge candidate */
-			{
-				MergeCandidate *candidate = (MergeCandidate *) palloc(sizeof(MergeCandidate));
+	_bt_metaversion(rel, &heapkeyspace, &allequalimage);
+	return heapkeyspace && allequalimage;
+}
 
-				candidate->left_page = left_page->blockno;
-				candidate->right_page = right_page->blockno;
-				candidate->left_usage_pct = left_page->usage_pct;
-				candidate->right_usage_pct = right_page->usage_pct;
-				candidate->total_items = left_page->item_count + right_page->item_count;
-				candidate->estimated_space = combined_used;
-				candidate->can_merge = can_merge;
+static void
+merge_dedup_begin(BTDedupState state, Page page)
+{
+	state->deduplicate = true;
+	state->nmaxitems = 0;
+	state->maxpostingsize = Min(BTMaxItemSize(page) / 2, INDEX_SIZE_MASK);
+	state->base = NULL;
+	state->baseoff = InvalidOffsetNumber;
+	state->basetupsize = 0;
+	state->htids = palloc(state->maxpostingsize);
+	state->nhtids = 0;
+	state->nitems = 0;
+	state->phystupsize = 0;
+	state->nintervals = 0;
+}
 
-				*merge_candidates = lappend(*merge_candidates, candidate);
-			}
-		}
+/*
+ * Finish the pending tuple, adding it to page dst if there is one, or else
+ * only adding its size to space
+ */
+static void
+merge_dedup_flush(BTDedupState state, Page dst, MergeDedupSpace *space)
+{
+	if (dst != NULL)
+	{
+		_bt_dedup_finish_pending(dst, state);
+		return;
 	}
 
-	pfree(pages);
-}
+	if (state->nitems == 1)
+		space->size += MAXALIGN(IndexTupleSize(state->base));
+	else
+		space->size += MAXALIGN(state->basetupsize +
+								state->nhtids * sizeof(ItemPointerData));
+	space->ntuples++;
 
-/* Parent page finding removed - VACUUM will fix parent links later */
+	state->nhtids = 0;
+	state->nitems = 0;
+	state->phystupsize = 0;
+}
 
 /*
- * Execute a merge of two pages
+ * Feed the data items of page src, from offset first onwards, to state
  *
- * Merges the contents of left_block into right_block, then marks
- * left_block as half-dead. VACUUM will later fully delete the page.
- *
- * WAL logging uses Full Page Images (FPI) via log_newpage_buffer() for
- * all modified pages. This is simpler than creating custom WAL records
- * and ensures crash safety.
+ * The items are expected in key order after those fed before.  Tuples that
+ * are ready go to dst or space, as for merge_dedup_flush(), which must be
+ * called at the end for the last pending tuple.
  */
-static bool
-execute_merge(Relation rel, BlockNumber left_block, BlockNumber right_block)
+static void
+merge_dedup_items(Relation rel, BTDedupState state, Page dst, Page src,
+				  OffsetNumber first, MergeDedupSpace *space)
 {
-	Buffer		left_buf;
-	Buffer		right_buf;
-	Buffer		right_sibling_buf = InvalidBuffer;
-	Buffer		left_sibling_buf = InvalidBuffer;
-	Page		left_page;
-	Page		right_page;
-	Page		left_sibling_page = NULL;
-	BTPageOpaque left_opaque;
-	BTPageOpaque right_opaque;
-	BTPageOpaque right_sibling_opaque = NULL;
-	BTPageOpaque left_sibling_opaque = NULL;
-	OffsetNumber left_maxoff;
-	OffsetNumber right_maxoff;
-	OffsetNumber left_firstdata;
-	OffsetNumber right_firstdata;
+	int			nkeyatts = IndexRelationGetNumberOfKeyAttributes(rel);
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(src);
 	OffsetNumber offnum;
-	ItemId		itemid;
-	bool		is_rightmost;
-	BlockNumber leftsib;
-	BlockNumber rightsib;
-	bool		needswal = RelationNeedsWAL(rel);
 
-	/* Pre-allocated arrays for items - allocated before critical section */
-	OffsetNumber *left_offsets = NULL;
-	OffsetNumber *deletable = NULL;
-	int			nleft_items = 0;
-	int			ndeletable = 0;
-	Size		left_items_total_size = 0;
+	for (offnum = first; offnum <= maxoff; offnum++)
+	{
+		ItemId		itemid = PageGetItemId(src, offnum);
+		IndexTuple	itup;
 
-	elog(DEBUG1, "pg_index_reclaim: ========================================");
-	elog(DEBUG1, "pg_index_reclaim: Starting merge of pages %u -> %u in index \"%s\"",
-		 left_block, right_block, RelationGetRelationName(rel));
-	elog(DEBUG1, "pg_index_reclaim: ========================================");
+		if (!ItemIdIsUsed(itemid))
+			continue;
 
-	/* Dump pages BEFORE merge */
-	dump_page(rel, left_block, "LEFT PAGE (BEFORE MERGE)");
-	dump_page(rel, right_block, "RIGHT PAGE (BEFORE MERGE)");
+		itup = (IndexTuple) PageGetItem(src, itemid);
 
-	/* Lock pages left-to-right to avoid deadlocks */
-	elog(DEBUG1, "pg_index_reclaim: Locking left page %u", left_block);
-	left_buf = ReadBufferExtended(rel, MAIN_FORKNUM, left_block, RBM_NORMAL, NULL);
-	LockBuffer(left_buf, BT_WRITE);
-	left_page = BufferGetPage(left_buf);
+		if (state->nitems > 0 &&
+			_bt_keep_natts_fast(rel, state->base, itup) > nkeyatts &&
+			_bt_dedup_save_htid(state, itup))
+			continue;
 
-	if (PageIsNew(left_page))
+		if (state->nitems > 0)
+			merge_dedup_flush(state, dst, space);
+		_bt_dedup_start_pending(state, itup, offnum);
+	}
+}
+
+/*
+ * Measure the data items of pages[0..npages-1], in this order, once
+ * deduplicated
+ */
+static void
+merge_dedup_measure(Relation rel, Page *pages, int npages,
+					MergeDedupSpace *space)
+{
+	BTDedupStateData state;
+	int			i;
+
+	space->size = 0;
+	space->ntuples = 0;
+
+	merge_dedup_begin(&state, pages[0]);
+	for (i = 0; i < npages; i++)
+		merge_dedup_items(rel, &state, NULL, pages[i],
+						  P_FIRSTDATAKEY(BTPageGetOpaque(pages[i])), space);
+	if (state.nitems > 0)
+		merge_dedup_flush(&state, NULL, space);
+	pfree(state.htids);
+}
+
+/*
+ * Fill pa with the space accounting of a live leaf page, or of a live
+ * internal page when merging internal levels
+ *
+ * If deduplicate is set, as merge_can_deduplicate() tells, the page is
+ * also measured as a merge would leave it.  The caller must hold at least
+ * a share lock on the page.
+ */
+static void
+analyze_leaf_page(Relation rel, Page page, BlockNumber blkno,
+				  bool deduplicate, PageAnalysis *pa)
+{
+	BTPageOpaque opaque = BTPageGetOpaque(page);
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+	OffsetNumber offnum;
+	Size		used_space = 0;
+	int			item_count = 0;
+	Size		total_space;
+
+	/* Calculate used space by summing item sizes */
+	for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff; offnum++)
 	{
-		elog(DEBUG1, "pg_index_reclaim: Left page %u is new/uninitialized, aborting", left_block);
-		UnlockReleaseBuffer(left_buf);
+		ItemId		itemid = PageGetItemId(page, offnum);
+		Size		itemsize = MAXALIGN(ItemIdGetLength(itemid));
+
+		used_space += itemsize;
+		item_count++;
+	}
+
+	pa->blockno = blkno;
+	pa->prev_blkno = opaque->btpo_prev;
+	pa->next_blkno = opaque->btpo_next;
+	pa->is_leaf = P_ISLEAF(opaque);
+	pa->is_rightmost = P_RIGHTMOST(opaque);
+	pa->is_deleted = false;
+	pa->is_halfdead = false;
+	pa->item_count = item_count;
+	pa->used_space = used_space;
+	pa->dedup_space = used_space;
+	if (deduplicate && item_count > 1)
+	{
+		MergeDedupSpace space;
+
+		merge_dedup_measure(rel, &page, 1, &space);
+		pa->dedup_space = space.size;
+	}
+	pa->free_space = PageGetFreeSpace(page);
+	pa->hikey_size = P_RIGHTMOST(opaque) ? 0 :
+		MAXALIGN(ItemIdGetLength(PageGetItemId(page, P_HIKEY))) + sizeof(ItemIdData);
+	pa->split_recently = (opaque->btpo_cycleid != 0);
+	pa->lsn = PageGetLSN(page);
+
+	/* Calculate usage percentage */
+	total_space = BLCKSZ - SizeOfPageHeaderData -
+		MAXALIGN(sizeof(BTPageOpaqueData));
+	if (total_space > 0)
+		pa->usage_pct = (double) used_space / (double) total_space * 100.0;
+	else
+		pa->usage_pct = 0.0;
+}
+
+/*
+ * Find the leaf where the keys at or after key begin, as _bt_first() does
+ *
+ * The level-1 page the leaf was reached from is stored in *parent (P_NONE
+ * when the leaf is the root).  Returns P_NONE if the index is empty.
+ */
+static BlockNumber
+find_range_start(Relation rel, BTScanInsert key, BlockNumber *parent)
+{
+	BTStack		stack;
+	Buffer		buf;
+	BlockNumber blkno;
+
+	*parent = P_NONE;
+
+	stack = _bt_search(rel, NULL, key, &buf, BT_READ);
+	if (!BufferIsValid(buf))
+	{
+		elog(DEBUG1, "pg_index_reclaim: Index has no root page");
+		return P_NONE;
+	}
+
+	blkno = BufferGetBlockNumber(buf);
+	if (stack != NULL)
+		*parent = stack->bts_blkno;
+	_bt_relbuf(rel, buf);
+	_bt_freestack(stack);
+
+	elog(DEBUG1, "pg_index_reclaim: Key range starts on leaf page %u", blkno);
+
+	return blkno;
+}
+
+/*
+ * Start a walk along a level of the tree at its leftmost page
+ *
+ * The leaf level is level 0; higher levels are walked the same way, to
+ * merge sparse internal pages.  If range is not NULL, the walk of the
+ * leaves is confined to it.  Pages are read through strategy, or through a
+ * bulk-read ring of the walk's own if it is NULL.  Returns false if there
+ * is no page to start from.
+ */
+static bool
+leaf_chain_scan_begin(LeafChainScan *scan, Relation rel, BlockNumber num_pages,
+					  int max_pct_to_merge, uint32 level,
+					  const ReclaimKeyRange *range, BufferAccessStrategy strategy)
+{
+	BlockNumber leftmost_leaf;
+	BlockNumber leftmost_parent;
+	bool		bounded = (range != NULL && range->lower != NULL);
+	instr_time	descent_start;
+
+	Assert(range == NULL || level == 0);
+
+	/* Find leftmost page by traversing from root */
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_DESCENDING);
+	phase_timer_start(&descent_start);
+	if (bounded)
+		leftmost_leaf = find_range_start(rel, range->lower, &leftmost_parent);
+	else
+		leftmost_leaf = find_leftmost_page(rel, level, &leftmost_parent);
+	phase_timer_stop(TIMED_DESCENT, descent_start);
+	if (leftmost_leaf == P_NONE)
+	{
+		if (level == 0 && !bounded)
+			elog(WARNING, "pg_index_reclaim: Could not find leftmost leaf page");
 		return false;
 	}
 
-	left_opaque = BTPageGetOpaque(left_page);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_SCANNING);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, num_pages);
+
+	scan->rel = rel;
+	scan->num_pages = num_pages;
+	scan->max_pct_to_merge = max_pct_to_merge;
+	scan->current_lsn = hot_page_current_lsn();
+	scan->level = level;
+	scan->deduplicate = (level == 0 && merge_can_deduplicate(rel));
+	scan->prefetcher = NULL;
+	scan->blkno = leftmost_leaf;
+	scan->upper = range != NULL ? range->upper : NULL;
+	scan->pages_visited = 0;
+	scan->have_prev = false;
+	scan->leaf_pages = 0;
+	scan->used_space = 0;
+	memset(scan->fill_histogram, 0, sizeof(scan->fill_histogram));
+
+	/*
+	 * A single-leaf index has nothing to read ahead, and internal levels
+	 * are small enough to do without
+	 */
+	if (prefetch_distance > 0 && level == 0 && leftmost_parent != P_NONE)
+	{
+		LeafPrefetcher *pf;
+
+		pf = scan->prefetcher = (LeafPrefetcher *) palloc0(sizeof(LeafPrefetcher));
+		pf->next_parent = leftmost_parent;
+
+		/* Starting in the middle of the parent, skip the leaves before */
+		if (bounded && prefetch_load_parent(rel, pf))
+		{
+			while (pf->next_downlink < pf->ndownlinks &&
+				   pf->downlinks[pf->next_downlink] != leftmost_leaf)
+				pf->next_downlink++;
+			if (pf->next_downlink >= pf->ndownlinks)
+				pf->next_downlink = 0;
+		}
+	}
+
+	/* Use a buffer access strategy for sequential scans */
+	scan->own_strategy = (strategy == NULL);
+	scan->strategy = scan->own_strategy ? GetAccessStrategy(BAS_BULKREAD) : strategy;
+
+	elog(DEBUG1, "pg_index_reclaim: Starting scan of level %u from page %u",
+		 level, leftmost_leaf);
+
+	return true;
+}
+
+/*
+ * Continue the leaf walk until it has found at least one more merge
+ * candidate
+ *
+ * The walk pairs each leaf with the previously analyzed one as soon as it is
+ * read, provided the two pages' sibling links agree, and adds the pair to
+ * merge_candidates if it qualifies.  Returns false once the leaf level is
+ * exhausted without finding another candidate.
+ */
+static bool
+leaf_chain_scan_next(LeafChainScan *scan, MergeCandidates *merge_candidates)
+{
+	Relation	rel = scan->rel;
+	BlockNumber blkno = scan->blkno;
+	PageAnalysis cur_page;
+	int			ncandidates = merge_candidates->count;
+	bool		past_upper;
+	instr_time	scan_start;
+
+	phase_timer_start(&scan_start);
+
+	/* A sane sibling chain cannot be longer than the relation */
+	while (blkno != P_NONE && scan->pages_visited++ < scan->num_pages)
+	{
+		Buffer		buf;
+		Page		page;
+		BTPageOpaque opaque;
+		BlockNumber next_blkno;
+
+		/* Sleeps only if cost-based delay is active, as in the worker */
+		vacuum_delay_point(false);
+
+		if (scan->prefetcher)
+			prefetch_leaves(rel, scan->prefetcher, scan->pages_visited);
+		reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_SCANNED,
+									  scan->pages_visited);
+
+		/* Read the page */
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, scan->strategy);
+		LockBuffer(buf, BT_READ);
+
+		page = BufferGetPage(buf);
+		
+		/* Check if page is new/uninitialized */
+		if (PageIsNew(page))
+		{
+			elog(WARNING, "pg_index_reclaim: Page %u is new/uninitialized, stopping scan", blkno);
+			UnlockReleaseBuffer(buf);
+			blkno = P_NONE;
+			break;
+		}
+
+		/* Basic validation - check page header magic */
+		if (PageGetPageSize(page) != BLCKSZ)
+		{
+			elog(WARNING, "pg_index_reclaim: Page %u has invalid page size, stopping scan", blkno);
+			UnlockReleaseBuffer(buf);
+			blkno = P_NONE;
+			break;
+		}
+
+		opaque = BTPageGetOpaque(page);
+
+		/* Skip deleted pages */
+		if (P_ISDELETED(opaque))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is deleted, skipping", blkno);
+			next_blkno = opaque->btpo_next;
+			UnlockReleaseBuffer(buf);
+			blkno = next_blkno;
+			scan->have_prev = false;
+			continue;
+		}
+
+		/* Stop at pages of other levels (shouldn't happen on a sibling chain) */
+		if (opaque->btpo_level != scan->level || P_ISLEAF(opaque) != (scan->level == 0))
+		{
+			elog(WARNING, "pg_index_reclaim: Page %u is not on level %u (level %u), stopping scan",
+				 blkno, scan->level, opaque->btpo_level);
+			UnlockReleaseBuffer(buf);
+			blkno = P_NONE;
+			break;
+		}
+
+		/* Skip half-dead pages (they'll be handled by VACUUM) */
+		if (P_ISHALFDEAD(opaque))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is half-dead, skipping", blkno);
+			next_blkno = opaque->btpo_next;
+			UnlockReleaseBuffer(buf);
+			blkno = next_blkno;
+			scan->have_prev = false;
+			continue;
+		}
+
+		analyze_leaf_page(rel, page, blkno, scan->deduplicate, &cur_page);
+
+		/* Above the upper bound, nothing to the right is in the range */
+		past_upper = (scan->upper != NULL && !P_RIGHTMOST(opaque) &&
+					  _bt_compare(rel, scan->upper, page, P_HIKEY) < 0);
+		UnlockReleaseBuffer(buf);
+
+		elog(DEBUG1, "pg_index_reclaim: Analyzed leaf page %u: %d items, %.2f%% usage, prev=%u, next=%u",
+			 blkno, cur_page.item_count, cur_page.usage_pct,
+			 cur_page.prev_blkno, cur_page.next_blkno);
+
+		/*
+		 * Pair with the previous leaf if both links agree.  A mismatch means
+		 * a concurrent split or deletion happened between the two reads;
+		 * execute_merge() would reject such a pair anyway.
+		 */
+		if (scan->have_prev &&
+			scan->prev_page.next_blkno == blkno &&
+			cur_page.prev_blkno == scan->prev_page.blockno)
+		{
+			phase_timer_stop(TIMED_SCAN, scan_start);
+			consider_merge_pair(rel, &scan->prev_page, &cur_page,
+								scan->max_pct_to_merge, scan->current_lsn,
+								merge_candidates);
+			phase_timer_start(&scan_start);
+		}
+
+		scan->prev_page = cur_page;
+		scan->have_prev = true;
+		scan->leaf_pages++;
+		scan->used_space += cur_page.used_space;
+		scan->fill_histogram[Min((int) (cur_page.usage_pct / 10),
+								 FILL_HISTOGRAM_BUCKETS - 1)]++;
+
+		/* Move to next sibling */
+		blkno = past_upper ? P_NONE : cur_page.next_blkno;
+
+		if (merge_candidates->count > ncandidates)
+			break;
+	}
+
+	scan->blkno = blkno;
+	phase_timer_stop(TIMED_SCAN, scan_start);
+
+	return merge_candidates->count > ncandidates;
+}
+
+/*
+ * Release the resources of a leaf walk
+ */
+static void
+leaf_chain_scan_end(LeafChainScan *scan, MergeCandidates *merge_candidates)
+{
+	elog(DEBUG1, "pg_index_reclaim: Scanned %u leaf pages, found %d merge candidates",
+		 scan->leaf_pages, merge_candidates->count);
+
+	if (scan->prefetcher)
+		pfree(scan->prefetcher);
+	if (scan->own_strategy)
+		FreeAccessStrategy(scan->strategy);
+}
+
+/*
+ * Find merge candidates by walking a level along its sibling links
+ *
+ * The scan visits pages in key order and streams: only the previously
+ * analyzed page is remembered.  Every page is therefore read and
+ * share-locked exactly once.
+ */
+static void
+analyze_leaf_chain(Relation rel, BlockNumber num_pages,
+				   MergeCandidates *merge_candidates, int max_pct_to_merge,
+				   uint32 level, const ReclaimKeyRange *range,
+				   BufferAccessStrategy strategy)
+{
+	LeafChainScan scan;
+
+	if (!leaf_chain_scan_begin(&scan, rel, num_pages, max_pct_to_merge, level,
+							   range, strategy))
+		return;
+
+	while (leaf_chain_scan_next(&scan, merge_candidates))
+		;
+
+	leaf_chain_scan_end(&scan, merge_candidates);
+}
+
+/*
+ * Point the summary arrays for nblocks blocks into the memory at base
+ */
+static void
+block_summaries_attach(BlockSummaries *bs, char *base, BlockNumber nblocks)
+{
+	bs->base = base;
+	bs->prev = (BlockNumber *) base;
+	bs->next = bs->prev + nblocks;
+	bs->used_space = (uint16 *) (bs->next + nblocks);
+	bs->dedup_space = bs->used_space + nblocks;
+	bs->hikey_size = bs->dedup_space + nblocks;
+	bs->item_count = bs->hikey_size + nblocks;
+	bs->flags = (uint8 *) (bs->item_count + nblocks);
+}
+
+static void
+block_summaries_alloc(BlockSummaries *bs, BlockNumber nblocks)
+{
+	block_summaries_attach(bs,
+						   palloc_extended(mul_size(BLOCK_SUMMARY_SIZE, nblocks),
+										   MCXT_ALLOC_HUGE),
+						   nblocks);
+}
+
+/*
+ * Copy the summaries of blocks [start, end) from src to dst
+ */
+static void
+block_summaries_copy(BlockSummaries *dst, const BlockSummaries *src,
+					 BlockNumber start, BlockNumber end)
+{
+	Size		n = end - start;
+
+	memcpy(&dst->prev[start], &src->prev[start], n * sizeof(BlockNumber));
+	memcpy(&dst->next[start], &src->next[start], n * sizeof(BlockNumber));
+	memcpy(&dst->used_space[start], &src->used_space[start], n * sizeof(uint16));
+	memcpy(&dst->dedup_space[start], &src->dedup_space[start], n * sizeof(uint16));
+	memcpy(&dst->hikey_size[start], &src->hikey_size[start], n * sizeof(uint16));
+	memcpy(&dst->item_count[start], &src->item_count[start], n * sizeof(uint16));
+	memcpy(&dst->flags[start], &src->flags[start], n * sizeof(uint8));
+}
+
+/*
+ * Enlarge summaries for oldn blocks to hold newn blocks
+ */
+static void
+block_summaries_grow(BlockSummaries *bs, BlockNumber oldn, BlockNumber newn)
+{
+	BlockSummaries old = *bs;
+
+	block_summaries_alloc(bs, newn);
+	block_summaries_copy(bs, &old, 0, oldn);
+	pfree(old.base);
+}
+
+/*
+ * Read blocks [start, end) in physical order into the summaries
+ *
+ * Pages that are new, or that don't look like B-tree pages, are recorded
+ * with zero flags so that the adjacency pass ignores them.
+ */
+static void
+scan_block_range(Relation rel, BlockNumber start, BlockNumber end,
+				 BufferAccessStrategy strategy, BlockSummaries *bs)
+{
+	bool		deduplicate = merge_can_deduplicate(rel);
+	BlockNumber blkno;
+	instr_time	scan_start;
+
+	phase_timer_start(&scan_start);
+
+	for (blkno = start; blkno < end; blkno++)
+	{
+		Buffer		buf;
+		Page		page;
+		BTPageOpaque opaque;
+		uint8		flags = 0;
+
+		vacuum_delay_point(false);
+
+		bs->prev[blkno] = P_NONE;
+		bs->next[blkno] = P_NONE;
+		bs->used_space[blkno] = 0;
+		bs->dedup_space[blkno] = 0;
+		bs->hikey_size[blkno] = 0;
+		bs->item_count[blkno] = 0;
+		bs->flags[blkno] = 0;
+
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		LockBuffer(buf, BT_READ);
+		page = BufferGetPage(buf);
+
+		if (PageIsNew(page) || PageGetPageSize(page) != BLCKSZ)
+		{
+			UnlockReleaseBuffer(buf);
+			continue;
+		}
+
+		opaque = BTPageGetOpaque(page);
+		bs->prev[blkno] = opaque->btpo_prev;
+		bs->next[blkno] = opaque->btpo_next;
+
+		if (P_ISLEAF(opaque))
+			flags |= BS_LEAF;
+		if (P_ISDELETED(opaque))
+			flags |= BS_DELETED;
+		if (P_ISHALFDEAD(opaque))
+			flags |= BS_HALF_DEAD;
+		if (opaque->btpo_cycleid != 0)
+			flags |= BS_SPLIT;
+		bs->flags[blkno] = flags;
+
+		if (P_ISLEAF(opaque) && !P_IGNORE(opaque))
+		{
+			PageAnalysis pa;
+
+			analyze_leaf_page(rel, page, blkno, deduplicate, &pa);
+			bs->item_count[blkno] = pa.item_count;
+			bs->used_space[blkno] = pa.used_space;
+			bs->dedup_space[blkno] = pa.dedup_space;
+			bs->hikey_size[blkno] = pa.hikey_size;
+		}
+
+		UnlockReleaseBuffer(buf);
+		reclaim_progress_incr_param(RECLAIM_PROGRESS_PAGES_SCANNED, 1);
+	}
+
+	phase_timer_stop(TIMED_SCAN, scan_start);
+}
+
+/*
+ * Scan chunks of the shared block range until none are left
+ */
+static void
+parallel_scan_chunks(Relation rel, ReclaimParallelShared *shared)
+{
+	BufferAccessStrategy strategy = GetAccessStrategy(BAS_BULKREAD);
+	BlockSummaries bs;
+
+	block_summaries_attach(&bs, shared->summaries, shared->nblocks);
+
+	for (;;)
+	{
+		BlockNumber start;
+
+		start = pg_atomic_fetch_add_u32(&shared->next_block, PARALLEL_SCAN_CHUNK);
+		if (start >= shared->nblocks)
+			break;
+
+		scan_block_range(rel, start,
+						 Min(start + PARALLEL_SCAN_CHUNK, shared->nblocks),
+						 strategy, &bs);
+	}
+
+	FreeAccessStrategy(strategy);
+}
+
+/*
+ * Entry point of the parallel workers of a physical-order scan
+ */
+void
+pg_index_reclaim_parallel_main(dsm_segment *seg, shm_toc *toc)
+{
+	ReclaimParallelShared *shared;
+	Relation	rel;
+
+	shared = (ReclaimParallelShared *) shm_toc_lookup(toc, PARALLEL_KEY_RECLAIM_SHARED, false);
+
+	/* The leader holds the same lock, so this cannot block */
+	rel = index_open(shared->indexrelid, AccessShareLock);
+	parallel_scan_chunks(rel, shared);
+	index_close(rel, AccessShareLock);
+}
+
+/*
+ * Summarize blocks 1..num_pages-1 with the help of up to nworkers workers
+ *
+ * As parallel CREATE INDEX and VACUUM do, this sets up a ParallelContext
+ * whose DSM segment holds the summary arrays; the leader takes chunks of
+ * the range like any worker.  The result is copied into summaries.
+ * Returns the number of workers that were actually launched; if none
+ * could be, the leader simply scans everything itself.
+ */
+static int
+scan_blocks_parallel(Relation rel, BlockNumber num_pages, int nworkers,
+					 BlockSummaries *summaries)
+{
+	ParallelContext *pcxt;
+	ReclaimParallelShared *shared;
+	BlockSummaries shared_bs;
+	Size		size;
+	int			nlaunched;
+
+	size = add_size(offsetof(ReclaimParallelShared, summaries),
+					mul_size(BLOCK_SUMMARY_SIZE, num_pages));
+
+	EnterParallelMode();
+	pcxt = CreateParallelContext("pg_index_reclaim",
+								 "pg_index_reclaim_parallel_main", nworkers);
+	shm_toc_estimate_chunk(&pcxt->estimator, size);
+	shm_toc_estimate_keys(&pcxt->estimator, 1);
+	InitializeParallelDSM(pcxt);
+
+	shared = (ReclaimParallelShared *) shm_toc_allocate(pcxt->toc, size);
+	shared->indexrelid = RelationGetRelid(rel);
+	shared->nblocks = num_pages;
+	pg_atomic_init_u32(&shared->next_block, BTREE_METAPAGE + 1);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_RECLAIM_SHARED, shared);
+
+	LaunchParallelWorkers(pcxt);
+	nlaunched = pcxt->nworkers_launched;
+
+	parallel_scan_chunks(rel, shared);
+	WaitForParallelWorkersToFinish(pcxt);
+
+	block_summaries_attach(&shared_bs, shared->summaries, num_pages);
+	block_summaries_copy(summaries, &shared_bs, BTREE_METAPAGE + 1, num_pages);
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return nlaunched;
+}
+
+/*
+ * Rebuild a PageAnalysis from a block summary
+ */
+static void
+summary_to_analysis(const BlockSummaries *bs, BlockNumber blkno, PageAnalysis *pa)
+{
+	Size		total_space = BLCKSZ - SizeOfPageHeaderData -
+		MAXALIGN(sizeof(BTPageOpaqueData));
+	Size		used_space = bs->used_space[blkno];
+
+	pa->blockno = blkno;
+	pa->prev_blkno = bs->prev[blkno];
+	pa->next_blkno = bs->next[blkno];
+	pa->is_leaf = true;
+	pa->is_rightmost = (bs->next[blkno] == P_NONE);
+	pa->is_deleted = false;
+	pa->is_halfdead = false;
+	pa->item_count = bs->item_count[blkno];
+	pa->used_space = used_space;
+	pa->dedup_space = bs->dedup_space[blkno];
+	pa->free_space = total_space - Min(total_space, used_space);
+	pa->hikey_size = bs->hikey_size[blkno];
+	pa->usage_pct = (double) used_space / (double) total_space * 100.0;
+	pa->split_recently = (bs->flags[blkno] & BS_SPLIT) != 0;
+	pa->lsn = InvalidXLogRecPtr;
+}
+
+/*
+ * Find merge candidates from a physical-order scan of the whole index
+ *
+ * Like btvacuumscan(), every block after the metapage is read in block
+ * order under a BAS_BULKREAD ring, which turns the random I/O of the
+ * sibling walk into sequential I/O.  Only a compact summary of each block
+ * is kept; the leaf chain is then rebuilt in memory from the prev/next
+ * links, so candidates come out in the same key order as the walk would
+ * produce them.  Leaves that are not reachable along the chain and
+ * half-dead pages, which the walk never sees, are counted and reported.
+ */
+static void
+analyze_physical(Relation rel, BlockNumber num_pages,
+				 MergeCandidates *merge_candidates, int max_pct_to_merge)
+{
+	BufferAccessStrategy strategy;
+	BlockSummaries summaries;
+	BlockNumber scanned;
+	BlockNumber blkno;
+	BlockNumber leftmost = P_NONE;
+	BlockNumber steps = 0;
+	PageAnalysis prev_page;
+	PageAnalysis cur_page;
+	bool		have_prev = false;
+	XLogRecPtr	current_lsn;
+	int			live_leaves = 0;
+	int			chained_leaves = 0;
+	int			halfdead_pages = 0;
+	int			deleted_pages = 0;
+	int			nworkers = 0;
+
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+	block_summaries_alloc(&summaries, num_pages);
+
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_SCANNING);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, num_pages);
+
+	/*
+	 * Split the first pass among parallel workers if the index is large
+	 * enough to be worth it.  Workers cannot see the local buffers of
+	 * temporary indexes.
+	 */
+	if (num_pages > BTREE_METAPAGE + 1 &&
+		num_pages >= (BlockNumber) min_parallel_index_scan_size &&
+		!RelationUsesLocalBuffers(rel) && !IsInParallelMode())
+		nworkers = max_parallel_maintenance_workers;
+
+	scanned = BTREE_METAPAGE + 1;
+	if (nworkers > 0)
+	{
+		int			nlaunched;
+
+		nlaunched = scan_blocks_parallel(rel, num_pages, nworkers, &summaries);
+		elog(DEBUG1, "pg_index_reclaim: Physical scan of %u blocks used %d of %d requested parallel workers",
+			 num_pages, nlaunched, nworkers);
+		scanned = num_pages;
+		reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_SCANNED, scanned);
+	}
+
+	/*
+	 * Pages split off while we scan are appended at the end of the
+	 * relation.  As btvacuumscan() does, keep scanning until the relation
+	 * stops growing, so that no right-link points past the array.
+	 */
+	for (;;)
+	{
+		scan_block_range(rel, scanned, num_pages, strategy, &summaries);
+		scanned = num_pages;
+
+		num_pages = RelationGetNumberOfBlocks(rel);
+		if (num_pages <= scanned)
+			break;
+		block_summaries_grow(&summaries, scanned, num_pages);
+		reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, num_pages);
+	}
+	num_pages = scanned;
+
+	FreeAccessStrategy(strategy);
+
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_PAIRING);
+
+	/*
+	 * Count page states and find the leftmost leaf.  That is the leaf
+	 * without a left sibling even if it is half-dead: it stays linked in
+	 * until VACUUM unlinks it, and the live leaf right of it still has it
+	 * as its left sibling.  The walk below steps over it.
+	 */
+	for (blkno = BTREE_METAPAGE + 1; blkno < num_pages; blkno++)
+	{
+		uint8		flags = summaries.flags[blkno];
+
+		if (flags & BS_DELETED)
+		{
+			deleted_pages++;
+			continue;
+		}
+		if (!(flags & BS_LEAF))
+			continue;
+
+		if (flags & BS_HALF_DEAD)
+			halfdead_pages++;
+		else
+			live_leaves++;
+		if (summaries.prev[blkno] == P_NONE && leftmost == P_NONE)
+			leftmost = blkno;
+	}
+
+	/* Walk the leaf chain in memory, pairing neighbours as the walk would */
+	current_lsn = hot_page_current_lsn();
+	blkno = leftmost;
+	while (blkno != P_NONE && blkno < num_pages && steps++ < num_pages)
+	{
+		uint8		flags = summaries.flags[blkno];
+
+		if (flags & (BS_DELETED | BS_HALF_DEAD))
+		{
+			have_prev = false;
+			blkno = summaries.next[blkno];
+			continue;
+		}
+
+		if (!(flags & BS_LEAF))
+			break;
+
+		summary_to_analysis(&summaries, blkno, &cur_page);
+		chained_leaves++;
+
+		if (have_prev &&
+			prev_page.next_blkno == blkno &&
+			cur_page.prev_blkno == prev_page.blockno)
+			consider_merge_pair(rel, &prev_page, &cur_page,
+								max_pct_to_merge, current_lsn, merge_candidates);
+
+		prev_page = cur_page;
+		have_prev = true;
+		blkno = summaries.next[blkno];
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Physical scan of %u blocks: %d live leaves (%d on the sibling chain), %d half-dead, %d deleted, found %d merge candidates",
+		 num_pages, live_leaves, chained_leaves, halfdead_pages, deleted_pages,
+		 merge_candidates->count);
+
+	if (chained_leaves < live_leaves)
+		elog(DEBUG1, "pg_index_reclaim: %d live leaf pages are not reachable along the sibling chain",
+			 live_leaves - chained_leaves);
+
+	pfree(summaries.base);
+}
+
+/*
+ * Analyze a B-tree index to find pages that can be merged
+ *
+ * By default the leaf level is walked from the leftmost leaf along the
+ * sibling links.  With sequential, the whole relation is read in physical
+ * order instead.  A level above the leaves, or a key range of the leaves,
+ * can only be walked.  The walk reads through strategy if it is not NULL.
+ */
+static void
+analyze_index_pages(Relation rel, MergeCandidates *merge_candidates, int max_pct_to_merge,
+					bool sequential, uint32 level, const ReclaimKeyRange *range,
+					BufferAccessStrategy strategy)
+{
+	BlockNumber num_pages;
+
+	elog(DEBUG1, "pg_index_reclaim: Starting page analysis");
+
+	/* Get total number of pages */
+	num_pages = RelationGetNumberOfBlocks(rel);
+	if (num_pages <= 1)		/* Only metapage */
+	{
+		elog(DEBUG1, "pg_index_reclaim: Index has only metapage, nothing to analyze");
+		return;
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Index has %u pages", num_pages);
+
+	Assert(!sequential || (level == 0 && range == NULL));
+
+	if (sequential)
+		analyze_physical(rel, num_pages, merge_candidates, max_pct_to_merge);
+	else
+		analyze_leaf_chain(rel, num_pages, merge_candidates, max_pct_to_merge,
+						   level, range, strategy);
+}
+
+/*
+ * Copy the used items of page src from offset first onwards to page dst
+ *
+ * Items are appended at consecutive offsets starting at *next, so each one
+ * costs a single copy and no line pointer shuffling.
+ */
+static void
+append_page_items(Relation rel, Page dst, OffsetNumber *next, Page src,
+				  OffsetNumber first, BlockNumber srcblkno)
+{
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(src);
+	OffsetNumber offnum;
+
+	for (offnum = first; offnum <= maxoff; offnum++)
+	{
+		ItemId		itemid = PageGetItemId(src, offnum);
+
+		if (!ItemIdIsUsed(itemid))
+			continue;
+
+		if (PageAddItem(dst, PageGetItem(src, itemid), ItemIdGetLength(itemid),
+						*next, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add item %u from page %u to merged page in index \"%s\"",
+				 offnum, srcblkno, RelationGetRelationName(rel));
+		(*next)++;
+	}
+}
+
+/*
+ * Rebuild page target with the items of page source in front of its own
+ *
+ * The merged page is built on a scratch page, the way _bt_split() builds
+ * its halves: the target's high key first (if it has one), then the data
+ * items of the source, then those of the target.  Since the source is the
+ * target's left sibling, this keeps the items in key order.  If deduplicate
+ * is set, the data items are deduplicated on the way.  The scratch page
+ * then replaces the target's contents.
+ *
+ * On internal pages the first data item is a downlink without a key, the
+ * "minus infinity" item.  The target's one needs a key once the source's
+ * downlinks come before it: the source's high key, which separated the two
+ * pages in the parent.
+ */
+static void
+rebuild_merged_page(Relation rel, Page target, BlockNumber tblkno,
+					Page source, BlockNumber sblkno, bool deduplicate)
+{
+	BTPageOpaque topaque = BTPageGetOpaque(target);
+	Page		newpage = PageGetTempPageCopySpecial(target);
+	OffsetNumber next = P_HIKEY;
+
+	if (!P_RIGHTMOST(topaque))
+		append_page_items(rel, newpage, &next, target, P_HIKEY, tblkno);
+	Assert(next == P_FIRSTDATAKEY(topaque));
+
+	if (deduplicate)
+	{
+		BTDedupStateData state;
+
+		merge_dedup_begin(&state, target);
+		merge_dedup_items(rel, &state, newpage, source,
+						  P_FIRSTDATAKEY(BTPageGetOpaque(source)), NULL);
+		merge_dedup_items(rel, &state, newpage, target,
+						  P_FIRSTDATAKEY(topaque), NULL);
+		if (state.nitems > 0)
+			merge_dedup_flush(&state, newpage, NULL);
+		pfree(state.htids);
+	}
+	else if (!P_ISLEAF(topaque))
+	{
+		IndexTuple	pivot;
+		IndexTuple	first;
+
+		append_page_items(rel, newpage, &next, source,
+						  P_FIRSTDATAKEY(BTPageGetOpaque(source)), sblkno);
+
+		pivot = CopyIndexTuple((IndexTuple)
+							   PageGetItem(source, PageGetItemId(source, P_HIKEY)));
+		first = (IndexTuple)
+			PageGetItem(target, PageGetItemId(target, P_FIRSTDATAKEY(topaque)));
+		BTreeTupleSetDownLink(pivot, BTreeTupleGetDownLink(first));
+		if (PageAddItem(newpage, (Item) pivot, IndexTupleSize(pivot), next,
+						false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add pivot tuple to merged page %u in index \"%s\"",
+				 tblkno, RelationGetRelationName(rel));
+		next++;
+		pfree(pivot);
+
+		append_page_items(rel, newpage, &next, target,
+						  OffsetNumberNext(P_FIRSTDATAKEY(topaque)), tblkno);
+	}
+	else
+	{
+		append_page_items(rel, newpage, &next, source,
+						  P_FIRSTDATAKEY(BTPageGetOpaque(source)), sblkno);
+		append_page_items(rel, newpage, &next, target,
+						  P_FIRSTDATAKEY(topaque), tblkno);
+	}
+
+	PageRestoreTempPage(newpage, target);
+}
+
+/*
+ * Exclusive-lock a buffer, adding the time spent waiting to *lock_wait
+ *
+ * The clock is only read if the lock is not immediately available.  If
+ * wait is false, a lock that is not immediately available is not waited
+ * for, and false is returned with the buffer still pinned.
+ */
+static bool
+lock_buffer_timed(Buffer buf, bool wait, instr_time *lock_wait)
+{
+	instr_time	start;
+	instr_time	end;
+
+	if (ConditionalLockBuffer(buf))
+		return true;
+	if (!wait)
+		return false;
+
+	INSTR_TIME_SET_CURRENT(start);
+	LockBuffer(buf, BT_WRITE);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(*lock_wait, end, start);
+	return true;
+}
+
+/*
+ * Lock the left sibling of page blkno, before blkno itself is locked
+ *
+ * This is the first lock of a merge, as in _bt_unlink_halfdead_page(), so
+ * that all pages are locked left to right and we can't deadlock with a
+ * VACUUM deleting pages next to ours.  The sibling is taken from blkno's
+ * left link, and may have split since, so we step right until we find the
+ * page that links to blkno.  Sets *buf to the locked sibling and *leftsib
+ * to its block, or to InvalidBuffer and P_NONE if blkno is leftmost.
+ * Nothing else is locked while we wait for the sibling, so it is waited
+ * for even with pg_index_reclaim.skip_locked.  Returns false, with *reason
+ * set and nothing locked, if the sibling can't be found.
+ */
+static bool
+lock_left_sibling(Relation rel, BlockNumber blkno, instr_time *lock_wait,
+				  Buffer *buf, BlockNumber *leftsib, MergeAbortReason *reason)
+{
+	Buffer		lbuf;
+	Page		page;
+	BlockNumber lblkno;
+
+	lbuf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	LockBuffer(lbuf, BT_READ);
+	page = BufferGetPage(lbuf);
+	lblkno = PageIsNew(page) ? P_NONE : BTPageGetOpaque(page)->btpo_prev;
+	UnlockReleaseBuffer(lbuf);
+
+	*buf = InvalidBuffer;
+	*leftsib = P_NONE;
+
+	while (lblkno != P_NONE)
+	{
+		BTPageOpaque lopaque;
+
+		elog(DEBUG1, "pg_index_reclaim: Locking left sibling page %u", lblkno);
+		lbuf = ReadBufferExtended(rel, MAIN_FORKNUM, lblkno, RBM_NORMAL, NULL);
+		(void) lock_buffer_timed(lbuf, true, lock_wait);
+		page = BufferGetPage(lbuf);
+		if (PageIsNew(page))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Left sibling %u is new/uninitialized, aborting", lblkno);
+			UnlockReleaseBuffer(lbuf);
+			*reason = MERGE_ABORT_SIBLING_MISMATCH;
+			return false;
+		}
+		lopaque = BTPageGetOpaque(page);
+		if (!P_ISDELETED(lopaque) && lopaque->btpo_next == blkno)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Left sibling %u validated", lblkno);
+			*buf = lbuf;
+			*leftsib = lblkno;
+			return true;
+		}
+
+		/* Step right one page */
+		lblkno = lopaque->btpo_next;
+		UnlockReleaseBuffer(lbuf);
+		if (lblkno == P_NONE)
+		{
+			elog(DEBUG1, "pg_index_reclaim: No left sibling of page %u found, aborting", blkno);
+			*reason = MERGE_ABORT_SIBLING_MISMATCH;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Find the way to the parent of page blkno, which is on the given level
+ *
+ * As _bt_pagedel() does, this descends from the root with the page's high
+ * key, which leads through the page itself; _bt_getstackbuf() can then
+ * find the downlink, moving right on the parent level if it has to.
+ * blkno must not be rightmost, and must not be locked by us: the descent
+ * takes read locks on the way down.  Returns the whole stack, to be freed
+ * by the caller, and sets *parent to its entry for the parent level, with
+ * the parent's block and the offset of the downlink.  Returns NULL if the
+ * page changed under us.
+ */
+static BTStack
+find_parent(Relation rel, Relation heaprel, BlockNumber blkno, uint32 level,
+			BTStack *parent)
+{
+	Buffer		buf;
+	Page		page;
+	BTPageOpaque opaque;
+	IndexTuple	highkey = NULL;
+	BTScanInsert itup_key;
+	BTStack		stack;
+	uint32		i;
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BT_READ);
+	page = BufferGetPage(buf);
+	opaque = BTPageGetOpaque(page);
+	if (!PageIsNew(page) && opaque->btpo_level == level && !P_IGNORE(opaque) &&
+		!P_RIGHTMOST(opaque))
+		highkey = CopyIndexTuple((IndexTuple) PageGetItem(page,
+														  PageGetItemId(page, P_HIKEY)));
+	UnlockReleaseBuffer(buf);
+
+	if (highkey == NULL)
+		return NULL;
+
+	/*
+	 * Find the leftmost leaf page with a matching high key.  As in
+	 * _bt_pagedel(), the search goes backward: it must land left of the
+	 * separator equal to the high key, in the page's own subtree, and not
+	 * right of it, in its right sibling's.
+	 */
+	itup_key = _bt_mkscankey(rel, highkey);
+	itup_key->backward = true;
+	stack = _bt_search(rel, heaprel, itup_key, &buf, BT_READ);
+	if (BufferIsValid(buf))
+		_bt_relbuf(rel, buf);
+	pfree(itup_key);
+	pfree(highkey);
+
+	/*
+	 * The stack starts at level 1.  The page has a right sibling, so its
+	 * level is below the fast root the descent started from, and the
+	 * stack does reach the parent.
+	 */
+	*parent = stack;
+	for (i = 0; i < level && *parent != NULL; i++)
+		*parent = (*parent)->bts_parent;
+
+	if (*parent == NULL)
+	{
+		_bt_freestack(stack);
+		return NULL;
+	}
+
+	return stack;
+}
+
+/*
+ * Execute a merge of a run of adjacent pages of one level
+ *
+ * blocks[] lists nblocks (at least two) pages of the given level, 0 for
+ * leaf pages, in left-to-right order; each must be the right sibling of
+ * the one before it, and their downlinks
+ * must be consecutive items of the same parent page.  The contents of all
+ * pages but the last are moved into the last one, the target, and the
+ * emptied pages are deleted the way _bt_unlink_halfdead_page() deletes
+ * them: they are unlinked from their siblings, their downlinks go away,
+ * and they are marked deleted with a safexid, after which they can be
+ * recycled.  The safexid they were marked with is stored in *safexid.  All
+ * pages are locked once, left to right, and stay locked until the whole
+ * run is relinked, so folding k pages costs one lock sweep instead of k-1
+ * pairwise merges.
+ *
+ * Changes are WAL-logged as generic WAL records, which carry only the
+ * byte ranges that changed instead of full page images.  A record covers
+ * at most MAX_GENERIC_XLOG_PAGES buffers, so the run is folded right to
+ * left one source page per record: each record moves one source into the
+ * target, links the target to the source's left neighbour and hands the
+ * source's key space to the target in the parent, whose downlink to the
+ * source now points to the target while the target's own goes away, as in
+ * _bt_mark_page_halfdead().  Every record on its own leaves a consistent
+ * tree, so replay after a crash between two of them simply ends up with a
+ * shorter merge.
+ *
+ * If the target ends up alone on its level, it becomes the fast root, as
+ * in _bt_unlink_halfdead_page(), so that descents skip the levels above
+ * that now have a single child each.  The metapage is then part of the
+ * last record, which has a buffer to spare since there is no left sibling
+ * to relink.
+ *
+ * With pg_index_reclaim.skip_locked, only the first page of the run is
+ * waited for.  If any other page or sibling is locked by someone else, the
+ * merge is declined with MERGE_ABORT_LOCK_BUSY instead of queueing behind
+ * them.  The parent is still waited for, as _bt_getstackbuf() has no
+ * conditional variant; it is only ever held briefly by inserters, which
+ * lock it after their child.
+ */
+static bool
+execute_merge(Relation rel, Relation heaprel, uint32 level, BlockNumber *blocks,
+			  int nblocks, MergeAbortReason *reason, Size *bytes_moved,
+			  instr_time *lock_wait, FullTransactionId *safexid)
+{
+	Buffer		bufs[MAX_MERGE_RUN];
+	Page		pages[MAX_MERGE_RUN];
+	BTPageOpaque opaques[MAX_MERGE_RUN];
+	Buffer		right_sibling_buf = InvalidBuffer;
+	Buffer		left_sibling_buf = InvalidBuffer;
+	BTPageOpaque right_sibling_opaque = NULL;
+	int			nsources = nblocks - 1;
+	int			nlocked = 0;
+	BlockNumber target_block = blocks[nblocks - 1];
+	Buffer		target_buf;
+	Page		target_page;
+	BTPageOpaque target_opaque;
+	XLogRecPtr	recptr;
+	OffsetNumber offnum;
+	ItemId		itemid;
+	BlockNumber leftsib;
+	BlockNumber rightsib;
+	BTStack		stack;
+	BTStack		pstack;
+	Buffer		parent_buf = InvalidBuffer;
+	Buffer		metabuf = InvalidBuffer;
+	Page		parent_page;
+	OffsetNumber poffset;
+	bool		deduplicate = (level == 0 && merge_can_deduplicate(rel));
+	bool		fits;
+	Size		moved_size = 0;
+	int			nmoved = 0;
+	int			i;
+	instr_time	phase_start;
+	bool		locking = false;
+
+	Assert(nblocks >= 2 && nblocks <= MAX_MERGE_RUN);
+
+	*reason = MERGE_ABORT_NONE;
+
+	/* Find the parent before locking anything; the descent needs no locks */
+	phase_timer_start(&phase_start);
+	stack = find_parent(rel, heaprel, blocks[0], level, &pstack);
+	phase_timer_stop(TIMED_DESCENT, phase_start);
+	if (stack == NULL)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Cannot find the parent of page %u, aborting", blocks[0]);
+		*reason = MERGE_ABORT_PARENT_MISMATCH;
+		return false;
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: ========================================");
+	elog(DEBUG1, "pg_index_reclaim: Starting merge of %d pages %u..%u -> %u in index \"%s\"",
+		 nsources, blocks[0], blocks[nsources - 1], target_block,
+		 RelationGetRelationName(rel));
+	elog(DEBUG1, "pg_index_reclaim: ========================================");
+
+	/* Dump pages BEFORE merge */
+	for (i = 0; i < nblocks; i++)
+		dump_page(rel, blocks[i], i < nsources ?
+				  "SOURCE PAGE (BEFORE MERGE)" : "TARGET PAGE (BEFORE MERGE)");
+
+	/* Lock the left sibling first, then the run, then the right sibling */
+	phase_timer_start(&phase_start);
+	locking = true;
+	if (!lock_left_sibling(rel, blocks[0], lock_wait, &left_sibling_buf,
+						   &leftsib, reason))
+		goto abort_merge;
+
+	/*
+	 * Then the pages of the run, left to right.  With skip_locked, only the
+	 * first lock of the merge is waited for: the left sibling's, or the
+	 * first page's if there is no left sibling.
+	 */
+	for (i = 0; i < nblocks; i++)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Locking page %u", blocks[i]);
+		bufs[i] = ReadBufferExtended(rel, MAIN_FORKNUM, blocks[i], RBM_NORMAL, NULL);
+		if (!lock_buffer_timed(bufs[i],
+							   !skip_locked || (i == 0 && !BufferIsValid(left_sibling_buf)),
+							   lock_wait))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is locked, deferring", blocks[i]);
+			ReleaseBuffer(bufs[i]);
+			*reason = MERGE_ABORT_LOCK_BUSY;
+			goto abort_merge;
+		}
+		nlocked++;
+		pages[i] = BufferGetPage(bufs[i]);
+
+		if (PageIsNew(pages[i]))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is new/uninitialized, aborting", blocks[i]);
+			*reason = MERGE_ABORT_NEW_PAGE;
+			goto abort_merge;
+		}
+
+		opaques[i] = BTPageGetOpaque(pages[i]);
+
+		/* Validate page */
+		if (opaques[i]->btpo_level != level || P_ISLEAF(opaques[i]) != (level == 0))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is not on level %u (level %u), aborting",
+				 blocks[i], level, opaques[i]->btpo_level);
+			*reason = MERGE_ABORT_NOT_LEAF;
+			goto abort_merge;
+		}
+		if (P_ISDELETED(opaques[i]))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is already deleted, aborting", blocks[i]);
+			*reason = MERGE_ABORT_DELETED;
+			goto abort_merge;
+		}
+		if (P_ISHALFDEAD(opaques[i]))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Page %u is half-dead, aborting", blocks[i]);
+			*reason = MERGE_ABORT_HALF_DEAD;
+			goto abort_merge;
+		}
+
+		/* Validate sibling relationship with the previous page of the run */
+		if (i > 0 &&
+			(opaques[i]->btpo_prev != blocks[i - 1] ||
+			 opaques[i - 1]->btpo_next != blocks[i]))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Sibling relationship mismatch: page %u prev=%u, expected %u, aborting",
+				 blocks[i], opaques[i]->btpo_prev, blocks[i - 1]);
+			*reason = MERGE_ABORT_SIBLING_MISMATCH;
+			goto abort_merge;
+		}
+
+		elog(DEBUG1, "pg_index_reclaim: Page %u validated: prev=%u, next=%u, flags=0x%x",
+			 blocks[i], opaques[i]->btpo_prev, opaques[i]->btpo_next,
+			 opaques[i]->btpo_flags);
+	}
+
+	target_buf = bufs[nsources];
+	target_page = pages[nsources];
+	target_opaque = opaques[nsources];
+
+	/* The run must still hang off the left sibling we locked */
+	if (opaques[0]->btpo_prev != leftsib)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Page %u prev=%u, expected %u, aborting",
+			 blocks[0], opaques[0]->btpo_prev, leftsib);
+		*reason = MERGE_ABORT_SIBLING_MISMATCH;
+		goto abort_merge;
+	}
+
+	rightsib = target_opaque->btpo_next;
+
+	elog(DEBUG1, "pg_index_reclaim: Sibling info: leftsib=%u, rightsib=%u, is_rightmost=%d",
+		 leftsib, rightsib, P_RIGHTMOST(target_opaque));
+
+	/* Lock right sibling if it exists (for validating its left-link) */
+	if (!P_RIGHTMOST(target_opaque))
+	{
+		elog(DEBUG1, "pg_index_reclaim: Locking right sibling page %u", rightsib);
+		right_sibling_buf = ReadBufferExtended(rel, MAIN_FORKNUM, rightsib,
+											   RBM_NORMAL, NULL);
+		if (!lock_buffer_timed(right_sibling_buf, !skip_locked, lock_wait))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Right sibling %u is locked, deferring", rightsib);
+			ReleaseBuffer(right_sibling_buf);
+			right_sibling_buf = InvalidBuffer;
+			*reason = MERGE_ABORT_LOCK_BUSY;
+			goto abort_merge;
+		}
+		right_sibling_opaque = BTPageGetOpaque(BufferGetPage(right_sibling_buf));
+
+		/* Validate right sibling's left-link */
+		if (right_sibling_opaque->btpo_prev != target_block)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Right sibling %u prev=%u, expected %u, aborting",
+				 rightsib, right_sibling_opaque->btpo_prev, target_block);
+			*reason = MERGE_ABORT_SIBLING_MISMATCH;
+			goto abort_merge;
+		}
+		elog(DEBUG1, "pg_index_reclaim: Right sibling %u validated", rightsib);
+	}
+	phase_timer_stop(TIMED_LOCK, phase_start);
+	locking = false;
+
+	/*
+	 * Check if we have space - should have been validated by analyze, but
+	 * double-check.  Every moved item needs its aligned size plus a line
+	 * pointer on the target page.
+	 */
+	for (i = 0; i < nsources; i++)
+	{
+		OffsetNumber maxoff = PageGetMaxOffsetNumber(pages[i]);
+
+		for (offnum = P_FIRSTDATAKEY(opaques[i]); offnum <= maxoff; offnum++)
+		{
+			itemid = PageGetItemId(pages[i], offnum);
+			if (!ItemIdIsUsed(itemid))
+			{
+				elog(WARNING, "pg_index_reclaim: Page %u has unused item at offset %u", blocks[i], offnum);
+				continue;
+			}
+			moved_size += MAXALIGN(ItemIdGetLength(itemid)) + sizeof(ItemIdData);
+			nmoved++;
+		}
+
+		/* On internal levels, the source's high key becomes a pivot */
+		if (level > 0)
+			moved_size += MAXALIGN(ItemIdGetLength(PageGetItemId(pages[i], P_HIKEY)));
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Space check - moved_size=%zu, available_space=%zu",
+		 moved_size, PageGetExactFreeSpace(target_page));
+
+	/*
+	 * If the items don't fit as they are, they may still fit once
+	 * deduplicated.  Measure the data items of the whole run as the last
+	 * step will leave them on the target, next to its high key.  Earlier
+	 * steps deduplicate fewer items, which can only take less space.
+	 */
+	fits = (moved_size <= PageGetExactFreeSpace(target_page));
+	if (!fits && deduplicate)
+	{
+		MergeDedupSpace space;
+		Size		needed;
+		Size		capacity;
+
+		merge_dedup_measure(rel, pages, nblocks, &space);
+		needed = space.size + space.ntuples * sizeof(ItemIdData);
+
+		/* Space left on the target once its own data items are gone too */
+		capacity = PageGetExactFreeSpace(target_page);
+		for (offnum = P_FIRSTDATAKEY(target_opaque);
+			 offnum <= PageGetMaxOffsetNumber(target_page); offnum++)
+		{
+			itemid = PageGetItemId(target_page, offnum);
+			capacity += MAXALIGN(ItemIdGetLength(itemid)) + sizeof(ItemIdData);
+		}
+
+		elog(DEBUG1, "pg_index_reclaim: Space check after deduplication - needed=%zu, available_space=%zu",
+			 needed, capacity);
+
+		fits = (needed <= capacity);
+	}
+
+	if (!fits)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Not enough space (%zu > %zu), aborting",
+			 moved_size, PageGetExactFreeSpace(target_page));
+		*reason = MERGE_ABORT_OUT_OF_SPACE;
+		goto abort_merge;
+	}
+
+	if (nmoved == 0)
+	{
+		elog(DEBUG1, "pg_index_reclaim: No valid items to move, aborting");
+		*reason = MERGE_ABORT_NO_ITEMS;
+		goto abort_merge;
+	}
+
+	/*
+	 * Lock the parent.  Like _bt_lock_subtree_parent(), this comes after
+	 * the children, and it may move right if the parent split since the
+	 * descent.  The downlinks of the whole run must follow each other on
+	 * it; _bt_mark_page_halfdead() refuses to hand a page's key space to
+	 * a right sibling that has a different parent for the same reason.
+	 */
+	phase_timer_start(&phase_start);
+	parent_buf = _bt_getstackbuf(rel, heaprel, pstack, blocks[0]);
+	phase_timer_stop(TIMED_LOCK, phase_start);
+	if (!BufferIsValid(parent_buf))
+	{
+		elog(DEBUG1, "pg_index_reclaim: Downlink to page %u not found, aborting", blocks[0]);
+		*reason = MERGE_ABORT_PARENT_MISMATCH;
+		goto abort_merge;
+	}
+	parent_page = BufferGetPage(parent_buf);
+	poffset = pstack->bts_offset;
+
+	for (i = 1; i < nblocks; i++)
+	{
+		OffsetNumber off = poffset + i;
+
+		if (off > PageGetMaxOffsetNumber(parent_page) ||
+			BTreeTupleGetDownLink((IndexTuple)
+								  PageGetItem(parent_page,
+											  PageGetItemId(parent_page, off))) != blocks[i])
+		{
+			elog(DEBUG1, "pg_index_reclaim: Downlink to page %u is not next to that of page %u in parent %u, aborting",
+				 blocks[i], blocks[i - 1], BufferGetBlockNumber(parent_buf));
+			*reason = MERGE_ABORT_PARENT_MISMATCH;
+			goto abort_merge;
+		}
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Moving %d items from %d source pages, total_size=%zu",
+		 nmoved, nsources, moved_size);
+
+	/*
+	 * Lock the metapage last, as _bt_unlink_halfdead_page() does, if the
+	 * target will be alone on its level.  As there, the fast root is only
+	 * moved down from the level right above, or when it looks wrong; and
+	 * only on metapages of the current layout.
+	 */
+	if (leftsib == P_NONE && P_RIGHTMOST(target_opaque))
+	{
+		BTMetaPageData *metad;
+		bool		locked;
+
+		phase_timer_start(&phase_start);
+		metabuf = ReadBufferExtended(rel, MAIN_FORKNUM, BTREE_METAPAGE,
+									 RBM_NORMAL, NULL);
+		locked = lock_buffer_timed(metabuf, !skip_locked, lock_wait);
+		phase_timer_stop(TIMED_LOCK, phase_start);
+		if (!locked)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Metapage is locked, deferring");
+			ReleaseBuffer(metabuf);
+			metabuf = InvalidBuffer;
+			*reason = MERGE_ABORT_LOCK_BUSY;
+			goto abort_merge;
+		}
+		metad = BTPageGetMeta(BufferGetPage(metabuf));
+		if (metad->btm_version < BTREE_NOVAC_VERSION ||
+			metad->btm_fastlevel > level + 1)
+		{
+			UnlockReleaseBuffer(metabuf);
+			metabuf = InvalidBuffer;
+		}
+	}
+
+	/* All source pages are marked with the same safexid */
+	*safexid = ReadNextFullTransactionId();
+
+	/*
+	 * Fold the source pages into the target, rightmost source first.  Each
+	 * step works on the private page copies handed out by the generic WAL
+	 * machinery; GenericXLogFinish() then applies them to the buffers and
+	 * logs the difference in one critical section.  Nothing is modified in
+	 * the shared buffers before that, so erroring out mid-step only has to
+	 * abandon the record with GenericXLogAbort().
+	 */
+	for (i = nsources - 1; i >= 0; i--)
+	{
+		GenericXLogState *state;
+		Buffer		newleft_buf;
+		BlockNumber newleft;
+		Page		spage;
+		Page		tpage;
+		Page		lpage = NULL;
+		Page		ppage;
+		IndexTuple	pitup;
+		bool		new_fastroot = false;
+
+		/* After this step, the target's left neighbour is the page left of the source */
+		if (i > 0)
+		{
+			newleft_buf = bufs[i - 1];
+			newleft = blocks[i - 1];
+		}
+		else
+		{
+			newleft_buf = left_sibling_buf;
+			newleft = leftsib;
+		}
+
+		phase_timer_start(&phase_start);
+		state = GenericXLogStart(rel);
+		spage = GenericXLogRegisterBuffer(state, bufs[i], 0);
+		tpage = GenericXLogRegisterBuffer(state, target_buf, 0);
+		if (BufferIsValid(newleft_buf))
+			lpage = GenericXLogRegisterBuffer(state, newleft_buf, 0);
+		ppage = GenericXLogRegisterBuffer(state, parent_buf, 0);
+		if (i == 0 && BufferIsValid(metabuf))
+		{
+			BTMetaPageData *metad;
+
+			Assert(lpage == NULL);
+			metad = BTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+			metad->btm_fastroot = target_block;
+			metad->btm_fastlevel = level;
+			new_fastroot = true;
+		}
+
+		PG_TRY();
+		{
+			/* Put the items of the source page in front of the target's own */
+			rebuild_merged_page(rel, tpage, target_block, spage, blocks[i],
+								deduplicate);
+
+			elog(DEBUG1, "pg_index_reclaim: Added the items of page %u to target page %u",
+				 blocks[i], target_block);
+
+			/*
+			 * The target page keeps its original high key (if any).  That is
+			 * the upper bound parent pages expect for it; the high key of
+			 * the source page separated pages that are now merged, so it
+			 * goes away.
+			 */
+
+			/* Update sibling links */
+			elog(DEBUG1, "pg_index_reclaim: Updating target page %u prev pointer from %u to %u",
+				 target_block, BTPageGetOpaque(tpage)->btpo_prev, newleft);
+			BTPageGetOpaque(tpage)->btpo_prev = newleft;
+			if (lpage != NULL)
+				BTPageGetOpaque(lpage)->btpo_next = target_block;
+
+			/*
+			 * In the parent, the downlink to the source, at poffset + i, now
+			 * points to the target, and the target's own downlink right
+			 * after it goes away.  The target thereby takes over the
+			 * source's lower bound along with its items.
+			 */
+			pitup = (IndexTuple) PageGetItem(ppage, PageGetItemId(ppage, poffset + i));
+			BTreeTupleSetDownLink(pitup, target_block);
+			PageIndexTupleDelete(ppage, poffset + i + 1);
+
+			/*
+			 * Mark the source page deleted.  It keeps its sibling links, so
+			 * that scans that still land on it can move on, and can only be
+			 * recycled once no such scan can remain, as safexid tells.
+			 */
+			BTPageSetDeleted(spage, *safexid);
+			BTPageGetOpaque(spage)->btpo_cycleid = 0;
+		}
+		PG_CATCH();
+		{
+			GenericXLogAbort(state);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		phase_timer_stop(TIMED_REWRITE, phase_start);
+
+		/* Apply the changes and WAL-log them (a no-op for unlogged indexes) */
+		phase_timer_start(&phase_start);
+		recptr = GenericXLogFinish(state);
+		phase_timer_stop(TIMED_WAL, phase_start);
+		elog(DEBUG1, "pg_index_reclaim: Page %u merged into %u and deleted, LSN=%X/%X",
+			 blocks[i], target_block, LSN_FORMAT_ARGS(recptr));
+		if (new_fastroot)
+			elog(DEBUG1, "pg_index_reclaim: Page %u is the new fast root, on level %u",
+				 target_block, level);
+	}
+
+	/* Release locks */
+	elog(DEBUG1, "pg_index_reclaim: Releasing buffers");
+	if (BufferIsValid(metabuf))
+	{
+		UnlockReleaseBuffer(metabuf);
+
+		/*
+		 * Have every backend read the new fast root.  Cached copies of the
+		 * metapage would otherwise keep descending from the old one, which
+		 * _bt_getroot() only notices once it is no longer alone.
+		 */
+		CacheInvalidateRelcache(rel);
+	}
+	UnlockReleaseBuffer(parent_buf);
+	_bt_freestack(stack);
+	if (BufferIsValid(left_sibling_buf))
+		UnlockReleaseBuffer(left_sibling_buf);
+	if (BufferIsValid(right_sibling_buf))
+		UnlockReleaseBuffer(right_sibling_buf);
+	for (i = nblocks - 1; i >= 0; i--)
+		UnlockReleaseBuffer(bufs[i]);
+
+	/* Dump pages AFTER merge */
+	for (i = 0; i < nblocks; i++)
+		dump_page(rel, blocks[i], i < nsources ?
+				  "SOURCE PAGE (AFTER MERGE - DELETED)" : "TARGET PAGE (AFTER MERGE)");
+	if (rightsib != P_NONE)
+		dump_page(rel, rightsib, "RIGHT SIBLING PAGE (AFTER MERGE)");
+
+	elog(DEBUG1, "pg_index_reclaim: Merge of %d pages into %u completed successfully",
+		 nsources, target_block);
+	*bytes_moved = moved_size;
+	return true;
+
+abort_merge:
+	if (locking)
+		phase_timer_stop(TIMED_LOCK, phase_start);
+
+	/* Nothing has been modified yet; just drop what we hold */
+	if (BufferIsValid(metabuf))
+		UnlockReleaseBuffer(metabuf);
+	if (BufferIsValid(parent_buf))
+		UnlockReleaseBuffer(parent_buf);
+	_bt_freestack(stack);
+	if (BufferIsValid(left_sibling_buf))
+		UnlockReleaseBuffer(left_sibling_buf);
+	if (BufferIsValid(right_sibling_buf))
+		UnlockReleaseBuffer(right_sibling_buf);
+	for (i = nlocked - 1; i >= 0; i--)
+		UnlockReleaseBuffer(bufs[i]);
+	return false;
+}
+
+/*
+ * Collect a run of adjacent pages to fold into one target
+ *
+ * The run starts with the pair described by candidate first, which must be
+ * mergeable, and is extended to the right while the next candidate continues
+ * the chain and everything collected so far still fits into its right page.
+ * The run is stored in blocks[], and its length in *nblocks.  Returns the
+ * index of the first candidate not consumed by the run.
+ */
+static int
+collect_merge_run(MergeCandidates *candidates, int first, BlockNumber *blocks,
+				  int *nblocks)
+{
+	MergeCandidate *candidate = &candidates->items[first];
+	Size		run_used = candidate->left_used + candidate->right_used;
+	int			next = first + 1;
+
+	blocks[0] = candidate->left_page;
+	blocks[1] = candidate->right_page;
+	*nblocks = 2;
+
+	while (next < candidates->count && *nblocks < MAX_MERGE_RUN)
+	{
+		candidate = &candidates->items[next];
+
+		if (candidate->left_page != blocks[*nblocks - 1] ||
+			run_used + candidate->right_used > candidate->right_capacity)
+			break;
+
+		run_used += candidate->right_used;
+		blocks[(*nblocks)++] = candidate->right_page;
+		next++;
+	}
+
+	return next;
+}
+
+/*
+ * WAL a merge writes for each page it touches besides the moved items: the
+ * record and block headers, and the delta of a page that only has its
+ * links or its header changed
+ */
+#define MERGE_WAL_PER_PAGE	64
+
+/*
+ * A run of candidates planned for one merge, and what it is expected to
+ * give back per byte of WAL
+ */
+typedef struct MergeRun
+{
+	int			first;			/* index of its first candidate */
+	double		score;
+} MergeRun;
+
+static int
+merge_run_cmp(const void *a, const void *b)
+{
+	const MergeRun *ra = (const MergeRun *) a;
+	const MergeRun *rb = (const MergeRun *) b;
+
+	if (ra->score > rb->score)
+		return -1;
+	if (ra->score < rb->score)
+		return 1;
+	return pg_cmp_s32(ra->first, rb->first);
+}
+
+/*
+ * Score a run of nrun pages starting at candidate first
+ *
+ * The benefit is the number of pages the merge deletes, less the chance
+ * that the merged page splits again and gives one back: the larger split
+ * risk of the run's candidates, weighted by how full the merge leaves the
+ * target.  The cost is the WAL written: the items moved, a per-page
+ * overhead for every page locked and changed, which includes the parent
+ * and both outer siblings, and a full-page image for each page of the run
+ * not written since the last checkpoint, or whose LSN is unknown.
+ */
+static double
+score_merge_run(const MergeCandidates *candidates, int first, int nrun,
+				XLogRecPtr redo)
+{
+	const MergeCandidate *last = &candidates->items[first + nrun - 2];
+	double		risk = 0;
+	double		moved = 0;
+	double		wal_bytes;
+	double		freed;
+	int			j;
+
+	wal_bytes = (nrun + 3) * MERGE_WAL_PER_PAGE;
+	for (j = 0; j < nrun - 1; j++)
+	{
+		const MergeCandidate *candidate = &candidates->items[first + j];
+
+		risk = Max(risk, candidate->split_risk);
+		moved += candidate->left_used;
+		if (candidate->left_lsn <= redo)
+			wal_bytes += BLCKSZ;
+	}
+	if (last->right_lsn <= redo)
+		wal_bytes += BLCKSZ;
+	wal_bytes += moved;
+
+	freed = (nrun - 1) - risk * (moved + last->right_used) / last->right_capacity;
+
+	/* Not worth its WAL if the target is likely to split right away */
+	if (freed < 0.5)
+		return 0;
+
+	return freed * BLCKSZ / wal_bytes;
+}
+
+/*
+ * Plan the merges of candidates, best first
+ *
+ * The mergeable candidates are packed into runs as collect_merge_run()
+ * packs them, and the runs are sorted by score_merge_run(), so that the
+ * merges done within a budget free the most space per byte of WAL.  Runs
+ * that score zero are left out.  Returns a palloc'd array of *nruns runs,
+ * and sets planned[i] for every candidate i that is part of one.
+ */
+static MergeRun *
+plan_merge_runs(MergeCandidates *candidates, int *nruns, bool *planned)
+{
+	MergeRun   *runs = palloc(sizeof(MergeRun) * Max(candidates->count, 1));
+	XLogRecPtr	redo = GetRedoRecPtr();
+	int			i = 0;
+	instr_time	pairing_start;
+
+	phase_timer_start(&pairing_start);
+	*nruns = 0;
+	while (i < candidates->count)
+	{
+		BlockNumber blocks[MAX_MERGE_RUN];
+		int			nrun;
+		int			first = i;
+		double		score;
+
+		if (!candidates->items[i].can_merge)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Skipping merge of pages %u -> %u (can_merge=false)",
+				 candidates->items[i].left_page, candidates->items[i].right_page);
+			i++;
+			continue;
+		}
+
+		i = collect_merge_run(candidates, first, blocks, &nrun);
+		score = score_merge_run(candidates, first, nrun, redo);
+		if (score <= 0)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Skipping merge of %d pages into %u (likely to split again)",
+				 nrun - 1, blocks[nrun - 1]);
+			continue;
+		}
+
+		runs[*nruns].first = first;
+		runs[*nruns].score = score;
+		(*nruns)++;
+		memset(&planned[first], true, sizeof(bool) * (i - first));
+	}
+
+	qsort(runs, *nruns, sizeof(MergeRun), merge_run_cmp);
+	phase_timer_stop(TIMED_PAIRING, pairing_start);
+
+	return runs;
+}
+
+/*
+ * Read a leaf page and analyze it, unless its LSN is still expected_lsn
+ *
+ * Returns false if the page is no longer a live leaf page.  Otherwise
+ * *changed tells whether the LSN moved on; only then is *pa filled in.
+ * If not, only what page_split_risk() looks at is.  Pass
+ * InvalidXLogRecPtr to always have the page analyzed.
+ */
+static bool
+recheck_leaf_page(Relation rel, BlockNumber blkno, XLogRecPtr expected_lsn,
+				  PageAnalysis *pa, bool *changed)
+{
+	bool		deduplicate = merge_can_deduplicate(rel);
+	Buffer		buf;
+	Page		page;
+	bool		live;
+	instr_time	scan_start;
+
+	if (blkno >= RelationGetNumberOfBlocks(rel))
+		return false;
+
+	phase_timer_start(&scan_start);
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BT_READ);
+	page = BufferGetPage(buf);
+
+	live = !PageIsNew(page) &&
+		P_ISLEAF(BTPageGetOpaque(page)) &&
+		!P_IGNORE(BTPageGetOpaque(page));
+	if (live)
+	{
+		*changed = (XLogRecPtrIsInvalid(expected_lsn) ||
+					PageGetLSN(page) != expected_lsn);
+		if (*changed)
+			analyze_leaf_page(rel, page, blkno, deduplicate, pa);
+		else
+		{
+			pa->lsn = expected_lsn;
+			pa->split_recently = (BTPageGetOpaque(page)->btpo_cycleid != 0);
+		}
+	}
+
+	UnlockReleaseBuffer(buf);
+	phase_timer_stop(TIMED_SCAN, scan_start);
+	return live;
+}
+
+/*
+ * Bring the merge candidates taken from the candidate cache up to date
+ *
+ * A mergeable candidate whose pages still carry the LSNs the analysis saw
+ * is kept; nothing on those pages has changed since.  Only its split risk
+ * is worked out again, as the pages have aged, or VACUUM may have cleared
+ * their split flags.  The pages of the others are analyzed again and the
+ * pair re-evaluated, which may drop it.  Either way, this reads just the
+ * candidate pages instead of the whole index.
+ */
+static void
+refresh_candidates(Relation rel, MergeCandidates *cached,
+				   MergeCandidates *result, int max_pct_to_merge)
+{
+	XLogRecPtr	current_lsn = hot_page_current_lsn();
+	int			nkept = 0;
+	int			i;
+
+	for (i = 0; i < cached->count; i++)
+	{
+		MergeCandidate *candidate = &cached->items[i];
+		PageAnalysis left;
+		PageAnalysis right;
+		bool		left_changed;
+		bool		right_changed;
+
+		vacuum_delay_point(false);
+
+		if (!recheck_leaf_page(rel, candidate->left_page, candidate->left_lsn,
+							   &left, &left_changed) ||
+			!recheck_leaf_page(rel, candidate->right_page, candidate->right_lsn,
+							   &right, &right_changed))
+			continue;
+
+		if (!left_changed && !right_changed)
+		{
+			if (!candidate->can_merge)
+				continue;
+			candidate->split_risk = Max(page_split_risk(&left, current_lsn),
+										page_split_risk(&right, current_lsn));
+			*candidates_append(result) = *candidate;
+			nkept++;
+			continue;
+		}
+
+		/* consider_merge_pair() needs a fresh analysis of both pages */
+		if ((!left_changed &&
+			 !recheck_leaf_page(rel, candidate->left_page, InvalidXLogRecPtr,
+								&left, &left_changed)) ||
+			(!right_changed &&
+			 !recheck_leaf_page(rel, candidate->right_page, InvalidXLogRecPtr,
+								&right, &right_changed)))
+			continue;
+
+		if (left.next_blkno != right.blockno ||
+			right.prev_blkno != left.blockno)
+			continue;
+
+		consider_merge_pair(rel, &left, &right, max_pct_to_merge, current_lsn,
+							result);
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Refreshed %d cached merge candidates of index \"%s\": %d unchanged, %d still valid",
+		 cached->count, RelationGetRelationName(rel), nkept, result->count);
+}
+
+/*
+ * Analyze only the leaves that lost tuples after since_lsn
+ *
+ * The changed leaves are taken from the WAL by collect_vacuumed_blocks().
+ * Each is paired with its left and right siblings, the only pages it could
+ * be merged with.  Leaves that lost no tuples cannot have become sparser,
+ * so the only pairs missed are those that already qualified before
+ * since_lsn.
+ */
+static void
+analyze_incremental(Relation rel, XLogRecPtr since_lsn,
+					MergeCandidates *merge_candidates, int max_pct_to_merge)
+{
+	BlockNumber *blocks;
+	int			nblocks;
+	XLogRecPtr	current_lsn = hot_page_current_lsn();
+	int			i;
+
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_READING_WAL);
+	blocks = collect_vacuumed_blocks(rel, since_lsn, &nblocks);
+
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_SCANNING);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, nblocks);
+
+	for (i = 0; i < nblocks; i++)
+	{
+		PageAnalysis cur;
+		PageAnalysis sib;
+		bool		changed;
+
+		vacuum_delay_point(false);
+		reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_SCANNED, i + 1);
+
+		if (!recheck_leaf_page(rel, blocks[i], InvalidXLogRecPtr, &cur, &changed))
+			continue;
+
+		/*
+		 * Pair with the left sibling, unless that changed as well; it then
+		 * pairs with us from its side.
+		 */
+		if (cur.prev_blkno != P_NONE &&
+			bsearch(&cur.prev_blkno, blocks, nblocks, sizeof(BlockNumber),
+					blocknumber_cmp) == NULL &&
+			recheck_leaf_page(rel, cur.prev_blkno, InvalidXLogRecPtr, &sib, &changed) &&
+			sib.next_blkno == cur.blockno)
+			consider_merge_pair(rel, &sib, &cur, max_pct_to_merge, current_lsn,
+								merge_candidates);
+
+		if (cur.next_blkno != P_NONE &&
+			recheck_leaf_page(rel, cur.next_blkno, InvalidXLogRecPtr, &sib, &changed) &&
+			sib.prev_blkno == cur.blockno)
+			consider_merge_pair(rel, &cur, &sib, max_pct_to_merge, current_lsn,
+								merge_candidates);
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Incremental analysis of %d changed leaves found %d merge candidates",
+		 nblocks, merge_candidates->count);
+
+	pfree(blocks);
+}
+
+/*
+ * Pages deleted by merges, waiting to go into the free space map
+ *
+ * A deleted page may only be reused once no scan can still land on it,
+ * which its safexid tells.  That is never the case yet in the call that
+ * deleted it, so, like VACUUM's _bt_pendingfsm_add(), we remember the
+ * pages and their safexid.  Every later reclaim_index() call of this
+ * backend on the same index records those that have become safe, so
+ * inserts can reuse them without waiting for a VACUUM.  Pages still
+ * waiting when the backend exits, or that do not fit in the list, are
+ * left for the next VACUUM to find.
+ */
+typedef struct PendingFreePage
+{
+	Oid			indexoid;
+	BlockNumber blkno;
+	FullTransactionId safexid;
+} PendingFreePage;
+
+#define MAX_PENDING_FREE_PAGES	1024
+
+static PendingFreePage *pending_free_pages = NULL;
+static int	num_pending_free_pages = 0;
+
+static void
+pending_free_pages_add(Relation rel, BlockNumber blkno,
+					   FullTransactionId safexid)
+{
+	PendingFreePage *page;
+
+	if (pending_free_pages == NULL)
+		pending_free_pages = (PendingFreePage *)
+			MemoryContextAlloc(TopMemoryContext,
+							   sizeof(PendingFreePage) * MAX_PENDING_FREE_PAGES);
+
+	if (num_pending_free_pages >= MAX_PENDING_FREE_PAGES)
+		return;
+
+	page = &pending_free_pages[num_pending_free_pages++];
+	page->indexoid = RelationGetRelid(rel);
+	page->blkno = blkno;
+	page->safexid = safexid;
+}
+
+/*
+ * Put the pending pages of rel that can now be recycled into the FSM
+ *
+ * As in btvacuumpage(), each page is checked with BTPageIsRecyclable()
+ * before it is recorded: it may have been recycled in the meantime, or the
+ * index rebuilt.
+ */
+static void
+pending_free_pages_record(Relation rel, Relation heaprel)
+{
+	BlockNumber num_pages = RelationGetNumberOfBlocks(rel);
+	int			nrecorded = 0;
+	int			nkept = 0;
+	int			i;
+
+	for (i = 0; i < num_pending_free_pages; i++)
+	{
+		PendingFreePage *page = &pending_free_pages[i];
+		Buffer		buf;
+
+		if (page->indexoid != RelationGetRelid(rel) ||
+			!GlobalVisCheckRemovableFullXid(heaprel, page->safexid))
+		{
+			pending_free_pages[nkept++] = *page;
+			continue;
+		}
+
+		if (page->blkno >= num_pages)
+			continue;
+
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, page->blkno, RBM_NORMAL, NULL);
+		LockBuffer(buf, BT_READ);
+		if (BTPageIsRecyclable(BufferGetPage(buf), heaprel))
+		{
+			RecordFreeIndexPage(rel, page->blkno);
+			nrecorded++;
+		}
+		UnlockReleaseBuffer(buf);
+	}
+	num_pending_free_pages = nkept;
+
+	/* Make the pages visible to searches of the FSM, as VACUUM does */
+	if (nrecorded > 0)
+	{
+		IndexFreeSpaceMapVacuum(rel);
+		elog(DEBUG1, "pg_index_reclaim: Recorded %d deleted pages of index \"%s\" in the free space map",
+			 nrecorded, RelationGetRelationName(rel));
+	}
+}
+
+/*
+ * Largest replay lag of the standbys streaming from us, in microseconds
+ *
+ * This is the replay_lag of pg_stat_replication, as the walsenders compute
+ * it from their standbys' replies.  Returns -1 if no standby reports one.
+ */
+static TimeOffset
+max_standby_replay_lag(void)
+{
+	TimeOffset	result = -1;
+	int			i;
+
+	if (WalSndCtl == NULL)
+		return result;
+
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd	   *walsnd = &WalSndCtl->walsnds[i];
+		pid_t		pid;
+		TimeOffset	lag;
+
+		SpinLockAcquire(&walsnd->mutex);
+		pid = walsnd->pid;
+		lag = walsnd->replayLag;
+		SpinLockRelease(&walsnd->mutex);
+
+		if (pid != 0 && lag > result)
+			result = lag;
+	}
+
+	return result;
+}
+
+/*
+ * Sleep while the merges run ahead of max_wal_rate, or while a standby
+ * lags further behind than max_replica_lag
+ *
+ * wal_bytes is the WAL this backend wrote since start; the rate is that of
+ * the whole merge phase, so a merge after a pause may run at once.  The
+ * standbys' lag is checked again every 100ms.  Sleeps are taken in naps of
+ * at most a second, with interrupts checked in between.  The time slept is
+ * added to *throttle_time, in milliseconds.
+ */
+static void
+reclaim_throttle(instr_time start, int64 wal_bytes, double *throttle_time)
+{
+	instr_time	sleep_start;
+	instr_time	sleep_end;
+	bool		slept = false;
+
+	for (;;)
+	{
+		long		delay_ms = 0;
+		uint32		wait_event = 0;
+
+		if (max_wal_rate > 0)
+		{
+			instr_time	now;
+			double		elapsed_ms;
+			double		due_ms;
+
+			INSTR_TIME_SET_CURRENT(now);
+			INSTR_TIME_SUBTRACT(now, start);
+			elapsed_ms = INSTR_TIME_GET_MILLISEC(now);
+
+			/* max_wal_rate is in kB per second */
+			due_ms = (double) wal_bytes * 1000.0 / ((double) max_wal_rate * 1024.0);
+			if (due_ms > elapsed_ms)
+			{
+				delay_ms = (long) ceil(due_ms - elapsed_ms);
+				if (wait_event_wal_rate == 0)
+					wait_event_wal_rate = WaitEventExtensionNew("IndexReclaimWALRate");
+				wait_event = wait_event_wal_rate;
+			}
+		}
+
+		if (max_replica_lag > 0 &&
+			max_standby_replay_lag() > (TimeOffset) max_replica_lag * 1000)
+		{
+			delay_ms = Max(delay_ms, 100);
+			if (wait_event_replica_lag == 0)
+				wait_event_replica_lag = WaitEventExtensionNew("IndexReclaimReplicaLag");
+			wait_event = wait_event_replica_lag;
+		}
+
+		if (delay_ms <= 0)
+			break;
+
+		if (!slept)
+		{
+			INSTR_TIME_SET_CURRENT(sleep_start);
+			slept = true;
+		}
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 Min(delay_ms, 1000),
+						 wait_event);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (slept)
+	{
+		INSTR_TIME_SET_CURRENT(sleep_end);
+		INSTR_TIME_SUBTRACT(sleep_end, sleep_start);
+		*throttle_time += INSTR_TIME_GET_MILLISEC(sleep_end);
+	}
+}
+
+/*
+ * Analyze an index and merge up to max_merges runs of the candidates found
+ *
+ * A single analysis pass feeds all the merges.  The candidates may be stale
+ * by the time we get to them, possibly because of our own earlier merges;
+ * execute_merge() re-validates each one under lock and simply declines
+ * those that no longer qualify.
+ *
+ * The analysis is skipped if the candidate cache holds candidates of an
+ * earlier analysis; they are only brought up to date, and the index is
+ * analyzed after all if no run of them is worth doing anymore.  Planned
+ * runs left over when max_merges runs out are put back into the cache for
+ * the next call.
+ * Runs declined because a page was locked, with skip_locked, are queued
+ * and retried once after all other candidates; those that find a page
+ * locked again go back into the cache as well.
+ * Pages deleted by earlier calls that have become safe to recycle are put
+ * into the free space map first.
+ *
+ * After each merge, the call may sleep to keep to max_wal_rate and
+ * max_replica_lag; no buffer locks are held then.
+ *
+ * With level > 0, the internal pages of that level are merged instead of
+ * the leaves.  With a range, only the leaves in that key range are.  Both
+ * are always analyzed afresh, and their leftovers are not kept, as the
+ * candidate cache only holds candidates of the whole leaf level.
+ *
+ * If batch is not NULL, the analysis reads through its access strategy,
+ * and the merges stop once they have used up its budget; a run that would
+ * overshoot the page budget is cut short.
+ *
+ * The caller must hold ShareUpdateExclusiveLock on the index and, to keep
+ * VACUUM out, on its table; see reclaim_open_index().  The number of pages
+ * deleted and the space they held are added to *pages_merged and
+ * *space_reclaimed.
+ */
+void
+reclaim_index(Relation rel, int max_pct_to_merge, int max_merges,
+			  uint32 level, const ReclaimKeyRange *range, ReclaimBatch *batch,
+			  int64 *pages_merged, int64 *space_reclaimed)
+{
+	bool		use_cache = (level == 0 && range == NULL);
+	Relation	heaprel;
+	MergeCandidates merge_candidates;
+	MergeCandidates cached;
+	MergeCandidates deferred;
+	MergeCandidates still_busy;
+	MergeCandidates *cands;
+	MergeCandidates *busy;
+	MergeRun   *runs;
+	int			nruns;
+	bool	   *planned;
+	bool	   *attempted;
+	int			merges_attempted = 0;
+	int			r;
+	int			i;
+	ReclaimIndexCounters counters;
+	instr_time	start;
+	instr_time	end;
+	int64		start_wal_bytes;
+
+	memset(&counters, 0, sizeof(counters));
+	counters.calls = 1;
+	memset(phase_times, 0, sizeof(phase_times));
+	INSTR_TIME_SET_CURRENT(start);
+
+	reclaim_progress_start_command(RECLAIM_COMMAND_EXECUTE, rel);
+
+	/*
+	 * Needed for the safexid horizon, and to finish incomplete splits; the
+	 * caller has locked it
+	 */
+	heaprel = table_open(rel->rd_index->indrelid, NoLock);
+	pending_free_pages_record(rel, heaprel);
+
+	candidates_init(&merge_candidates);
+
+	/* Reuse the candidates of an earlier analysis if we have them */
+	candidates_init(&cached);
+	if (use_cache && candidate_cache_fetch(rel, max_pct_to_merge, &cached) > 0)
+		refresh_candidates(rel, &cached, &merge_candidates, max_pct_to_merge);
+	candidates_free(&cached);
+
+	/*
+	 * Take the runs best first.  If the cached candidates make no run worth
+	 * doing anymore, analyze afresh; otherwise an index whose cache holds
+	 * only stale or hot pairs would never be analyzed again.
+	 */
+	planned = palloc0(sizeof(bool) * Max(merge_candidates.count, 1));
+	runs = plan_merge_runs(&merge_candidates, &nruns, planned);
+	if (nruns == 0)
+	{
+		pfree(runs);
+		pfree(planned);
+		candidates_free(&merge_candidates);
+		candidates_init(&merge_candidates);
+
+		elog(DEBUG1, "pg_index_reclaim: Starting analysis for index \"%s\" with max_pct_to_merge=%d, level=%u",
+			 RelationGetRelationName(rel), max_pct_to_merge, level);
+		analyze_index_pages(rel, &merge_candidates, max_pct_to_merge, false,
+							level, range, batch ? batch->strategy : NULL);
+
+		planned = palloc0(sizeof(bool) * Max(merge_candidates.count, 1));
+		runs = plan_merge_runs(&merge_candidates, &nruns, planned);
+	}
+
+	elog(DEBUG1, "pg_index_reclaim: Found %d merge candidates", merge_candidates.count);
+
+	/* Execute merges for candidates that can be merged */
+	elog(DEBUG1, "pg_index_reclaim: Processing merge candidates (max %d merges per execution)",
+		 max_merges);
+
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_MERGING);
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	counters.analysis_time = INSTR_TIME_GET_MILLISEC(end);
+	INSTR_TIME_SET_CURRENT(start);
+	start_wal_bytes = pgWalUsage.wal_bytes;
+
+	/* The error path below reports too, and must not have to attach */
+	reclaim_stats_prepare();
+
+	/* Runs that found a page locked go to busy, which is retried once */
+	candidates_init(&deferred);
+	candidates_init(&still_busy);
+	cands = &merge_candidates;
+	busy = &deferred;
+
+	/* Remember which candidates were tried */
+	attempted = palloc0(sizeof(bool) * Max(cands->count, 1));
+
+	r = 0;
+	for (;;)
+	{
+		BlockNumber run[MAX_MERGE_RUN];
+		int			nrun;
+		int			first;
+		bool		merged;
+		MergeAbortReason reason;
+		Size		bytes_moved = 0;
+		instr_time	lock_wait;
+		FullTransactionId safexid;
+
+		if (r >= nruns)
+		{
+			if (cands != &merge_candidates || deferred.count == 0)
+				break;
+			elog(DEBUG1, "pg_index_reclaim: Retrying %d candidates that found a page locked",
+				 deferred.count);
+			pfree(runs);
+			pfree(planned);
+			pfree(attempted);
+			cands = &deferred;
+			busy = &still_busy;
+			planned = palloc0(sizeof(bool) * Max(cands->count, 1));
+			runs = plan_merge_runs(cands, &nruns, planned);
+			attempted = palloc0(sizeof(bool) * Max(cands->count, 1));
+			r = 0;
+			continue;
+		}
+
+		/* Limit the number of merges per execution */
+		if (merges_attempted >= max_merges)
+		{
+			elog(DEBUG1, "pg_index_reclaim: Reached merge limit (%d), stopping", max_merges);
+			break;
+		}
+
+		if (batch != NULL &&
+			((batch->max_pages >= 0 && batch->pages >= batch->max_pages) ||
+			 (batch->max_wal_bytes >= 0 &&
+			  batch->wal_bytes + (pgWalUsage.wal_bytes - start_wal_bytes) >= batch->max_wal_bytes)))
+		{
+			elog(DEBUG1, "pg_index_reclaim: Batch budget used up, stopping");
+			break;
+		}
+
+		vacuum_delay_point(false);
+
+		first = runs[r++].first;
+		(void) collect_merge_run(cands, first, run, &nrun);
+
+		/* Every prefix of a run is a run whose last page has room */
+		if (batch != NULL && batch->max_pages >= 0 &&
+			nrun - 1 > batch->max_pages - batch->pages)
+			nrun = batch->max_pages - batch->pages + 1;
+		for (i = first; i < first + nrun - 1; i++)
+			attempted[i] = true;
+		merges_attempted++;
+		elog(DEBUG1, "pg_index_reclaim: Attempting merge %d/%d: %d pages %u..%u -> %u",
+			 merges_attempted, max_merges, nrun - 1,
+			 run[0], run[nrun - 2], run[nrun - 1]);
+
+		INSTR_TIME_SET_ZERO(lock_wait);
+
+		PG_TRY();
+		{
+			merged = execute_merge(rel, heaprel, level, run, nrun, &reason,
+								   &bytes_moved, &lock_wait, &safexid);
+			if (merged)
+			{
+				int			j;
+
+				for (j = 0; j < nrun - 1; j++)
+					pending_free_pages_add(rel, run[j], safexid);
+				*pages_merged += nrun - 1;
+				*space_reclaimed += (int64) (nrun - 1) * BLCKSZ;
+				reclaim_progress_incr_param(RECLAIM_PROGRESS_MERGES_DONE, 1);
+				reclaim_progress_incr_param(RECLAIM_PROGRESS_PAGES_MERGED, nrun - 1);
+				reclaim_progress_update_wal();
+				elog(DEBUG1, "pg_index_reclaim: Successfully merged %d pages into %u (total merged: " INT64_FORMAT ")",
+					 nrun - 1, run[nrun - 1], *pages_merged);
+			}
+			else
+			{
+				/* Expected when an earlier merge changed these pages */
+				elog(DEBUG1, "pg_index_reclaim: Failed to merge %d pages into %u (merge function returned false)",
+					 nrun - 1, run[nrun - 1]);
+			}
+		}
+		PG_CATCH();
+		{
+			ErrorData *edata;
+
+			/* Get error info */
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			elog(WARNING, "pg_index_reclaim: Error during merge of %d pages into %u: %s - stopping merge execution",
+				 nrun - 1, run[nrun - 1],
+				 edata->message ? edata->message : "unknown error");
+
+			counters.aborts[MERGE_ABORT_ERROR]++;
+			INSTR_TIME_SET_CURRENT(end);
+			INSTR_TIME_SUBTRACT(end, start);
+			counters.merge_time = INSTR_TIME_GET_MILLISEC(end) - counters.throttle_time;
+			counters.wal_bytes = pgWalUsage.wal_bytes - start_wal_bytes;
+			phase_times_report(&counters);
+			reclaim_stats_report(rel, &counters);
+
+			/* Don't continue with more merges after an error */
+			/* Re-throw the error to abort the function */
+			ReThrowError(edata);
+		}
+		PG_END_TRY();
+
+		if (merged)
+		{
+			counters.merges++;
+			counters.pages_deleted += nrun - 1;
+			counters.bytes_moved += bytes_moved;
+			if (batch != NULL)
+				batch->pages += nrun - 1;
+
+			reclaim_throttle(start, pgWalUsage.wal_bytes - start_wal_bytes,
+							 &counters.throttle_time);
+		}
+		else
+		{
+			counters.aborts[reason]++;
+			if (reason == MERGE_ABORT_LOCK_BUSY)
+			{
+				for (i = first; i < first + nrun - 1; i++)
+					*candidates_append(busy) = cands->items[i];
+			}
+		}
+		counters.lock_wait_time += INSTR_TIME_GET_MILLISEC(lock_wait);
+	}
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	counters.merge_time = INSTR_TIME_GET_MILLISEC(end) - counters.throttle_time;
+	counters.wal_bytes = pgWalUsage.wal_bytes - start_wal_bytes;
+	phase_times_report(&counters);
+	reclaim_stats_report(rel, &counters);
+	if (batch != NULL)
+		batch->wal_bytes += counters.wal_bytes;
+
+	/*
+	 * Keep the planned runs we did not get to for the next call, in chain
+	 * order, behind the runs that are still waiting for a retry.  Those
+	 * left out of the plan would only be left out again.
+	 */
+	for (i = 0; i < cands->count; i++)
+	{
+		if (planned[i] && !attempted[i])
+			*candidates_append(busy) = cands->items[i];
+	}
+	if (use_cache)
+		candidate_cache_store(rel, max_pct_to_merge, busy->items, busy->count);
+
+	pfree(runs);
+	pfree(planned);
+	pfree(attempted);
+
+	candidates_free(&still_busy);
+	candidates_free(&deferred);
+	candidates_free(&merge_candidates);
+	table_close(heaprel, NoLock);
+	reclaim_progress_end_command();
+}
+
+/*
+ * Arguments of the SQL-callable functions, which come in several variants
+ */
+typedef struct ReclaimArgs
+{
+	Oid			index_oid;
+	int			max_pct_to_merge;
+	int			max_merges;
+	int			level;
+	bool		sequential;
+	bool		incremental;	/* is since_lsn given? */
+	XLogRecPtr	since_lsn;
+	Oid			bound_type;		/* InvalidOid if there are no key bounds */
+	Datum		lower;
+	bool		lower_isnull;
+	Datum		upper;
+	bool		upper_isnull;
+} ReclaimArgs;
+
+/*
+ * Pick up the key bounds of a *_range() variant, at arguments argno and
+ * argno + 1
+ */
+static void
+reclaim_args_set_range(FunctionCallInfo fcinfo, int argno, ReclaimArgs *args)
+{
+	args->bound_type = get_fn_expr_argtype(fcinfo->flinfo, argno);
+	if (!OidIsValid(args->bound_type))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not determine the type of the key bounds")));
+
+	args->lower_isnull = PG_ARGISNULL(argno);
+	args->lower = args->lower_isnull ? (Datum) 0 : PG_GETARG_DATUM(argno);
+	args->upper_isnull = PG_ARGISNULL(argno + 1);
+	args->upper = args->upper_isnull ? (Datum) 0 : PG_GETARG_DATUM(argno + 1);
+}
+
+/*
+ * Build an insertion scan key on the first column of an index alone
+ *
+ * The value is copied into the current memory context, so that the key
+ * outlives the function call's arguments.
+ */
+static BTScanInsert
+make_bound_key(Relation rel, Datum value, Oid typid)
+{
+	BTScanInsert key = _bt_mkscankey(rel, NULL);
+	int16		typlen;
+	bool		typbyval;
+
+	get_typlenbyval(typid, &typlen, &typbyval);
+
+	key->keysz = 1;
+	key->anynullkeys = false;
+	key->scankeys[0].sk_argument = datumCopy(value, typbyval, typlen);
+	key->scankeys[0].sk_flags &= ~SK_ISNULL;
+
+	return key;
+}
+
+/*
+ * Turn the key bounds of args into a key range of the index
+ *
+ * The bounds must be of the type of the index's first column, or of one
+ * binary coercible to its operator class's input type, as that is what
+ * its comparison function will be handed.  Returns NULL if there are no
+ * bounds.
+ */
+static ReclaimKeyRange *
+make_key_range(Relation rel, const ReclaimArgs *args)
+{
+	ReclaimKeyRange *range;
+	BTScanInsert swap;
+
+	if (!OidIsValid(args->bound_type))
+		return NULL;
+
+	if (!IsBinaryCoercible(args->bound_type, rel->rd_opcintype[0]))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("key bounds of type %s do not match the first column of index \"%s\"",
+						format_type_be(args->bound_type),
+						RelationGetRelationName(rel)),
+				 errhint("Cast the bounds to %s.",
+						 format_type_be(TupleDescAttr(RelationGetDescr(rel), 0)->atttypid))));
+
+	if (args->lower_isnull && args->upper_isnull)
+		return NULL;
+
+	range = (ReclaimKeyRange *) palloc0(sizeof(ReclaimKeyRange));
+	if (!args->lower_isnull)
+		range->lower = make_bound_key(rel, args->lower, args->bound_type);
+	if (!args->upper_isnull)
+		range->upper = make_bound_key(rel, args->upper, args->bound_type);
+
+	/* A descending column comes in the index from its upper bound down */
+	if (rel->rd_indoption[0] & INDOPTION_DESC)
+	{
+		swap = range->lower;
+		range->lower = range->upper;
+		range->upper = swap;
+	}
+
+	return range;
+}
+
+/*
+ * Lock and open a B-tree index whose pages are to be merged or moved, and
+ * its table
+ *
+ * The table is locked before the index, as VACUUM and REINDEX do.  Its
+ * ShareUpdateExclusiveLock keeps VACUUM out while pages change:
+ * btvacuumscan() reads the index in block order, and would miss the items
+ * moved into a block it has already passed.  Close both with
+ * ShareUpdateExclusiveLock.
+ *
+ * As for VACUUM, the caller needs the MAINTAIN privilege on the table.  It
+ * is checked before the table is locked, so that no one can queue up
+ * behind the locks of someone else's table.
+ */
+static Relation
+reclaim_open_index(Oid index_oid, Relation *heaprel)
+{
+	Oid			heap_oid;
+	Relation	rel;
+	AclResult	aclresult;
+
+	heap_oid = IndexGetRelation(index_oid, true);
+	if (!OidIsValid(heap_oid))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an index", get_rel_name(index_oid))));
+	aclresult = pg_class_aclcheck(heap_oid, GetUserId(), ACL_MAINTAIN);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(get_rel_relkind(heap_oid)),
+					   get_rel_name(heap_oid));
+	*heaprel = table_open(heap_oid, ShareUpdateExclusiveLock);
+	rel = index_open(index_oid, ShareUpdateExclusiveLock);
+
+	/* Verify it's a B-tree index */
+	if (rel->rd_rel->relam != BTREE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("index \"%s\" is not a B-tree index",
+						RelationGetRelationName(rel))));
+
+	return rel;
+}
+
+/*
+ * Execute the merges of reclaim_space_execute() or
+ * reclaim_space_execute_range()
+ */
+static Datum
+reclaim_execute_common(FunctionCallInfo fcinfo, const ReclaimArgs *args)
+{
+	Oid			index_oid = args->index_oid;
+	int			max_pct_to_merge = args->max_pct_to_merge;
+	int			max_merges = args->max_merges;
+	int			level = args->level;
+	Relation	heaprel;
+	Relation	rel;
+	ReclaimKeyRange *range;
+	int64		pages_merged = 0;
+	int64		space_reclaimed = 0;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* Validate parameters */
+	if (max_pct_to_merge < 1 || max_pct_to_merge > 100)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_pct_to_merge must be between 1 and 100")));
+	if (max_merges < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_merges must be at least 1")));
+	if (level < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("level must not be negative")));
+
+	rel = reclaim_open_index(index_oid, &heaprel);
+
+	range = make_key_range(rel, args);
+
+	/* Set up return structure */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTemplateTupleDesc(2);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pages_merged",
+					   INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "space_reclaimed",
+					   INT8OID, -1, 0);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	reclaim_index(rel, max_pct_to_merge, max_merges, (uint32) level, range,
+				  NULL, &pages_merged, &space_reclaimed);
+
+	/* Return results */
+	elog(DEBUG1, "pg_index_reclaim: Completed execution - pages_merged=" INT64_FORMAT ", space_reclaimed=" INT64_FORMAT,
+		 pages_merged, space_reclaimed);
+	
+	{
+		Datum		values[2];
+		bool		nulls[2];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(pages_merged);
+		values[1] = Int64GetDatum(space_reclaimed);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* Clean up */
+	index_close(rel, ShareUpdateExclusiveLock);
+	table_close(heaprel, ShareUpdateExclusiveLock);
+
+	elog(DEBUG1, "pg_index_reclaim: reclaim_space_execute completed successfully");
+	return (Datum) 0;
+}
+
+/*
+ * SQL-callable function to execute the merge
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_execute);
+Datum
+pg_index_reclaim_execute(PG_FUNCTION_ARGS)
+{
+	ReclaimArgs args;
+
+	memset(&args, 0, sizeof(args));
+	args.index_oid = PG_GETARG_OID(0);
+	args.max_pct_to_merge = PG_GETARG_INT32(1);
+	args.max_merges = PG_GETARG_INT32(2);
+	args.level = PG_GETARG_INT32(3);
+
+	return reclaim_execute_common(fcinfo, &args);
+}
+
+/*
+ * SQL-callable function to execute the merge on a key range of the leaves
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_execute_range);
+Datum
+pg_index_reclaim_execute_range(PG_FUNCTION_ARGS)
+{
+	ReclaimArgs args;
+
+	memset(&args, 0, sizeof(args));
+	args.index_oid = PG_GETARG_OID(0);
+	reclaim_args_set_range(fcinfo, 1, &args);
+	args.max_pct_to_merge = PG_GETARG_INT32(3);
+	args.max_merges = PG_GETARG_INT32(4);
+
+	return reclaim_execute_common(fcinfo, &args);
+}
+
+/*
+ * Online compaction: moving live pages down and truncating the file
+ *
+ * Merging frees pages inside the index, but the file only shrinks when its
+ * tail is free.  reclaim_space_compact() moves the live pages with the
+ * highest block numbers into the lowest free blocks, so that the pages
+ * left free at the end can be cut off, the way VACUUM truncates a heap.
+ *
+ * A page is moved by copying it into the free block and pointing every
+ * link to it at the copy: its siblings' links, its downlink in the parent
+ * and, for the root or the fast root, the metapage.  That can be five
+ * buffers, one more than a generic WAL record covers.  A page without a
+ * left or without a right sibling needs at most four, and is copied in
+ * one record.  A page with both is moved in two records, each of which
+ * leaves a consistent tree: it is split into the free block as
+ * _bt_split() would split it, keeping only its first item, and what is
+ * left of it is then merged into the new right half as execute_merge()
+ * would merge it.  All the pages of both records are locked and checked
+ * before the first is written, so the move is never left half done.
+ *
+ * Either way the page is marked deleted, with its right link pointing to
+ * where its items went, so that scans and descents that still land on it
+ * move on to them, as over any deleted page.  It can be recycled, and cut
+ * off if it is at the end, once its safexid is old enough, which is never
+ * the case yet in the call that moved it.
+ */
+
+/* As in lazy_truncate_heap(), the lock is retried for up to 5 seconds */
+#define COMPACT_TRUNCATE_LOCK_WAIT_INTERVAL	50	/* ms */
+#define COMPACT_TRUNCATE_LOCK_TIMEOUT		5000	/* ms */
+
+typedef enum RelocateResult
+{
+	RELOCATE_DONE,				/* the page was moved */
+	RELOCATE_SKIP_PAGE,			/* the page can't be moved for now */
+	RELOCATE_SKIP_TARGET,		/* the free block is no longer free */
+} RelocateResult;
+
+/*
+ * Lock the free block a page is to be moved to
+ *
+ * An insert may have taken the block from the free space map meanwhile.
+ * As _bt_allocbuf() does, a lock held by someone else is not waited for,
+ * and the block is checked to be still free once we have it.  Returns
+ * InvalidBuffer if the block can't be used.
+ *
+ * A deleted page is about to get new contents, while queries on a hot
+ * standby may still hold links to it from before it was deleted.  As
+ * _bt_log_reuse_page() does, an XLOG_BTREE_REUSE_PAGE record with the
+ * page's safexid makes the standby cancel those whose snapshots are older
+ * before the page is overwritten there.
+ */
+static Buffer
+compact_lock_target(Relation rel, Relation heaprel, BlockNumber blkno)
+{
+	Buffer		buf;
+	Page		page;
 
-	/* Validate left page */
-	if (!P_ISLEAF(left_opaque))
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	if (!ConditionalLockBuffer(buf))
 	{
-		elog(DEBUG1, "pg_index_reclaim: Left page %u is not a leaf page (level %u), aborting",
-			 left_block, left_opaque->btpo_level);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		ReleaseBuffer(buf);
+		return InvalidBuffer;
 	}
-	if (P_ISDELETED(left_opaque))
+	page = BufferGetPage(buf);
+	if (!BTPageIsRecyclable(page, heaprel))
 	{
-		elog(DEBUG1, "pg_index_reclaim: Left page %u is already deleted, aborting", left_block);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		UnlockReleaseBuffer(buf);
+		return InvalidBuffer;
 	}
-	if (P_ISHALFDEAD(left_opaque))
+
+	if (!PageIsNew(page) && RelationNeedsWAL(rel) && XLogStandbyInfoActive())
 	{
-		elog(DEBUG1, "pg_index_reclaim: Left page %u is half-dead, aborting", left_block);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		xl_btree_reuse_page xlrec_reuse;
+
+		xlrec_reuse.locator = rel->rd_locator;
+		xlrec_reuse.block = blkno;
+		xlrec_reuse.snapshotConflictHorizon = BTPageGetDeleteXid(page);
+		xlrec_reuse.isCatalogRel = RelationIsAccessibleInLogicalDecoding(heaprel);
+
+		XLogBeginInsert();
+		XLogRegisterData((char *) &xlrec_reuse, SizeOfBtreeReusePage);
+		XLogInsert(RM_BTREE_ID, XLOG_BTREE_REUSE_PAGE);
 	}
 
-	elog(DEBUG1, "pg_index_reclaim: Left page %u validated: prev=%u, next=%u, flags=0x%x",
-		 left_block, left_opaque->btpo_prev, left_opaque->btpo_next, left_opaque->btpo_flags);
+	return buf;
+}
 
-	/* Get right page */
-	elog(DEBUG1, "pg_index_reclaim: Locking right page %u", right_block);
-	right_buf = ReadBufferExtended(rel, MAIN_FORKNUM, right_block, RBM_NORMAL, NULL);
-	LockBuffer(right_buf, BT_WRITE);
-	right_page = BufferGetPage(right_buf);
+/*
+ * Find the way to the parent of a rightmost page of the given level
+ *
+ * find_parent() descends with the page's high key, which a rightmost page
+ * lacks.  Its downlink is on the rightmost page of the level above,
+ * though, so, as _bt_insert_parent() does after a concurrent root split,
+ * this sets up a phony stack entry there, from which _bt_getstackbuf()
+ * searches the page and those right of it.  Free the stack with
+ * _bt_freestack().
+ */
+static BTStack
+find_rightmost_parent(Relation rel, uint32 level)
+{
+	Buffer		buf;
+	BTStack		stack;
 
-	if (PageIsNew(right_page))
+	buf = _bt_get_endpoint(rel, level + 1, true);
+	if (!BufferIsValid(buf))
+		return NULL;
+
+	stack = (BTStack) palloc(sizeof(BTStackData));
+	stack->bts_blkno = BufferGetBlockNumber(buf);
+	stack->bts_offset = InvalidOffsetNumber;
+	stack->bts_parent = NULL;
+	_bt_relbuf(rel, buf);
+
+	return stack;
+}
+
+/*
+ * Move a page that lacks a left or a right sibling to the free block
+ * newblkno, in one record
+ *
+ * seen is the page's special space as last seen unlocked; the move is
+ * declined if the page has changed since.  Locks are taken as in page
+ * deletion: the left sibling before the page, the page before its right
+ * sibling, children before the parent and the metapage last.  The
+ * metapage is only ever needed for a page alone on its level, which has
+ * no sibling to relink; a page with a sibling that the metapage still
+ * points to stays where it is.
+ */
+static RelocateResult
+relocate_page_copy(Relation rel, Relation heaprel, BlockNumber blkno,
+				   BlockNumber newblkno, const BTPageOpaqueData *seen,
+				   FullTransactionId *safexid)
+{
+	uint32		level = seen->btpo_level;
+	bool		isroot = (bool) P_ISROOT(seen);
+	bool		alone = P_LEFTMOST(seen) && P_RIGHTMOST(seen);
+	BTStack		stack = NULL;
+	BTStack		pstack = NULL;
+	Buffer		left_buf = InvalidBuffer;
+	Buffer		buf;
+	Buffer		newbuf = InvalidBuffer;
+	Buffer		right_buf = InvalidBuffer;
+	Buffer		parent_buf = InvalidBuffer;
+	Buffer		metabuf = InvalidBuffer;
+	Page		page;
+	BTPageOpaque opaque;
+	BTMetaPageData *metad;
+	GenericXLogState *state;
+	Page		hpage;
+	Page		npage;
+	BTPageOpaque hopaque;
+	RelocateResult result = RELOCATE_SKIP_PAGE;
+
+	/* Find the way to the parent before locking anything */
+	if (!isroot)
 	{
-		elog(DEBUG1, "pg_index_reclaim: Right page %u is new/uninitialized, aborting", right_block);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		if (P_RIGHTMOST(seen))
+			stack = pstack = find_rightmost_parent(rel, level);
+		else
+			stack = find_parent(rel, heaprel, blkno, level, &pstack);
+		if (stack == NULL)
+			return RELOCATE_SKIP_PAGE;
 	}
 
-	right_opaque = BTPageGetOpaque(right_page);
-
-	/* Validate right page and sibling relationship */
-	if (!P_ISLEAF(right_opaque))
+	if (!P_LEFTMOST(seen))
 	{
-		elog(DEBUG1, "pg_index_reclaim: Right page %u is not a leaf page (level %u), aborting",
-			 right_block, right_opaque->btpo_level);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		left_buf = ReadBufferExtended(rel, MAIN_FORKNUM, seen->btpo_prev,
+									  RBM_NORMAL, NULL);
+		LockBuffer(left_buf, BT_WRITE);
 	}
-	if (P_ISDELETED(right_opaque))
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BT_WRITE);
+	page = BufferGetPage(buf);
+	opaque = BTPageGetOpaque(page);
+	if (PageIsNew(page) || P_IGNORE(opaque) || P_INCOMPLETE_SPLIT(opaque) ||
+		opaque->btpo_level != level || (bool) P_ISROOT(opaque) != isroot ||
+		opaque->btpo_prev != seen->btpo_prev ||
+		opaque->btpo_next != seen->btpo_next)
 	{
-		elog(DEBUG1, "pg_index_reclaim: Right page %u is already deleted, aborting", right_block);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		elog(DEBUG1, "pg_index_reclaim: Page %u changed before it could be moved", blkno);
+		goto done;
 	}
-	if (P_ISHALFDEAD(right_opaque))
+	if (BufferIsValid(left_buf) &&
+		BTPageGetOpaque(BufferGetPage(left_buf))->btpo_next != blkno)
 	{
-		elog(DEBUG1, "pg_index_reclaim: Right page %u is half-dead, aborting", right_block);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		elog(DEBUG1, "pg_index_reclaim: Left sibling of page %u changed, not moving it", blkno);
+		goto done;
 	}
 
-	if (right_opaque->btpo_prev != left_block)
+	newbuf = compact_lock_target(rel, heaprel, newblkno);
+	if (!BufferIsValid(newbuf))
 	{
-		elog(DEBUG1, "pg_index_reclaim: Sibling relationship mismatch: right page %u prev=%u, expected %u, aborting",
-			 right_block, right_opaque->btpo_prev, left_block);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		elog(DEBUG1, "pg_index_reclaim: Block %u is no longer free", newblkno);
+		result = RELOCATE_SKIP_TARGET;
+		goto done;
 	}
 
-	elog(DEBUG1, "pg_index_reclaim: Right page %u validated: prev=%u, next=%u, flags=0x%x",
-		 right_block, right_opaque->btpo_prev, right_opaque->btpo_next, right_opaque->btpo_flags);
-
-	/* Get sibling information */
-	leftsib = left_opaque->btpo_prev;
-	rightsib = right_opaque->btpo_next;
-	is_rightmost = P_RIGHTMOST(right_opaque);
-
-	elog(DEBUG1, "pg_index_reclaim: Sibling info: leftsib=%u, rightsib=%u, is_rightmost=%d",
-		 leftsib, rightsib, is_rightmost);
-
-	/* Lock right sibling if it exists (for updating its left-link) */
-	if (!is_rightmost)
+	if (!P_RIGHTMOST(opaque))
 	{
-		elog(DEBUG1, "pg_index_reclaim: Locking right sibling page %u", rightsib);
-		right_sibling_buf = ReadBufferExtended(rel, MAIN_FORKNUM, rightsib,
-											   RBM_NORMAL, NULL);
-		LockBuffer(right_sibling_buf, BT_WRITE);
-		right_sibling_opaque = BTPageGetOpaque(BufferGetPage(right_sibling_buf));
-
-		/* Validate right sibling's left-link */
-		if (right_sibling_opaque->btpo_prev != right_block)
+		right_buf = ReadBufferExtended(rel, MAIN_FORKNUM, opaque->btpo_next,
+									   RBM_NORMAL, NULL);
+		LockBuffer(right_buf, BT_WRITE);
+		if (BTPageGetOpaque(BufferGetPage(right_buf))->btpo_prev != blkno)
 		{
-			elog(DEBUG1, "pg_index_reclaim: Right sibling %u prev=%u, expected %u, aborting",
-				 rightsib, right_sibling_opaque->btpo_prev, right_block);
-			UnlockReleaseBuffer(right_sibling_buf);
-			UnlockReleaseBuffer(right_buf);
-			UnlockReleaseBuffer(left_buf);
-			return false;
+			elog(DEBUG1, "pg_index_reclaim: Right sibling of page %u changed, not moving it", blkno);
+			goto done;
 		}
-		elog(DEBUG1, "pg_index_reclaim: Right sibling %u validated", rightsib);
 	}
 
-	/* Lock left sibling if it exists - BEFORE critical section */
-	if (leftsib != P_NONE)
+	if (!isroot)
 	{
-		elog(DEBUG1, "pg_index_reclaim: Locking left sibling page %u", leftsib);
-		left_sibling_buf = ReadBufferExtended(rel, MAIN_FORKNUM, leftsib,
-											  RBM_NORMAL, NULL);
-		LockBuffer(left_sibling_buf, BT_WRITE);
-		left_sibling_page = BufferGetPage(left_sibling_buf);
-		left_sibling_opaque = BTPageGetOpaque(left_sibling_page);
-
-		/* Validate left sibling's right-link */
-		if (left_sibling_opaque->btpo_next != left_block)
+		parent_buf = _bt_getstackbuf(rel, heaprel, pstack, blkno);
+		if (!BufferIsValid(parent_buf))
 		{
-			elog(DEBUG1, "pg_index_reclaim: Left sibling %u next=%u, expected %u, aborting",
-				 leftsib, left_sibling_opaque->btpo_next, left_block);
-			UnlockReleaseBuffer(left_sibling_buf);
-			if (BufferIsValid(right_sibling_buf))
-				UnlockReleaseBuffer(right_sibling_buf);
-			UnlockReleaseBuffer(right_buf);
-			UnlockReleaseBuffer(left_buf);
-			return false;
+			elog(DEBUG1, "pg_index_reclaim: Downlink to page %u not found, not moving it", blkno);
+			goto done;
 		}
-		elog(DEBUG1, "pg_index_reclaim: Left sibling %u validated", leftsib);
 	}
 
-	/* Get page statistics */
-	left_maxoff = PageGetMaxOffsetNumber(left_page);
-	right_maxoff = PageGetMaxOffsetNumber(right_page);
-	left_firstdata = P_FIRSTDATAKEY(left_opaque);
-	right_firstdata = P_FIRSTDATAKEY(right_opaque);
+	metabuf = ReadBufferExtended(rel, MAIN_FORKNUM, BTREE_METAPAGE,
+								 RBM_NORMAL, NULL);
+	LockBuffer(metabuf, alone ? BT_WRITE : BT_READ);
+	metad = BTPageGetMeta(BufferGetPage(metabuf));
+	if (metad->btm_root != blkno && metad->btm_fastroot != blkno)
+	{
+		UnlockReleaseBuffer(metabuf);
+		metabuf = InvalidBuffer;
+	}
+	else if (!alone)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Page %u is the fast root but has a sibling, not moving it", blkno);
+		goto done;
+	}
 
-	elog(DEBUG1, "pg_index_reclaim: Page stats - left: maxoff=%u, firstdata=%u; right: maxoff=%u, firstdata=%u",
-		 left_maxoff, left_firstdata, right_maxoff, right_firstdata);
+	*safexid = ReadNextFullTransactionId();
 
-	/* Check if we have space - should have been validated by analyze, but double-check */
+	state = GenericXLogStart(rel);
+	hpage = GenericXLogRegisterBuffer(state, buf, 0);
+	npage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+	if (BufferIsValid(left_buf))
+		BTPageGetOpaque(GenericXLogRegisterBuffer(state, left_buf, 0))->btpo_next = newblkno;
+	if (BufferIsValid(right_buf))
+		BTPageGetOpaque(GenericXLogRegisterBuffer(state, right_buf, 0))->btpo_prev = newblkno;
+	if (BufferIsValid(parent_buf))
 	{
-		Size total_used = 0;
-		Size available_space;
+		Page		ppage = GenericXLogRegisterBuffer(state, parent_buf, 0);
+		IndexTuple	pitup;
 
-		for (offnum = left_firstdata; offnum <= left_maxoff; offnum++)
-		{
-			itemid = PageGetItemId(left_page, offnum);
-			if (!ItemIdIsUsed(itemid))
-			{
-				elog(WARNING, "pg_index_reclaim: Left page %u has unused item at offset %u", left_block, offnum);
-				continue;
-			}
-			total_used += MAXALIGN(ItemIdGetLength(itemid));
-		}
-		for (offnum = right_firstdata; offnum <= right_maxoff; offnum++)
-		{
-			itemid = PageGetItemId(right_page, offnum);
-			if (!ItemIdIsUsed(itemid))
-			{
-				elog(WARNING, "pg_index_reclaim: Right page %u has unused item at offset %u", right_block, offnum);
-				continue;
-			}
-			total_used += MAXALIGN(ItemIdGetLength(itemid));
-		}
+		pitup = (IndexTuple) PageGetItem(ppage,
+										 PageGetItemId(ppage, pstack->bts_offset));
+		BTreeTupleSetDownLink(pitup, newblkno);
+	}
+	if (BufferIsValid(metabuf))
+	{
+		Assert(!BufferIsValid(left_buf) && !BufferIsValid(right_buf));
+		metad = BTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+		if (metad->btm_root == blkno)
+			metad->btm_root = newblkno;
+		if (metad->btm_fastroot == blkno)
+			metad->btm_fastroot = newblkno;
+	}
 
-		available_space = PageGetFreeSpace(right_page);
-		elog(DEBUG1, "pg_index_reclaim: Space check - total_used=%zu, available_space=%zu",
-			 total_used, available_space);
+	memcpy(npage, hpage, BLCKSZ);
+	BTPageGetOpaque(npage)->btpo_cycleid = 0;
 
-		if (total_used > available_space)
-		{
-			elog(DEBUG1, "pg_index_reclaim: Not enough space (%zu > %zu), aborting",
-				 total_used, available_space);
-			/* Not enough space - abort */
-			if (BufferIsValid(left_sibling_buf))
-				UnlockReleaseBuffer(left_sibling_buf);
-			if (BufferIsValid(right_sibling_buf))
-				UnlockReleaseBuffer(right_sibling_buf);
-			UnlockReleaseBuffer(right_buf);
-			UnlockReleaseBuffer(left_buf);
-			return false;
-		}
-	}
+	/* Scans that still land on the page move right, onto its copy */
+	BTPageSetDeleted(hpage, *safexid);
+	hopaque = BTPageGetOpaque(hpage);
+	hopaque->btpo_flags &= ~BTP_ROOT;
+	hopaque->btpo_next = newblkno;
+	hopaque->btpo_cycleid = 0;
 
-	/*
-	 * Allocate all memory BEFORE critical section - palloc can throw errors
-	 */
-	nleft_items = left_maxoff - left_firstdata + 1;
-	if (nleft_items <= 0)
-	{
-		elog(DEBUG1, "pg_index_reclaim: No items to move from left page %u, aborting", left_block);
-		if (BufferIsValid(left_sibling_buf))
-			UnlockReleaseBuffer(left_sibling_buf);
-		if (BufferIsValid(right_sibling_buf))
-			UnlockReleaseBuffer(right_sibling_buf);
+	(void) GenericXLogFinish(state);
+	result = RELOCATE_DONE;
+
+done:
+	if (BufferIsValid(metabuf))
+		UnlockReleaseBuffer(metabuf);
+	if (BufferIsValid(parent_buf))
+		UnlockReleaseBuffer(parent_buf);
+	if (BufferIsValid(right_buf))
 		UnlockReleaseBuffer(right_buf);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(left_buf))
 		UnlockReleaseBuffer(left_buf);
-		return false;
+	if (stack != NULL)
+		_bt_freestack(stack);
+
+	if (result == RELOCATE_DONE)
+	{
+		RecordUsedIndexPage(rel, newblkno);
+
+		/* As after a merge, have every backend read the new root */
+		if (BufferIsValid(metabuf))
+			CacheInvalidateRelcache(rel);
 	}
 
-	elog(DEBUG1, "pg_index_reclaim: Allocating arrays for %d items (BEFORE critical section)", nleft_items);
-	left_offsets = (OffsetNumber *) palloc(sizeof(OffsetNumber) * nleft_items);
+	return result;
+}
 
-	/* Also pre-allocate the deletable array for marking left page half-dead */
-	ndeletable = left_maxoff - left_firstdata + 1;
-	if (ndeletable > 0)
-		deletable = (OffsetNumber *) palloc(sizeof(OffsetNumber) * ndeletable);
+/*
+ * Move a page that has siblings on both sides to the free block newblkno,
+ * in two records
+ *
+ * The first record splits the page the way _bt_split() would, with the
+ * free block as the right half.  The page keeps only its first data item
+ * and gets the separator in front of the second as its new high key; the
+ * right half gets all other items, the page's old high key and a downlink
+ * right after the page's own.  That takes the page, its right sibling,
+ * the free block and the parent.  The second record merges the page into
+ * the right half as execute_merge() would, which takes the page, the free
+ * block, the left sibling and the parent.
+ *
+ * All five pages are locked, in execute_merge()'s order, and checked
+ * before the first record is written, and stay locked until the second
+ * one is: nothing can then keep the merge from going through, and the
+ * split is never left behind on its own.  The merged page holds exactly
+ * the items the page had, so it fits.
+ */
+static RelocateResult
+relocate_page_split(Relation rel, Relation heaprel, BlockNumber blkno,
+					BlockNumber newblkno, const BTPageOpaqueData *seen,
+					FullTransactionId *safexid)
+{
+	uint32		level = seen->btpo_level;
+	BTStack		stack;
+	BTStack		pstack;
+	Buffer		left_buf = InvalidBuffer;
+	Buffer		buf;
+	Buffer		newbuf = InvalidBuffer;
+	Buffer		right_buf = InvalidBuffer;
+	Buffer		parent_buf = InvalidBuffer;
+	BlockNumber leftsib;
+	Page		page;
+	BTPageOpaque opaque;
+	OffsetNumber firstoff;
+	IndexTuple	firstitem;
+	IndexTuple	seconditem;
+	IndexTuple	highkey = NULL;
+	IndexTuple	pivot = NULL;
+	IndexTuple	pitup;
+	ItemId		itemid;
+	GenericXLogState *state;
+	Page		hpage;
+	Page		npage;
+	Page		ppage;
+	Page		lpage;
+	Page		newpage;
+	BTPageOpaque hopaque;
+	BTPageOpaque nopaque;
+	OffsetNumber next;
+	RelocateResult result = RELOCATE_SKIP_PAGE;
+	MergeAbortReason reason;
+	instr_time	lock_wait;
+
+	stack = find_parent(rel, heaprel, blkno, level, &pstack);
+	if (stack == NULL)
+		return RELOCATE_SKIP_PAGE;
+
+	INSTR_TIME_SET_ZERO(lock_wait);
+	if (!lock_left_sibling(rel, blkno, &lock_wait, &left_buf, &leftsib, &reason))
+	{
+		_bt_freestack(stack);
+		return RELOCATE_SKIP_PAGE;
+	}
 
-	/*
-	 * Collect left page item offsets and calculate total size (before crit section)
-	 */
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BT_WRITE);
+	page = BufferGetPage(buf);
+	opaque = BTPageGetOpaque(page);
+	if (!BufferIsValid(left_buf) || PageIsNew(page) || P_IGNORE(opaque) ||
+		P_INCOMPLETE_SPLIT(opaque) || opaque->btpo_level != level ||
+		opaque->btpo_prev != leftsib || P_RIGHTMOST(opaque))
 	{
-		int i = 0;
-		for (offnum = left_firstdata; offnum <= left_maxoff; offnum++)
-		{
-			itemid = PageGetItemId(left_page, offnum);
-			if (!ItemIdIsUsed(itemid))
-			{
-				elog(DEBUG1, "pg_index_reclaim: Skipping unused item at offset %u", offnum);
-				continue;
-			}
-			left_offsets[i] = offnum;
-			left_items_total_size += MAXALIGN(ItemIdGetLength(itemid));
-			i++;
-		}
-		nleft_items = i;  /* Update actual count */
+		elog(DEBUG1, "pg_index_reclaim: Page %u changed before it could be moved", blkno);
+		goto done;
 	}
-	elog(DEBUG1, "pg_index_reclaim: Collected %d valid items from L page, total_size=%zu",
-		 nleft_items, left_items_total_size);
 
-	if (nleft_items == 0)
+	/* The page keeps its first data item, and needs a second one to give */
+	firstoff = P_FIRSTDATAKEY(opaque);
+	if (PageGetMaxOffsetNumber(page) < OffsetNumberNext(firstoff))
 	{
-		elog(DEBUG1, "pg_index_reclaim: No valid items to move, aborting");
-		pfree(left_offsets);
-		if (deletable)
-			pfree(deletable);
-		if (BufferIsValid(left_sibling_buf))
-			UnlockReleaseBuffer(left_sibling_buf);
-		if (BufferIsValid(right_sibling_buf))
-			UnlockReleaseBuffer(right_sibling_buf);
-		UnlockReleaseBuffer(right_buf);
-		UnlockReleaseBuffer(left_buf);
-		return false;
+		elog(DEBUG1, "pg_index_reclaim: Page %u has fewer than two items, not moving it", blkno);
+		goto done;
 	}
 
-	/*
-	 * Start critical section - no errors allowed from here until END_CRIT_SECTION.
-	 * All allocations done above, all buffers acquired above.
-	 *
-	 * Merge strategy: We'll add items from the left page to the right page
-	 * using PageAddItem(), which properly handles page layout.
-	 */
-	elog(DEBUG1, "pg_index_reclaim: Starting critical section for merge");
-	START_CRIT_SECTION();
+	newbuf = compact_lock_target(rel, heaprel, newblkno);
+	if (!BufferIsValid(newbuf))
+	{
+		elog(DEBUG1, "pg_index_reclaim: Block %u is no longer free", newblkno);
+		result = RELOCATE_SKIP_TARGET;
+		goto done;
+	}
+
+	right_buf = ReadBufferExtended(rel, MAIN_FORKNUM, opaque->btpo_next,
+								   RBM_NORMAL, NULL);
+	LockBuffer(right_buf, BT_WRITE);
+	if (BTPageGetOpaque(BufferGetPage(right_buf))->btpo_prev != blkno)
+	{
+		elog(DEBUG1, "pg_index_reclaim: Right sibling of page %u changed, not moving it", blkno);
+		goto done;
+	}
 
 	/*
-	 * Step 1: Add items from left page to right page using PageAddItem.
-	 * We add them one by one at the end of the right page's data.
+	 * The separator becomes the page's high key and, with a downlink to the
+	 * right half, goes into the parent.  As in _bt_split(), it is the
+	 * suffix-truncated boundary of the two items on leaves, and the first
+	 * item of the right half on internal pages.
 	 */
-	elog(DEBUG1, "pg_index_reclaim: Adding %d items from left page to right page", nleft_items);
-
+	firstitem = (IndexTuple) PageGetItem(page, PageGetItemId(page, firstoff));
+	seconditem = (IndexTuple) PageGetItem(page,
+										  PageGetItemId(page, OffsetNumberNext(firstoff)));
+	if (P_ISLEAF(opaque))
 	{
-		int i;
-		int items_added = 0;
-
-		for (i = 0; i < nleft_items; i++)
-		{
-			Size itemsz;
-			IndexTuple itup;
-			OffsetNumber newoff;
-
-			offnum = left_offsets[i];
-			itemid = PageGetItemId(left_page, offnum);
+		BTScanInsert itup_key = _bt_mkscankey(rel, NULL);
 
-			Assert(ItemIdIsUsed(itemid));
+		highkey = _bt_truncate(rel, firstitem, seconditem, itup_key);
+		pfree(itup_key);
+	}
+	else
+		highkey = CopyIndexTuple(seconditem);
+	pivot = CopyIndexTuple(highkey);
+	BTreeTupleSetDownLink(pivot, newblkno);
 
-			itemsz = ItemIdGetLength(itemid);
-			itup = (IndexTuple) PageGetItem(left_page, itemid);
+	parent_buf = _bt_getstackbuf(rel, heaprel, pstack, blkno);
+	if (!BufferIsValid(parent_buf))
+	{
+		elog(DEBUG1, "pg_index_reclaim: Downlink to page %u not found, not moving it", blkno);
+		goto done;
+	}
+	if (PageGetFreeSpace(BufferGetPage(parent_buf)) < MAXALIGN(IndexTupleSize(pivot)))
+	{
+		elog(DEBUG1, "pg_index_reclaim: No room for a downlink in parent %u, not moving page %u",
+			 BufferGetBlockNumber(parent_buf), blkno);
+		goto done;
+	}
 
-			/*
-			 * Add the item to the right page. We use InvalidOffsetNumber
-			 * to add at the end of the page's items.
-			 */
-			newoff = PageAddItem(right_page, (char *) itup, itemsz,
-								 InvalidOffsetNumber, false, false);
+	/* First record: split the page into the free block */
+	state = GenericXLogStart(rel);
+	hpage = GenericXLogRegisterBuffer(state, buf, 0);
+	npage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+	BTPageGetOpaque(GenericXLogRegisterBuffer(state, right_buf, 0))->btpo_prev = newblkno;
+	ppage = GenericXLogRegisterBuffer(state, parent_buf, 0);
 
-			if (newoff == InvalidOffsetNumber)
-			{
-				elog(WARNING, "pg_index_reclaim: Failed to add item %d from left page", i);
-				/* Continue trying other items */
-			}
-			else
-			{
-				items_added++;
-				elog(DEBUG1, "pg_index_reclaim: Added L item %d (size %zu) to R at offset %u",
-					 i, itemsz, newoff);
-			}
+	PG_TRY();
+	{
+		/* The right half: the old high key, then the items after the first */
+		_bt_pageinit(npage, BufferGetPageSize(newbuf));
+		nopaque = BTPageGetOpaque(npage);
+		nopaque->btpo_prev = blkno;
+		nopaque->btpo_next = opaque->btpo_next;
+		nopaque->btpo_level = level;
+		nopaque->btpo_flags = opaque->btpo_flags &
+			~(BTP_ROOT | BTP_SPLIT_END | BTP_HAS_GARBAGE | BTP_INCOMPLETE_SPLIT);
+		nopaque->btpo_cycleid = 0;
+
+		itemid = PageGetItemId(page, P_HIKEY);
+		if (PageAddItem(npage, PageGetItem(page, itemid), ItemIdGetLength(itemid),
+						P_HIKEY, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add high key to page %u in index \"%s\"",
+				 newblkno, RelationGetRelationName(rel));
+		next = OffsetNumberNext(P_HIKEY);
+		if (P_ISLEAF(opaque))
+			append_page_items(rel, npage, &next, page,
+							  OffsetNumberNext(firstoff), blkno);
+		else
+		{
+			IndexTupleData trunctuple;
+
+			/* Its first downlink loses its key, as in _bt_pgaddtup() */
+			trunctuple = *seconditem;
+			trunctuple.t_info = sizeof(IndexTupleData);
+			BTreeTupleSetNAtts(&trunctuple, 0, false);
+			if (PageAddItem(npage, (Item) &trunctuple, sizeof(IndexTupleData),
+							next, false, false) == InvalidOffsetNumber)
+				elog(ERROR, "failed to add minus infinity item to page %u in index \"%s\"",
+					 newblkno, RelationGetRelationName(rel));
+			next++;
+			append_page_items(rel, npage, &next, page,
+							  OffsetNumberNext(OffsetNumberNext(firstoff)), blkno);
 		}
 
-		elog(DEBUG1, "pg_index_reclaim: Added %d of %d items from left to right page",
-			 items_added, nleft_items);
+		/* The left half: the separator as high key, then the first item */
+		newpage = PageGetTempPageCopySpecial(hpage);
+		if (PageAddItem(newpage, (Item) highkey, IndexTupleSize(highkey),
+						P_HIKEY, false, false) == InvalidOffsetNumber ||
+			PageAddItem(newpage, (Item) firstitem, IndexTupleSize(firstitem),
+						OffsetNumberNext(P_HIKEY), false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add items to split page %u in index \"%s\"",
+				 blkno, RelationGetRelationName(rel));
+		PageRestoreTempPage(newpage, hpage);
+		hopaque = BTPageGetOpaque(hpage);
+		hopaque->btpo_next = newblkno;
+		hopaque->btpo_flags &= ~(BTP_SPLIT_END | BTP_HAS_GARBAGE);
+		hopaque->btpo_cycleid = 0;
+
+		if (PageAddItem(ppage, (Item) pivot, IndexTupleSize(pivot),
+						OffsetNumberNext(pstack->bts_offset),
+						false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add downlink to page %u to parent %u in index \"%s\"",
+				 newblkno, BufferGetBlockNumber(parent_buf),
+				 RelationGetRelationName(rel));
+	}
+	PG_CATCH();
+	{
+		GenericXLogAbort(state);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	/* Re-get right page opaque after inserting items */
-	right_opaque = BTPageGetOpaque(right_page);
-	right_maxoff = PageGetMaxOffsetNumber(right_page);
-	right_firstdata = P_FIRSTDATAKEY(right_opaque);
+	(void) GenericXLogFinish(state);
 
-	elog(DEBUG1, "pg_index_reclaim: After insertion - right page: maxoff=%u, firstdata=%u, rightmost=%d",
-		 right_maxoff, right_firstdata, P_RIGHTMOST(right_opaque));
+	elog(DEBUG1, "pg_index_reclaim: Split page %u into free block %u", blkno, newblkno);
 
 	/*
-	 * Step 2: Update the high key on the right page if needed.
-	 * The merged page should have the high key from the LEFT page
-	 * (since we're deleting the left page).
+	 * Second record: fold what is left of the page into the right half, as
+	 * execute_merge() does.  The page's downlink now points to the right
+	 * half, whose own downlink goes away, and the page is marked deleted.
 	 */
-	elog(DEBUG1, "pg_index_reclaim: Checking high key - left rightmost=%d, right rightmost=%d",
-		 P_RIGHTMOST(left_opaque), P_RIGHTMOST(right_opaque));
+	*safexid = ReadNextFullTransactionId();
+
+	state = GenericXLogStart(rel);
+	hpage = GenericXLogRegisterBuffer(state, buf, 0);
+	npage = GenericXLogRegisterBuffer(state, newbuf, 0);
+	lpage = GenericXLogRegisterBuffer(state, left_buf, 0);
+	ppage = GenericXLogRegisterBuffer(state, parent_buf, 0);
 
-	if (!P_RIGHTMOST(left_opaque))
+	PG_TRY();
 	{
-		ItemId		left_hikey_itemid;
+		rebuild_merged_page(rel, npage, newblkno, hpage, blkno, false);
+		BTPageGetOpaque(npage)->btpo_prev = leftsib;
+		BTPageGetOpaque(lpage)->btpo_next = newblkno;
 
-		elog(DEBUG1, "pg_index_reclaim: Left page %u has high key, need to update right page %u",
-			 left_block, right_block);
+		pitup = (IndexTuple) PageGetItem(ppage,
+										 PageGetItemId(ppage, pstack->bts_offset));
+		BTreeTupleSetDownLink(pitup, newblkno);
+		PageIndexTupleDelete(ppage, OffsetNumberNext(pstack->bts_offset));
 
-		left_hikey_itemid = PageGetItemId(left_page, P_HIKEY);
-		if (ItemIdIsUsed(left_hikey_itemid) && ItemIdHasStorage(left_hikey_itemid))
-		{
-			/*
-			 * The right page's current high key should remain (it's the upper bound
-			 * for this page). After merging, the right page now contains items from
-			 * the left page, but the high key should still be the ORIGINAL right
-			 * page's high key (if it had one), because that's the upper bound that
-			 * parent pages expect.
-			 *
-			 * The left page's high key was the separator between left and right,
-			 * but now that they're merged, we don't need it.
-			 *
-			 * So: we DON'T update the high key here. The right page keeps its
-			 * original high key (if any).
-			 */
-			elog(DEBUG1, "pg_index_reclaim: Right page keeps its original high key (if any)");
-		}
-		else
-		{
-			elog(WARNING, "pg_index_reclaim: Left page %u high key not usable", left_block);
-		}
+		BTPageSetDeleted(hpage, *safexid);
+		BTPageGetOpaque(hpage)->btpo_cycleid = 0;
 	}
-	else
+	PG_CATCH();
 	{
-		elog(DEBUG1, "pg_index_reclaim: Left page %u was rightmost, no high key considerations", left_block);
+		GenericXLogAbort(state);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	/* Update sibling links */
-	elog(DEBUG1, "pg_index_reclaim: Updating sibling links");
+	(void) GenericXLogFinish(state);
+	result = RELOCATE_DONE;
 
-	/* Update right page's prev pointer to skip over deleted left page */
-	elog(DEBUG1, "pg_index_reclaim: Updating right page %u prev pointer from %u to %u",
-		 right_block, right_opaque->btpo_prev, leftsib);
-	right_opaque->btpo_prev = leftsib;
+	elog(DEBUG1, "pg_index_reclaim: Merged page %u into %u and deleted it", blkno, newblkno);
 
-	/* Update left sibling's next pointer if it exists */
-	if (BufferIsValid(left_sibling_buf))
-	{
-		Assert(left_sibling_opaque->btpo_next == left_block);
-		elog(DEBUG1, "pg_index_reclaim: Left sibling %u next pointer: %u -> %u",
-			 leftsib, left_sibling_opaque->btpo_next, right_block);
-		left_sibling_opaque->btpo_next = right_block;
-		MarkBufferDirty(left_sibling_buf);
-	}
+done:
+	if (BufferIsValid(parent_buf))
+		UnlockReleaseBuffer(parent_buf);
+	if (BufferIsValid(right_buf))
+		UnlockReleaseBuffer(right_buf);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(left_buf))
+		UnlockReleaseBuffer(left_buf);
+	_bt_freestack(stack);
+	if (highkey != NULL)
+		pfree(highkey);
+	if (pivot != NULL)
+		pfree(pivot);
 
-	/* Right sibling's prev pointer already points to right_block - no change needed */
-	if (BufferIsValid(right_sibling_buf))
-	{
-		elog(DEBUG1, "pg_index_reclaim: Right sibling %u prev pointer is already correct (%u)",
-			 rightsib, right_sibling_opaque->btpo_prev);
-	}
+	if (result == RELOCATE_DONE)
+		RecordUsedIndexPage(rel, newblkno);
+
+	return result;
+}
+
+/*
+ * Move up to max_moves live pages from the end of an index into free
+ * blocks nearer its start
+ *
+ * One pass over the index, in block order as in VACUUM, lists its free
+ * blocks and its live pages.  The live page with the highest block number
+ * then goes to the lowest free block, as long as that is below it, and so
+ * on inwards from both ends.  Each move locks and checks both blocks
+ * again; a page that can't be moved is passed over for the next one, and
+ * a block that has been taken for the next free one.  Half-dead pages and
+ * deleted pages that can't be recycled yet stay where they are.
+ *
+ * The moved pages are queued for the free space map like merged ones.
+ * Returns the number of pages moved.
+ */
+static int64
+compact_relocate(Relation rel, Relation heaprel, int max_moves,
+				 double *throttle_time)
+{
+	BlockNumber num_pages = RelationGetNumberOfBlocks(rel);
+	BufferAccessStrategy strategy;
+	BlockNumber *free_blocks;
+	BlockNumber *live_blocks;
+	int			nfree = 0;
+	int			nlive = 0;
+	int			lo;
+	int			hi;
+	int64		moved = 0;
+	BlockNumber blkno;
+	instr_time	start;
+	int64		start_wal_bytes;
 
-	/* Parent page update skipped - VACUUM will fix parent links later */
-	elog(DEBUG1, "pg_index_reclaim: Skipping parent page update - VACUUM will fix parent links when deleting half-dead pages");
+	free_blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * Max(num_pages, 1));
+	live_blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * Max(num_pages, 1));
 
-	/* Mark left page as half-dead (not fully deleted) */
-	elog(DEBUG1, "pg_index_reclaim: Marking left page %u as half-dead", left_block);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_SCANNING);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, num_pages);
 
-	/* Delete all items from left page except high key */
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+	for (blkno = BTREE_METAPAGE + 1; blkno < num_pages; blkno++)
 	{
-		int			i;
-		int			valid_items = 0;
+		Buffer		buf;
+		Page		page;
 
-		elog(DEBUG1, "pg_index_reclaim: Deleting %d items from left page %u", ndeletable, left_block);
+		vacuum_delay_point(false);
 
-		if (ndeletable > 0 && deletable != NULL)
-		{
-			for (i = 0, offnum = left_firstdata; offnum <= left_maxoff; offnum++, i++)
-			{
-				itemid = PageGetItemId(left_page, offnum);
-				if (ItemIdIsUsed(itemid))
-				{
-					deletable[valid_items] = offnum;
-					valid_items++;
-				}
-			}
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		LockBuffer(buf, BT_READ);
+		page = BufferGetPage(buf);
+		if (BTPageIsRecyclable(page, heaprel))
+			free_blocks[nfree++] = blkno;
+		else if (!P_IGNORE(BTPageGetOpaque(page)))
+			live_blocks[nlive++] = blkno;
+		UnlockReleaseBuffer(buf);
 
-			if (valid_items > 0)
-			{
-				elog(DEBUG1, "pg_index_reclaim: Deleting %d valid items from left page", valid_items);
-				PageIndexMultiDelete(left_page, deletable, valid_items);
-			}
-		}
+		reclaim_progress_incr_param(RECLAIM_PROGRESS_PAGES_SCANNED, 1);
 	}
+	FreeAccessStrategy(strategy);
 
-	/* Mark page as half-dead */
-	left_opaque = BTPageGetOpaque(left_page);
-	left_opaque->btpo_flags |= BTP_HALF_DEAD;
+	elog(DEBUG1, "pg_index_reclaim: Index \"%s\" has %d free blocks and %d live pages",
+		 RelationGetRelationName(rel), nfree, nlive);
 
-	/* Set up dummy high key for half-dead page */
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_RELOCATING);
+
+	INSTR_TIME_SET_CURRENT(start);
+	start_wal_bytes = pgWalUsage.wal_bytes;
+
+	lo = 0;
+	hi = nlive - 1;
+	while (moved < max_moves && lo < nfree && hi >= 0 &&
+		   free_blocks[lo] < live_blocks[hi])
 	{
-		IndexTupleData trunctuple;
+		Buffer		buf;
+		Page		page;
+		BTPageOpaqueData seen;
+		bool		movable;
+		FullTransactionId safexid;
+		RelocateResult result;
 
-		/* Create/update dummy high key */
-		MemSet(&trunctuple, 0, sizeof(IndexTupleData));
-		trunctuple.t_info = sizeof(IndexTupleData);
-		BTreeTupleSetNAtts(&trunctuple, 0, false);
-		/* Set top parent to InvalidBlockNumber - VACUUM will handle parent updates */
-		BTreeTupleSetTopParent(&trunctuple, InvalidBlockNumber);
+		vacuum_delay_point(false);
 
-		/* Overwrite or add high key */
-		if (PageGetMaxOffsetNumber(left_page) >= P_HIKEY &&
-			ItemIdIsUsed(PageGetItemId(left_page, P_HIKEY)))
-		{
-			/* Overwrite existing high key */
-			if (!PageIndexTupleOverwrite(left_page, P_HIKEY, (char *) &trunctuple, sizeof(IndexTupleData)))
-			{
-				/* Should not happen - just log warning */
-				elog(WARNING, "pg_index_reclaim: Failed to overwrite high key in half-dead page %u", left_block);
-			}
-		}
+		/* Have a look at the page first, to know its level and siblings */
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, live_blocks[hi],
+								 RBM_NORMAL, NULL);
+		LockBuffer(buf, BT_READ);
+		page = BufferGetPage(buf);
+		movable = !PageIsNew(page) && !P_IGNORE(BTPageGetOpaque(page)) &&
+			!P_INCOMPLETE_SPLIT(BTPageGetOpaque(page));
+		if (movable)
+			seen = *BTPageGetOpaque(page);
+		UnlockReleaseBuffer(buf);
+
+		if (!movable)
+			result = RELOCATE_SKIP_PAGE;
+		else if (P_LEFTMOST(&seen) || P_RIGHTMOST(&seen))
+			result = relocate_page_copy(rel, heaprel, live_blocks[hi],
+										free_blocks[lo], &seen, &safexid);
 		else
+			result = relocate_page_split(rel, heaprel, live_blocks[hi],
+										 free_blocks[lo], &seen, &safexid);
+
+		switch (result)
 		{
-			/* Add high key */
-			if (PageAddItem(left_page, (char *) &trunctuple, sizeof(IndexTupleData), P_HIKEY, false, false) == InvalidOffsetNumber)
-			{
-				/* Should not happen - just log warning */
-				elog(WARNING, "pg_index_reclaim: Failed to add dummy high key to half-dead page %u", left_block);
-			}
+			case RELOCATE_DONE:
+				elog(DEBUG1, "pg_index_reclaim: Moved page %u of index \"%s\" to block %u",
+					 live_blocks[hi], RelationGetRelationName(rel), free_blocks[lo]);
+				pending_free_pages_add(rel, live_blocks[hi], safexid);
+				moved++;
+				lo++;
+				hi--;
+				reclaim_throttle(start, pgWalUsage.wal_bytes - start_wal_bytes,
+								 throttle_time);
+				break;
+			case RELOCATE_SKIP_PAGE:
+				hi--;
+				break;
+			case RELOCATE_SKIP_TARGET:
+				lo++;
+				break;
 		}
 	}
 
-	left_opaque->btpo_cycleid = 0;
-	elog(DEBUG1, "pg_index_reclaim: Left page %u marked as half-dead", left_block);
+	pfree(free_blocks);
+	pfree(live_blocks);
+
+	return moved;
+}
 
-	/* Mark buffers dirty */
-	elog(DEBUG1, "pg_index_reclaim: Marking buffers dirty");
-	MarkBufferDirty(left_buf);
-	MarkBufferDirty(right_buf);
+/*
+ * Find where the free pages at the end of the first num_pages blocks of
+ * an index begin; the metapage is never free
+ */
+static BlockNumber
+compact_free_tail(Relation rel, Relation heaprel, BlockNumber num_pages)
+{
+	BlockNumber blkno = num_pages;
 
-	/*
-	 * WAL logging using Full Page Images (FPI).
-	 * We use log_newpage_buffer() which logs the entire page content.
-	 * This is simpler than creating custom WAL records and is crash-safe.
-	 */
-	if (needswal)
+	while (blkno > BTREE_METAPAGE + 1)
 	{
-		XLogRecPtr	recptr;
+		Buffer		buf;
+		bool		recyclable;
 
-		elog(DEBUG1, "pg_index_reclaim: WAL logging with FPI for modified pages");
+		CHECK_FOR_INTERRUPTS();
 
-		/*
-		 * Log each modified page as a full page image.
-		 * log_newpage_buffer() must be called from within a critical section.
-		 */
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno - 1, RBM_NORMAL, NULL);
+		LockBuffer(buf, BT_READ);
+		recyclable = BTPageIsRecyclable(BufferGetPage(buf), heaprel);
+		UnlockReleaseBuffer(buf);
+
+		if (!recyclable)
+			break;
+		blkno--;
+	}
+
+	return blkno;
+}
 
-		/* Log the left page (now half-dead) */
-		recptr = log_newpage_buffer(left_buf, true);
-		elog(DEBUG1, "pg_index_reclaim: Logged left page %u, LSN=%X/%X",
-			 left_block, LSN_FORMAT_ARGS(recptr));
+/*
+ * Cut the free pages at the end of an index off the file
+ *
+ * As lazy_truncate_heap() does, this takes an AccessExclusiveLock on the
+ * index, retrying for a few seconds rather than queueing up behind the
+ * sessions using it, and gives up if it does not get it.  Inserts may have
+ * extended the file or used some of its free pages in the meantime, so
+ * the tail is looked at again under the lock; no scan can still be on its
+ * way to a recyclable page then.  Returns the number of pages cut off.
+ */
+static BlockNumber
+compact_truncate(Relation rel, Relation heaprel)
+{
+	BlockNumber old_pages;
+	BlockNumber new_pages;
+	int			waited = 0;
 
-		/* Log the right page (contains merged items) */
-		recptr = log_newpage_buffer(right_buf, true);
-		elog(DEBUG1, "pg_index_reclaim: Logged right page %u, LSN=%X/%X",
-			 right_block, LSN_FORMAT_ARGS(recptr));
+	old_pages = RelationGetNumberOfBlocks(rel);
+	if (compact_free_tail(rel, heaprel, old_pages) == old_pages)
+		return 0;
 
-		/* Log the left sibling page if modified */
-		if (BufferIsValid(left_sibling_buf))
+	while (!ConditionalLockRelation(rel, AccessExclusiveLock))
+	{
+		if (waited >= COMPACT_TRUNCATE_LOCK_TIMEOUT)
 		{
-			recptr = log_newpage_buffer(left_sibling_buf, true);
-			elog(DEBUG1, "pg_index_reclaim: Logged left sibling page %u, LSN=%X/%X",
-				 leftsib, LSN_FORMAT_ARGS(recptr));
+			elog(DEBUG1, "pg_index_reclaim: Could not lock index \"%s\" to truncate it, giving up",
+				 RelationGetRelationName(rel));
+			return 0;
 		}
 
-		/* Right sibling was not modified, no need to log */
+		if (wait_event_truncate == 0)
+			wait_event_truncate = WaitEventExtensionNew("IndexReclaimTruncate");
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 COMPACT_TRUNCATE_LOCK_WAIT_INTERVAL,
+						 wait_event_truncate);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+		waited += COMPACT_TRUNCATE_LOCK_WAIT_INTERVAL;
 	}
-	else
+
+	old_pages = RelationGetNumberOfBlocks(rel);
+	new_pages = compact_free_tail(rel, heaprel, old_pages);
+	if (new_pages < old_pages)
 	{
-		elog(DEBUG1, "pg_index_reclaim: WAL logging not needed for this relation");
+		RelationTruncate(rel, new_pages);
+		elog(DEBUG1, "pg_index_reclaim: Truncated index \"%s\" from %u to %u pages",
+			 RelationGetRelationName(rel), old_pages, new_pages);
 	}
 
-	END_CRIT_SECTION();
-	elog(DEBUG1, "pg_index_reclaim: Critical section ended");
-
-	/* Free pre-allocated memory */
-	pfree(left_offsets);
-	if (deletable)
-		pfree(deletable);
-
-	/* Release locks */
-	elog(DEBUG1, "pg_index_reclaim: Releasing buffers");
-	if (BufferIsValid(left_sibling_buf))
-		UnlockReleaseBuffer(left_sibling_buf);
-	if (BufferIsValid(right_sibling_buf))
-		UnlockReleaseBuffer(right_sibling_buf);
-	UnlockReleaseBuffer(right_buf);
-	UnlockReleaseBuffer(left_buf);
-
-	/* Dump pages AFTER merge */
-	elog(DEBUG1, "pg_index_reclaim: ========================================");
-	elog(DEBUG1, "pg_index_reclaim: Merge completed, dumping pages AFTER merge");
-	elog(DEBUG1, "pg_index_reclaim: ========================================");
-	dump_page(rel, left_block, "LEFT PAGE (AFTER MERGE - HALF-DEAD)");
-	dump_page(rel, right_block, "RIGHT PAGE (AFTER MERGE)");
-	if (rightsib != P_NONE)
-		dump_page(rel, rightsib, "RIGHT SIBLING PAGE (AFTER MERGE)");
+	UnlockRelation(rel, AccessExclusiveLock);
 
-	elog(DEBUG1, "pg_index_reclaim: Merge of pages %u -> %u completed successfully",
-		 left_block, right_block);
-	return true;
+	return old_pages - new_pages;
 }
 
 /*
- * SQL-callable function to execute the merge
+ * SQL-callable function compacting an index
  */
-PG_FUNCTION_INFO_V1(pg_index_reclaim_execute);
+PG_FUNCTION_INFO_V1(pg_index_reclaim_compact);
 Datum
-pg_index_reclaim_execute(PG_FUNCTION_ARGS)
+pg_index_reclaim_compact(PG_FUNCTION_ARGS)
 {
 	Oid			index_oid = PG_GETARG_OID(0);
-	int			max_pct_to_merge = PG_GETARG_INT32(1);
+	int			max_moves = PG_GETARG_INT32(1);
+	Relation	heaprel;
 	Relation	rel;
-	List	   *merge_candidates = NIL;
-	ListCell   *lc;
-	int64		pages_merged = 0;
-	int64		space_reclaimed = 0;
+	int64		pages_moved;
+	int64		pages_truncated;
+	double		throttle_time = 0;
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
-	const int	MAX_MERGES_PER_EXECUTION = 1;
-	int			merges_attempted = 0;
-	MergeCandidate *candidate;
+	Datum		values[2];
+	bool		nulls[2];
 
 	/* Validate parameters */
-	if (max_pct_to_merge < 1 || max_pct_to_merge > 100)
+	if (max_moves < 0)
 		ereport(ERROR,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("max_pct_to_merge must be between 1 and 100")));
+				 errmsg("max_moves must not be negative")));
 
-	/* Open the index relation */
-	rel = index_open(index_oid, ShareUpdateExclusiveLock);
-
-	/* Verify it's a B-tree index */
-	if (rel->rd_rel->relam != BTREE_AM_OID)
-		ereport(ERROR,
-				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
-				 errmsg("index \"%s\" is not a B-tree index",
-						RelationGetRelationName(rel))));
+	rel = reclaim_open_index(index_oid, &heaprel);
 
 	/* Set up return structure */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -1132,13 +4505,12 @@ pg_index_reclaim_execute(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 				 errmsg("set-valued function called in context that cannot accept a set")));
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
 
 	tupdesc = CreateTemplateTupleDesc(2);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pages_merged",
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pages_moved",
 					   INT8OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "space_reclaimed",
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "pages_truncated",
 					   INT8OID, -1, 0);
 
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
@@ -1148,98 +4520,259 @@ pg_index_reclaim_execute(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	/* Analyze to get merge candidates */
-	elog(DEBUG1, "pg_index_reclaim: Starting analysis for index \"%s\" with max_pct_to_merge=%d",
-		 RelationGetRelationName(rel), max_pct_to_merge);
-	analyze_index_pages(rel, &merge_candidates, max_pct_to_merge);
+	reclaim_progress_start_command(RECLAIM_COMMAND_COMPACT, rel);
+	pending_free_pages_record(rel, heaprel);
 
-	elog(DEBUG1, "pg_index_reclaim: Found %d merge candidates", list_length(merge_candidates));
+	pages_moved = compact_relocate(rel, heaprel, max_moves, &throttle_time);
 
-	/* Execute merges for candidates that can be merged */
-	/* Limit to only 1 merge (2 pages) for safety */
-	elog(DEBUG1, "pg_index_reclaim: Processing merge candidates (max %d merge = 2 pages per execution)",
-		 MAX_MERGES_PER_EXECUTION);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_TRUNCATING);
+	pages_truncated = compact_truncate(rel, heaprel);
 
-	foreach(lc, merge_candidates)
-	{
-		/* Limit the number of merges per execution */
-		if (merges_attempted >= MAX_MERGES_PER_EXECUTION)
-		{
-			elog(DEBUG1, "pg_index_reclaim: Reached merge limit (%d), stopping", MAX_MERGES_PER_EXECUTION);
-			break;
-		}
+	reclaim_progress_end_command();
 
-		candidate = (MergeCandidate *) lfirst(lc);
+	/* Cached candidates may name pages that have moved or are gone */
+	candidate_cache_store(rel, 0, NULL, 0);
 
-		if (candidate->can_merge)
-		{
-			merges_attempted++;
-			elog(DEBUG1, "pg_index_reclaim: Attempting merge %d/%d: pages %u -> %u",
-				 merges_attempted, MAX_MERGES_PER_EXECUTION,
-				 candidate->left_page, candidate->right_page);
+	elog(DEBUG1, "pg_index_reclaim: Completed compaction - pages_moved=" INT64_FORMAT ", pages_truncated=" INT64_FORMAT,
+		 pages_moved, pages_truncated);
 
-			PG_TRY();
-			{
-				if (execute_merge(rel, candidate->left_page, candidate->right_page))
-				{
-					pages_merged++;
-					space_reclaimed += (BLCKSZ - candidate->estimated_space);
-					elog(DEBUG1, "pg_index_reclaim: Successfully merged pages %u -> %u (total merged: " INT64_FORMAT ")",
-						 candidate->left_page, candidate->right_page, pages_merged);
-				}
-				else
-				{
-					elog(WARNING, "pg_index_reclaim: Failed to merge pages %u -> %u (merge function returned false)",
-						 candidate->left_page, candidate->right_page);
-				}
-			}
-			PG_CATCH();
-			{
-				ErrorData *edata;
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(pages_moved);
+	values[1] = Int64GetDatum(pages_truncated);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 
-				/* Get error info */
-				edata = CopyErrorData();
-				FlushErrorState();
+	index_close(rel, ShareUpdateExclusiveLock);
+	table_close(heaprel, ShareUpdateExclusiveLock);
 
-				elog(WARNING, "pg_index_reclaim: Error during merge of pages %u -> %u: %s - stopping merge execution",
-					 candidate->left_page, candidate->right_page,
-					 edata->message ? edata->message : "unknown error");
+	return (Datum) 0;
+}
 
-				FreeErrorData(edata);
+/*
+ * Per-query state of reclaim_space()
+ *
+ * In the default leaf-walk mode the walk runs only as far as needed to
+ * produce the next row, so a caller that stops fetching stops the scan.  The
+ * other modes have to see the whole index before they know any candidate;
+ * they run to completion on the first call and then return the rows one by
+ * one.
+ */
+typedef struct ReclaimAnalyzeState
+{
+	Relation	rel;
+	int			max_pct_to_merge;
+	uint32		level;			/* tree level being analyzed */
+	ReclaimKeyRange *range;		/* key range analyzed, or NULL */
+	bool		incremental;	/* only the leaves changed since since_lsn? */
+	MergeCandidates candidates;
+	int			next;			/* next candidate to return */
+	bool		walking;		/* is the leaf walk still running? */
+	LeafChainScan scan;
+	bool		finished;
+} ReclaimAnalyzeState;
 
-				/* Don't continue with more merges after an error */
-				/* Re-throw the error to abort the function */
-				PG_RE_THROW();
-			}
-			PG_END_TRY();
+/*
+ * Stop the analysis and release everything reclaim_space() holds
+ *
+ * Once the walk is complete, the candidates go to the candidate cache, so
+ * that the next reclaim_space_execute() can start from these even if the
+ * caller did not fetch all rows.  Only candidates of the whole leaf level
+ * are cached; a walk cut short by the caller found only a prefix of them,
+ * and an incremental analysis only those of the changed leaves.  Caching
+ * those would make the next execute skip the rest of the index.
+ */
+static void
+reclaim_analyze_finish(ReclaimAnalyzeState *state)
+{
+	bool		complete = !state->walking;
+
+	if (state->finished)
+		return;
+	state->finished = true;
+
+	if (state->walking)
+	{
+		leaf_chain_scan_end(&state->scan, &state->candidates);
+		state->walking = false;
+	}
+
+	if (complete && !state->incremental && state->level == 0 &&
+		state->range == NULL)
+		candidate_cache_store(state->rel, state->max_pct_to_merge,
+							  state->candidates.items, state->candidates.count);
+	candidates_free(&state->candidates);
+	index_close(state->rel, AccessShareLock);
+	reclaim_progress_end_command();
+}
+
+/*
+ * Expression context callback, for callers that stop before the last row
+ */
+static void
+reclaim_analyze_shutdown(Datum arg)
+{
+	reclaim_analyze_finish((ReclaimAnalyzeState *) DatumGetPointer(arg));
+}
+
+/*
+ * Return the next merge candidate of reclaim_space() or
+ * reclaim_space_range(), starting the analysis on the first call
+ */
+static Datum
+reclaim_analyze_common(FunctionCallInfo fcinfo, const ReclaimArgs *args)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	FuncCallContext *funcctx;
+	ReclaimAnalyzeState *state;
+	MergeCandidate *candidate;
+	Datum		values[7];
+	bool		nulls[7];
+	HeapTuple	tuple;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			index_oid = args->index_oid;
+		int			max_pct_to_merge = args->max_pct_to_merge;
+		bool		sequential = args->sequential;
+		int			level = args->level;
+		Relation	rel;
+		TupleDesc	tupdesc;
+		MemoryContext oldcontext;
+
+		/* Validate parameters */
+		if (max_pct_to_merge < 1 || max_pct_to_merge > 100)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("max_pct_to_merge must be between 1 and 100")));
+		if (level < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("level must not be negative")));
+		if (level > 0 && (sequential || args->incremental))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("internal levels can only be analyzed by walking the sibling chain")));
+
+		if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("set-valued function called in context that cannot accept a set")));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Open the index relation */
+		rel = index_open(index_oid, AccessShareLock);
+
+		/* Verify it's a B-tree index */
+		if (rel->rd_rel->relam != BTREE_AM_OID)
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("index \"%s\" is not a B-tree index",
+							RelationGetRelationName(rel))));
+
+		if (args->incremental)
+		{
+			if (sequential)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("sequential and since_lsn cannot be combined")));
+			if (!RelationNeedsWAL(rel))
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("incremental analysis requires a WAL-logged index")));
 		}
+
+		tupdesc = CreateTemplateTupleDesc(7);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "left_page_block",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "right_page_block",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "left_page_usage_pct",
+						   NUMERICOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "right_page_usage_pct",
+						   NUMERICOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "total_items_to_move",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 6, "estimated_space_reclaimed",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 7, "can_merge",
+						   BOOLOID, -1, 0);
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		reclaim_progress_start_command(RECLAIM_COMMAND_ANALYZE, rel);
+
+		state = (ReclaimAnalyzeState *) palloc0(sizeof(ReclaimAnalyzeState));
+		state->rel = rel;
+		state->max_pct_to_merge = max_pct_to_merge;
+		state->level = (uint32) level;
+		state->incremental = args->incremental;
+		state->range = make_key_range(rel, args);
+		candidates_init(&state->candidates);
+
+		/* Analyze to get merge candidates, or start to */
+		if (args->incremental)
+			analyze_incremental(rel, args->since_lsn, &state->candidates,
+								max_pct_to_merge);
+		else if (sequential)
+			analyze_index_pages(rel, &state->candidates, max_pct_to_merge, true,
+								0, NULL, NULL);
 		else
 		{
-			elog(DEBUG1, "pg_index_reclaim: Skipping merge of pages %u -> %u (can_merge=false)",
-				 candidate->left_page, candidate->right_page);
+			BlockNumber num_pages = RelationGetNumberOfBlocks(rel);
+
+			/* An index with only a metapage has nothing to walk */
+			if (num_pages > 1)
+				state->walking = leaf_chain_scan_begin(&state->scan, rel,
+													   num_pages,
+													   max_pct_to_merge,
+													   state->level,
+													   state->range, NULL);
 		}
+
+		RegisterExprContextCallback(rsinfo->econtext, reclaim_analyze_shutdown,
+									PointerGetDatum(state));
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcontext);
 	}
 
-	/* Return results */
-	elog(DEBUG1, "pg_index_reclaim: Completed execution - pages_merged=" INT64_FORMAT ", space_reclaimed=" INT64_FORMAT,
-		 pages_merged, space_reclaimed);
-	
-	{
-		Datum		values[2];
-		bool		nulls[2];
+	funcctx = SRF_PERCALL_SETUP();
+	state = (ReclaimAnalyzeState *) funcctx->user_fctx;
 
-		memset(nulls, 0, sizeof(nulls));
-		values[0] = Int64GetDatum(pages_merged);
-		values[1] = Int64GetDatum(space_reclaimed);
+	/* Walk on until there is another candidate to return */
+	while (state->walking && state->next >= state->candidates.count)
+	{
+		if (!leaf_chain_scan_next(&state->scan, &state->candidates))
+		{
+			leaf_chain_scan_end(&state->scan, &state->candidates);
+			state->walking = false;
+		}
+	}
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	if (state->next >= state->candidates.count)
+	{
+		UnregisterExprContextCallback(rsinfo->econtext, reclaim_analyze_shutdown,
+									  PointerGetDatum(state));
+		reclaim_analyze_finish(state);
+		SRF_RETURN_DONE(funcctx);
 	}
 
-	/* Clean up */
-	index_close(rel, ShareUpdateExclusiveLock);
+	candidate = &state->candidates.items[state->next++];
 
-	elog(DEBUG1, "pg_index_reclaim: reclaim_space_execute completed successfully");
-	return (Datum) 0;
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum((int64) candidate->left_page);
+	values[1] = Int64GetDatum((int64) candidate->right_page);
+	values[2] = DirectFunctionCall1(float8_numeric,
+									 Float8GetDatum(candidate->left_usage_pct));
+	values[3] = DirectFunctionCall1(float8_numeric,
+									 Float8GetDatum(candidate->right_usage_pct));
+	values[4] = Int64GetDatum((int64) candidate->total_items);
+	values[5] = Int64GetDatum((int64) (BLCKSZ - candidate->estimated_space));
+	values[6] = BoolGetDatum(candidate->can_merge);
+
+	tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
 }
 
 /*
@@ -1248,17 +4781,287 @@ pg_index_reclaim_execute(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(pg_index_reclaim_analyze);
 Datum
 pg_index_reclaim_analyze(PG_FUNCTION_ARGS)
+{
+	ReclaimArgs args;
+
+	memset(&args, 0, sizeof(args));
+	args.index_oid = PG_GETARG_OID(0);
+	args.max_pct_to_merge = PG_GETARG_INT32(1);
+	args.sequential = PG_GETARG_BOOL(2);
+	args.incremental = !PG_ARGISNULL(3);
+	if (args.incremental)
+		args.since_lsn = PG_GETARG_LSN(3);
+	args.level = PG_GETARG_INT32(4);
+
+	return reclaim_analyze_common(fcinfo, &args);
+}
+
+/*
+ * SQL-callable function to analyze merge candidates in a key range of the
+ * leaves
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_analyze_range);
+Datum
+pg_index_reclaim_analyze_range(PG_FUNCTION_ARGS)
+{
+	ReclaimArgs args;
+
+	memset(&args, 0, sizeof(args));
+	args.index_oid = PG_GETARG_OID(0);
+	reclaim_args_set_range(fcinfo, 1, &args);
+	args.max_pct_to_merge = PG_GETARG_INT32(3);
+
+	return reclaim_analyze_common(fcinfo, &args);
+}
+
+/*
+ * Running estimate of what reclaim_space_execute() would free
+ *
+ * Candidates are fed in the order the leaf walk finds them, and are packed
+ * into runs the way collect_merge_run() does: a candidate extends the
+ * current run if it continues it and its right page still has room for
+ * everything moved so far.
+ */
+typedef struct ReclaimEstimate
+{
+	int64		mergeable_pairs;
+	int64		reclaimable_pages;
+	BlockNumber run_target;		/* right page of the current run */
+	int			run_pages;		/* 0 if there is no current run */
+	Size		run_used;
+} ReclaimEstimate;
+
+static void
+estimate_candidate(ReclaimEstimate *est, const MergeCandidate *candidate)
+{
+	if (candidate->can_merge)
+		est->mergeable_pairs++;
+
+	if (est->run_pages > 0 && est->run_pages < MAX_MERGE_RUN &&
+		candidate->left_page == est->run_target &&
+		est->run_used + candidate->right_used <= candidate->right_capacity)
+	{
+		est->run_used += candidate->right_used;
+		est->run_pages++;
+	}
+	else if (candidate->can_merge)
+	{
+		est->run_used = candidate->left_used + candidate->right_used;
+		est->run_pages = 2;
+	}
+	else
+	{
+		est->run_pages = 0;
+		return;
+	}
+
+	est->run_target = candidate->right_page;
+	est->reclaimable_pages++;
+}
+
+/*
+ * Leaf-level statistics returned by reclaim_space_summary()
+ *
+ * The counts are extrapolated, and so fractional, when only a sample of the
+ * index was read.  reclaimable_low and reclaimable_high bound
+ * reclaimable_pages; they are equal to it for a full walk.
+ */
+typedef struct ReclaimSummary
+{
+	double		leaf_pages;
+	double		used_space;
+	double		fill_histogram[FILL_HISTOGRAM_BUCKETS];
+	double		mergeable_pairs;
+	double		reclaimable_pages;
+	double		reclaimable_low;
+	double		reclaimable_high;
+} ReclaimSummary;
+
+/*
+ * Summarize the leaf level with a full walk along the sibling chain
+ */
+static void
+summarize_leaf_chain(Relation rel, BlockNumber num_pages,
+					 int max_pct_to_merge, ReclaimSummary *summary)
+{
+	LeafChainScan scan;
+	MergeCandidates merge_candidates;
+	ReclaimEstimate est;
+	int			i;
+
+	if (!leaf_chain_scan_begin(&scan, rel, num_pages, max_pct_to_merge, 0,
+							   NULL, NULL))
+		return;
+
+	memset(&est, 0, sizeof(est));
+	candidates_init(&merge_candidates);
+
+	while (leaf_chain_scan_next(&scan, &merge_candidates))
+	{
+		for (i = 0; i < merge_candidates.count; i++)
+			estimate_candidate(&est, &merge_candidates.items[i]);
+
+		/* Only the running totals are needed, so reuse the array */
+		merge_candidates.count = 0;
+	}
+	leaf_chain_scan_end(&scan, &merge_candidates);
+	candidates_free(&merge_candidates);
+
+	summary->leaf_pages = scan.leaf_pages;
+	summary->used_space = scan.used_space;
+	for (i = 0; i < FILL_HISTOGRAM_BUCKETS; i++)
+		summary->fill_histogram[i] = scan.fill_histogram[i];
+	summary->mergeable_pairs = est.mergeable_pairs;
+	summary->reclaimable_pages = est.reclaimable_pages;
+	summary->reclaimable_low = est.reclaimable_pages;
+	summary->reclaimable_high = est.reclaimable_pages;
+}
+
+/*
+ * Estimate the leaf-level statistics from a random sample of blocks
+ *
+ * The blocks are chosen with the sampler ANALYZE uses, so they are read in
+ * physical order.  Every sampled live leaf is paired with its right sibling
+ * the way the leaf walk would pair it; since every leaf but the rightmost
+ * is the left page of exactly one pair, the fraction of sampled blocks that
+ * start a mergeable pair estimates the number of such pairs in the index.
+ * Chains cannot be seen in a sample, so each mergeable pair is assumed to
+ * free a page; that is what reclaim_space_execute() achieves unless chains
+ * overflow their target page.  The bounds are those of a 95% confidence
+ * interval for that proportion, with the finite population correction.
+ */
+static void
+summarize_sample(Relation rel, BlockNumber num_pages, double sample_fraction,
+				 int max_pct_to_merge, ReclaimSummary *summary)
+{
+	BlockSamplerData bs;
+	MergeCandidates merge_candidates;
+	BlockNumber nblocks = num_pages - 1;	/* all but the metapage */
+	BlockNumber nsampled = 0;
+	int64		pairs = 0;
+	XLogRecPtr	current_lsn = hot_page_current_lsn();
+	double		scale;
+	double		p;
+	double		halfwidth;
+	int			targblocks;
+	int			i;
+
+	targblocks = (int) Min(ceil(nblocks * sample_fraction), (double) nblocks);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PHASE, RECLAIM_PHASE_SCANNING);
+	reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_TOTAL, Max(targblocks, 1));
+	BlockSampler_Init(&bs, nblocks, Max(targblocks, 1),
+					  pg_prng_uint32(&pg_global_prng_state));
+	candidates_init(&merge_candidates);
+
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber blkno = BlockSampler_Next(&bs) + 1;
+		PageAnalysis left;
+		PageAnalysis right;
+		bool		changed;
+
+		vacuum_delay_point(false);
+		nsampled++;
+		reclaim_progress_update_param(RECLAIM_PROGRESS_PAGES_SCANNED, nsampled);
+
+		if (!recheck_leaf_page(rel, blkno, InvalidXLogRecPtr, &left, &changed))
+			continue;
+
+		summary->leaf_pages++;
+		summary->used_space += left.used_space;
+		summary->fill_histogram[Min((int) (left.usage_pct / 10),
+									FILL_HISTOGRAM_BUCKETS - 1)]++;
+
+		if (left.is_rightmost ||
+			!recheck_leaf_page(rel, left.next_blkno, InvalidXLogRecPtr,
+							   &right, &changed) ||
+			right.prev_blkno != blkno)
+			continue;
+
+		consider_merge_pair(rel, &left, &right, max_pct_to_merge, current_lsn,
+							&merge_candidates);
+		if (merge_candidates.count > 0 && merge_candidates.items[0].can_merge)
+			pairs++;
+		merge_candidates.count = 0;
+	}
+
+	candidates_free(&merge_candidates);
+
+	elog(DEBUG1, "pg_index_reclaim: Sampled %u of %u blocks: %.0f leaf pages, " INT64_FORMAT " mergeable pairs",
+		 nsampled, nblocks, summary->leaf_pages, pairs);
+
+	if (nsampled == 0)
+		return;
+
+	/* Scale the sample up to the whole index */
+	scale = (double) nblocks / nsampled;
+	summary->leaf_pages *= scale;
+	summary->used_space *= scale;
+	for (i = 0; i < FILL_HISTOGRAM_BUCKETS; i++)
+		summary->fill_histogram[i] *= scale;
+	summary->mergeable_pairs = pairs * scale;
+	summary->reclaimable_pages = summary->mergeable_pairs;
+
+	p = (double) pairs / nsampled;
+	halfwidth = 1.96 * sqrt(p * (1.0 - p) / nsampled);
+	if (nblocks > 1)
+		halfwidth *= sqrt((double) (nblocks - nsampled) / (nblocks - 1));
+
+	/* We have seen pairs, and the unseen blocks can hold at most one each */
+	summary->reclaimable_low = Max((p - halfwidth) * nblocks, (double) pairs);
+	summary->reclaimable_high = Min((p + halfwidth) * nblocks,
+									(double) (pairs + nblocks - nsampled));
+}
+
+/*
+ * Estimate how many pages reclaim_space_execute() would free in an index
+ *
+ * Reads a random sample of about sample_blocks blocks, as
+ * reclaim_space_summary() does with a sample_fraction; small indexes are
+ * read completely.
+ */
+double
+reclaim_estimate_pages(Relation rel, int max_pct_to_merge,
+					   BlockNumber sample_blocks)
+{
+	BlockNumber num_pages = RelationGetNumberOfBlocks(rel);
+	ReclaimSummary summary;
+
+	if (num_pages <= 2)
+		return 0;
+
+	memset(&summary, 0, sizeof(summary));
+	summarize_sample(rel, num_pages,
+					 Min((double) sample_blocks / (num_pages - 1), 1.0),
+					 max_pct_to_merge, &summary);
+
+	return summary.reclaimable_pages;
+}
+
+/*
+ * SQL-callable function summarizing the leaf level of an index
+ *
+ * With the default sample_fraction of 1, this makes the same walk as
+ * reclaim_space(), but only keeps running totals, so its memory use does
+ * not depend on the size of the index.  A smaller fraction reads only a
+ * random sample of the blocks and extrapolates.
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_summary);
+Datum
+pg_index_reclaim_summary(PG_FUNCTION_ARGS)
 {
 	Oid			index_oid = PG_GETARG_OID(0);
 	int			max_pct_to_merge = PG_GETARG_INT32(1);
+	double		sample_fraction = PG_GETARG_FLOAT8(2);
 	Relation	rel;
-	List	   *merge_candidates = NIL;
-	ListCell   *lc;
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	tupdesc;
-	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
+	BlockNumber num_pages;
+	ReclaimSummary summary;
+	Datum		histogram[FILL_HISTOGRAM_BUCKETS];
+	Datum		values[9];
+	bool		nulls[9];
+	Size		page_capacity;
+	int			i;
 
 	/* Validate parameters */
 	if (max_pct_to_merge < 1 || max_pct_to_merge > 100)
@@ -1266,6 +5069,14 @@ pg_index_reclaim_analyze(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("max_pct_to_merge must be between 1 and 100")));
 
+	if (!(sample_fraction > 0 && sample_fraction <= 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample_fraction must be greater than 0 and at most 1")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
 	/* Open the index relation */
 	rel = index_open(index_oid, AccessShareLock);
 
@@ -1276,66 +5087,47 @@ pg_index_reclaim_analyze(PG_FUNCTION_ARGS)
 				 errmsg("index \"%s\" is not a B-tree index",
 						RelationGetRelationName(rel))));
 
-	/* Set up return structure */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
-
-	tupdesc = CreateTemplateTupleDesc(7);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "left_page_block",
-					   INT8OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "right_page_block",
-					   INT8OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "left_page_usage_pct",
-					   NUMERICOID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "right_page_usage_pct",
-					   NUMERICOID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 5, "total_items_to_move",
-					   INT8OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 6, "estimated_space_reclaimed",
-					   INT8OID, -1, 0);
-	TupleDescInitEntry(tupdesc, (AttrNumber) 7, "can_merge",
-					   BOOLOID, -1, 0);
-
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
-
-	MemoryContextSwitchTo(oldcontext);
-
-	/* Analyze to get merge candidates */
-	analyze_index_pages(rel, &merge_candidates, max_pct_to_merge);
+	memset(&summary, 0, sizeof(summary));
+	reclaim_progress_start_command(RECLAIM_COMMAND_SUMMARY, rel);
 
-	/* Return results */
-	foreach(lc, merge_candidates)
+	num_pages = RelationGetNumberOfBlocks(rel);
+	if (num_pages > 1)
 	{
-		MergeCandidate *candidate = (MergeCandidate *) lfirst(lc);
-		Datum		values[7];
-		bool		nulls[7];
+		if (sample_fraction < 1)
+			summarize_sample(rel, num_pages, sample_fraction,
+							 max_pct_to_merge, &summary);
+		else
+			summarize_leaf_chain(rel, num_pages, max_pct_to_merge, &summary);
+	}
 
-		memset(nulls, 0, sizeof(nulls));
+	reclaim_progress_end_command();
+	index_close(rel, AccessShareLock);
 
-		values[0] = Int64GetDatum((int64) candidate->left_page);
-		values[1] = Int64GetDatum((int64) candidate->right_page);
-		values[2] = DirectFunctionCall1(float8_numeric,
-										 Float8GetDatum(candidate->left_usage_pct));
-		values[3] = DirectFunctionCall1(float8_numeric,
-										 Float8GetDatum(candidate->right_usage_pct));
-		values[4] = Int64GetDatum((int64) candidate->total_items);
-		values[5] = Int64GetDatum((int64) (BLCKSZ - candidate->estimated_space));
-		values[6] = BoolGetDatum(candidate->can_merge);
+	for (i = 0; i < FILL_HISTOGRAM_BUCKETS; i++)
+		histogram[i] = Int64GetDatum((int64) rint(summary.fill_histogram[i]));
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-	}
+	page_capacity = BLCKSZ - SizeOfPageHeaderData -
+		MAXALIGN(sizeof(BTPageOpaqueData));
 
-	/* Clean up */
-	index_close(rel, AccessShareLock);
+	memset(nulls, 0, sizeof(nulls));
 
-	return (Datum) 0;
+	values[0] = Int64GetDatum((int64) rint(summary.leaf_pages));
+	values[1] = Int64GetDatum((int64) rint(summary.used_space));
+	if (summary.leaf_pages > 0)
+		values[2] = DirectFunctionCall1(float8_numeric,
+										 Float8GetDatum(summary.used_space /
+														(summary.leaf_pages * page_capacity) * 100.0));
+	else
+		nulls[2] = true;
+	values[3] = PointerGetDatum(construct_array_builtin(histogram,
+														FILL_HISTOGRAM_BUCKETS,
+														INT8OID));
+	values[4] = Int64GetDatum((int64) rint(summary.mergeable_pairs));
+	values[5] = Int64GetDatum((int64) rint(summary.reclaimable_pages));
+	values[6] = Int64GetDatum((int64) rint(summary.reclaimable_pages) * BLCKSZ);
+	values[7] = Int64GetDatum((int64) floor(summary.reclaimable_low));
+	values[8] = Int64GetDatum((int64) ceil(summary.reclaimable_high));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+													  values, nulls)));
 }
-
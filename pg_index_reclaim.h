@@ -0,0 +1,188 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_index_reclaim.h
+ *	  Declarations shared by the pg_index_reclaim modules
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/pg_index_reclaim.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_INDEX_RECLAIM_H
+#define PG_INDEX_RECLAIM_H
+
+#include "access/xlogdefs.h"
+#include "storage/block.h"
+#include "storage/buf.h"
+#include "utils/palloc.h"
+#include "utils/relcache.h"
+
+/*
+ * Structure to hold merge candidate information
+ */
+typedef struct MergeCandidate
+{
+	BlockNumber left_page;
+	BlockNumber right_page;
+	double		left_usage_pct;
+	double		right_usage_pct;
+	int			total_items;
+	Size		estimated_space;
+	Size		left_used;		/* space the items of each page take */
+	Size		right_used;
+	Size		right_capacity; /* space the right page may be filled to */
+	float		split_risk;		/* chance the merged page splits again */
+	bool		can_merge;
+	XLogRecPtr	left_lsn;		/* page LSNs when they were analyzed */
+	XLogRecPtr	right_lsn;
+} MergeCandidate;
+
+/*
+ * Growable flat array of merge candidates
+ *
+ * The candidates are stored inline, in the order they were found, in a
+ * memory context of their own: one allocation per doubling instead of one
+ * per candidate, and all of it released at once.
+ */
+typedef struct MergeCandidates
+{
+	MemoryContext mcxt;
+	MergeCandidate *items;
+	int			count;
+	int			capacity;
+} MergeCandidates;
+
+/* Why execute_merge() declined a merge */
+typedef enum MergeAbortReason
+{
+	MERGE_ABORT_NONE = 0,		/* the merge went through */
+	MERGE_ABORT_NEW_PAGE,		/* a page was uninitialized */
+	MERGE_ABORT_NOT_LEAF,		/* a page was no longer a leaf */
+	MERGE_ABORT_DELETED,		/* a page was deleted */
+	MERGE_ABORT_HALF_DEAD,		/* a page was half-dead */
+	MERGE_ABORT_SIBLING_MISMATCH,	/* sibling links had changed */
+	MERGE_ABORT_PARENT_MISMATCH,	/* downlinks not next to each other */
+	MERGE_ABORT_OUT_OF_SPACE,	/* the items no longer fit the target */
+	MERGE_ABORT_NO_ITEMS,		/* the source pages had become empty */
+	MERGE_ABORT_LOCK_BUSY,		/* a page was locked, with skip_locked */
+	MERGE_ABORT_ERROR,			/* the merge raised an error */
+} MergeAbortReason;
+
+#define MERGE_ABORT_NREASONS	(MERGE_ABORT_ERROR + 1)
+
+/*
+ * Counters of one reclaim_index() call, accumulated per index in
+ * pg_stat_index_reclaim; times are in milliseconds
+ *
+ * The per-phase times from descent_time on are only collected with
+ * pg_index_reclaim.track_timing and break analysis_time and merge_time
+ * down further.
+ */
+typedef struct ReclaimIndexCounters
+{
+	int64		calls;
+	int64		merges;
+	int64		pages_deleted;
+	int64		bytes_moved;
+	int64		wal_bytes;
+	double		lock_wait_time;
+	double		throttle_time;
+	double		analysis_time;
+	double		merge_time;
+	double		descent_time;	/* to the first leaf, and to each parent */
+	double		lock_time;		/* locking the pages of each merge */
+	double		scan_time;		/* reading and measuring pages */
+	double		pairing_time;	/* evaluating pairs and planning runs */
+	double		rewrite_time;	/* building the merged pages */
+	double		wal_time;		/* applying and WAL-logging them */
+	int64		aborts[MERGE_ABORT_NREASONS];
+} ReclaimIndexCounters;
+
+/* Key range of a leaf walk, opaque outside pg_index_reclaim.c */
+typedef struct ReclaimKeyRange ReclaimKeyRange;
+
+/*
+ * State shared by the reclaim_index() calls of one reclaim_space_all()
+ *
+ * The calls read through one buffer access strategy, and together delete
+ * at most max_pages pages and write at most max_wal_bytes of WAL; a
+ * negative limit is no limit.  pages and wal_bytes are what was spent.
+ */
+typedef struct ReclaimBatch
+{
+	BufferAccessStrategy strategy;
+	int64		max_pages;
+	int64		max_wal_bytes;
+	int64		pages;
+	int64		wal_bytes;
+} ReclaimBatch;
+
+/* Commands reported in pg_stat_progress_index_reclaim */
+typedef enum ReclaimCommand
+{
+	RECLAIM_COMMAND_ANALYZE = 1,
+	RECLAIM_COMMAND_EXECUTE,
+	RECLAIM_COMMAND_SUMMARY,
+	RECLAIM_COMMAND_COMPACT,
+} ReclaimCommand;
+
+/* Progress parameters, as in commands/progress.h */
+#define RECLAIM_PROGRESS_PHASE					0
+#define RECLAIM_PROGRESS_PAGES_TOTAL			1
+#define RECLAIM_PROGRESS_PAGES_SCANNED			2
+#define RECLAIM_PROGRESS_CANDIDATES				3
+#define RECLAIM_PROGRESS_MERGES_DONE			4
+#define RECLAIM_PROGRESS_PAGES_MERGED			5
+#define RECLAIM_PROGRESS_WAL_BYTES				6
+#define RECLAIM_PROGRESS_NPARAMS				7
+
+/* Phases of RECLAIM_PROGRESS_PHASE */
+#define RECLAIM_PHASE_INITIALIZING				0
+#define RECLAIM_PHASE_DESCENDING				1
+#define RECLAIM_PHASE_SCANNING					2
+#define RECLAIM_PHASE_READING_WAL				3
+#define RECLAIM_PHASE_PAIRING					4
+#define RECLAIM_PHASE_MERGING					5
+#define RECLAIM_PHASE_RELOCATING				6
+#define RECLAIM_PHASE_TRUNCATING				7
+
+/* pg_index_reclaim.c */
+extern void candidates_init(MergeCandidates *cands);
+extern MergeCandidate *candidates_append(MergeCandidates *cands);
+extern void candidates_free(MergeCandidates *cands);
+extern void reclaim_index(Relation rel, int max_pct_to_merge, int max_merges,
+						  uint32 level, const ReclaimKeyRange *range,
+						  ReclaimBatch *batch,
+						  int64 *pages_merged, int64 *space_reclaimed);
+extern double reclaim_estimate_pages(Relation rel, int max_pct_to_merge,
+									 BlockNumber sample_blocks);
+
+/* candidate_cache.c */
+extern void candidate_cache_store(Relation rel, int max_pct_to_merge,
+								  const MergeCandidate *candidates, int ncandidates);
+extern int	candidate_cache_fetch(Relation rel, int max_pct_to_merge,
+								  MergeCandidates *cands);
+
+/* progress.c */
+extern void reclaim_progress_start_command(ReclaimCommand command, Relation rel);
+extern void reclaim_progress_update_param(int index, int64 val);
+extern void reclaim_progress_incr_param(int index, int64 incr);
+extern void reclaim_progress_update_wal(void);
+extern void reclaim_progress_end_command(void);
+
+/* reclaim_stats.c */
+extern void reclaim_stats_prepare(void);
+extern void reclaim_stats_report(Relation rel, const ReclaimIndexCounters *counters);
+
+/* wal_changes.c */
+extern int	blocknumber_cmp(const void *a, const void *b);
+extern BlockNumber *collect_vacuumed_blocks(Relation rel, XLogRecPtr since_lsn,
+											int *nblocks);
+
+/* reclaim_worker.c */
+extern void reclaim_worker_init(void);
+extern PGDLLEXPORT void pg_index_reclaim_worker_main(Datum main_arg);
+
+#endif							/* PG_INDEX_RECLAIM_H */
@@ -0,0 +1,350 @@
+/*-------------------------------------------------------------------------
+ *
+ * progress.c
+ *	  Progress reporting for analysis and merge runs
+ *
+ * The core progress machinery (pgstat_progress_start_command() and the
+ * pg_stat_progress_* views) only knows the commands built into the server,
+ * so the extension keeps its own, equivalent, set of per-backend slots in a
+ * segment of the DSM registry.  A running command only ever writes its own
+ * slot, with the same change-count protocol PgBackendStatus uses: the count
+ * is odd while the owner is writing, and readers retry until they see the
+ * same even count before and after copying the slot.  Updates therefore
+ * cost a couple of barriers and no lock, and can be made for every page.
+ *
+ * A slot is released when the command ends, and at the end of the
+ * transaction in case the command errored out.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/progress.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "executor/instrument.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/dsm_registry.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+
+#include "pg_index_reclaim.h"
+
+typedef struct ReclaimProgressSlot
+{
+	uint32		changecount;	/* odd while the owner is writing */
+	int			pid;			/* 0 if the slot is idle */
+	Oid			dbid;
+	Oid			userid;
+	Oid			indexoid;
+	ReclaimCommand command;
+	int64		params[RECLAIM_PROGRESS_NPARAMS];
+} ReclaimProgressSlot;
+
+typedef struct ReclaimProgress
+{
+	int			nslots;
+	ReclaimProgressSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} ReclaimProgress;
+
+static ReclaimProgress *reclaim_progress = NULL;
+
+/* Slot of the command this backend is running, if any */
+static ReclaimProgressSlot *my_slot = NULL;
+static int64 my_start_wal_bytes;
+static bool xact_callback_registered = false;
+
+static void
+reclaim_progress_init_shmem(void *ptr)
+{
+	ReclaimProgress *progress = (ReclaimProgress *) ptr;
+
+	memset(progress, 0,
+		   offsetof(ReclaimProgress, slots) +
+		   sizeof(ReclaimProgressSlot) * MaxBackends);
+	progress->nslots = MaxBackends;
+}
+
+/*
+ * Attach to the progress slots, creating them on first use
+ */
+static ReclaimProgress *
+reclaim_progress_attach(void)
+{
+	bool		found;
+
+	if (reclaim_progress == NULL)
+		reclaim_progress = GetNamedDSMSegment("pg_index_reclaim_progress",
+											  offsetof(ReclaimProgress, slots) +
+											  sizeof(ReclaimProgressSlot) * MaxBackends,
+											  reclaim_progress_init_shmem,
+											  &found);
+
+	return reclaim_progress;
+}
+
+static inline void
+slot_begin_write(volatile ReclaimProgressSlot *slot)
+{
+	slot->changecount++;
+	pg_write_barrier();
+}
+
+static inline void
+slot_end_write(volatile ReclaimProgressSlot *slot)
+{
+	pg_write_barrier();
+	slot->changecount++;
+}
+
+/*
+ * Release the slot if an error ended the command before it could
+ */
+static void
+reclaim_progress_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_COMMIT)
+		reclaim_progress_end_command();
+}
+
+/*
+ * Start reporting the progress of a command on an index
+ *
+ * Parallel workers do not report; their leader does for them.
+ */
+void
+reclaim_progress_start_command(ReclaimCommand command, Relation rel)
+{
+	ReclaimProgress *progress;
+	volatile ReclaimProgressSlot *slot;
+
+	if (IsParallelWorker())
+		return;
+
+	progress = reclaim_progress_attach();
+	if (MyProcNumber < 0 || MyProcNumber >= progress->nslots)
+		return;
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(reclaim_progress_xact_callback, NULL);
+		xact_callback_registered = true;
+	}
+
+	slot = &progress->slots[MyProcNumber];
+	slot_begin_write(slot);
+	slot->pid = MyProcPid;
+	slot->dbid = MyDatabaseId;
+	slot->userid = GetUserId();
+	slot->indexoid = RelationGetRelid(rel);
+	slot->command = command;
+	memset((char *) slot->params, 0, sizeof(slot->params));
+	slot_end_write(slot);
+
+	my_slot = (ReclaimProgressSlot *) slot;
+	my_start_wal_bytes = pgWalUsage.wal_bytes;
+}
+
+/*
+ * Set a progress parameter of the running command
+ */
+void
+reclaim_progress_update_param(int index, int64 val)
+{
+	volatile ReclaimProgressSlot *slot = my_slot;
+
+	Assert(index >= 0 && index < RECLAIM_PROGRESS_NPARAMS);
+
+	if (slot == NULL)
+		return;
+
+	slot_begin_write(slot);
+	slot->params[index] = val;
+	slot_end_write(slot);
+}
+
+/*
+ * Add to a progress parameter of the running command
+ */
+void
+reclaim_progress_incr_param(int index, int64 incr)
+{
+	volatile ReclaimProgressSlot *slot = my_slot;
+
+	Assert(index >= 0 && index < RECLAIM_PROGRESS_NPARAMS);
+
+	if (slot == NULL)
+		return;
+
+	slot_begin_write(slot);
+	slot->params[index] += incr;
+	slot_end_write(slot);
+}
+
+/*
+ * Report the WAL the running command has written so far
+ */
+void
+reclaim_progress_update_wal(void)
+{
+	reclaim_progress_update_param(RECLAIM_PROGRESS_WAL_BYTES,
+								  pgWalUsage.wal_bytes - my_start_wal_bytes);
+}
+
+/*
+ * Stop reporting progress; a no-op if no command is running
+ */
+void
+reclaim_progress_end_command(void)
+{
+	volatile ReclaimProgressSlot *slot = my_slot;
+
+	if (slot == NULL)
+		return;
+
+	slot_begin_write(slot);
+	slot->pid = 0;
+	slot_end_write(slot);
+
+	my_slot = NULL;
+}
+
+static const char *
+reclaim_command_name(ReclaimCommand command)
+{
+	switch (command)
+	{
+		case RECLAIM_COMMAND_ANALYZE:
+			return "analyze";
+		case RECLAIM_COMMAND_EXECUTE:
+			return "execute";
+		case RECLAIM_COMMAND_SUMMARY:
+			return "summary";
+		case RECLAIM_COMMAND_COMPACT:
+			return "compact";
+	}
+	return "unknown";
+}
+
+static const char *
+reclaim_phase_name(int64 phase)
+{
+	switch (phase)
+	{
+		case RECLAIM_PHASE_INITIALIZING:
+			return "initializing";
+		case RECLAIM_PHASE_DESCENDING:
+			return "descending";
+		case RECLAIM_PHASE_SCANNING:
+			return "scanning leaves";
+		case RECLAIM_PHASE_READING_WAL:
+			return "reading wal";
+		case RECLAIM_PHASE_PAIRING:
+			return "pairing";
+		case RECLAIM_PHASE_MERGING:
+			return "merging";
+		case RECLAIM_PHASE_RELOCATING:
+			return "relocating pages";
+		case RECLAIM_PHASE_TRUNCATING:
+			return "truncating";
+	}
+	return "unknown";
+}
+
+/*
+ * SQL-callable function listing the running commands
+ *
+ * As for the built-in progress views, only roles with the privileges of
+ * the command's user or of pg_read_all_stats see more than the pid, the
+ * database and the command.
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_progress);
+Datum
+pg_index_reclaim_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ReclaimProgress *progress;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	/* Set up return structure */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	progress = reclaim_progress_attach();
+
+	for (i = 0; i < progress->nslots; i++)
+	{
+		volatile ReclaimProgressSlot *slot = &progress->slots[i];
+		ReclaimProgressSlot local;
+		Datum		values[11];
+		bool		nulls[11];
+		int			j;
+
+		/* Copy the slot, retrying until we get a consistent copy */
+		for (;;)
+		{
+			uint32		before = slot->changecount;
+
+			pg_read_barrier();
+			memcpy(&local, (char *) slot, sizeof(local));
+			pg_read_barrier();
+			if (before == slot->changecount && (before & 1) == 0)
+				break;
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (local.pid == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(local.pid);
+		values[1] = ObjectIdGetDatum(local.dbid);
+		values[2] = ObjectIdGetDatum(local.indexoid);
+		values[3] = CStringGetTextDatum(reclaim_command_name(local.command));
+		values[4] = CStringGetTextDatum(reclaim_phase_name(local.params[RECLAIM_PROGRESS_PHASE]));
+		for (j = 1; j < RECLAIM_PROGRESS_NPARAMS; j++)
+			values[4 + j] = Int64GetDatum(local.params[j]);
+
+		if (!has_privs_of_role(GetUserId(), local.userid) &&
+			!has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS))
+		{
+			nulls[2] = true;
+			for (j = 4; j < 11; j++)
+				nulls[j] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,358 @@
+/*-------------------------------------------------------------------------
+ *
+ * reclaim_all.c
+ *	  Reclaim space in the B-tree indexes of a table, schema or database
+ *
+ * reclaim_space_all() does in one call what a maintenance script would do
+ * by calling reclaim_space_execute() on index after index.  It first
+ * estimates, from a small random sample of each index, how many pages
+ * merging would free, and then runs the merges on the indexes in order of
+ * that estimate, most profitable first, until a budget of deleted pages or
+ * written WAL shared by all of them is spent.  Indexes whose sample shows
+ * nothing to reclaim are left alone.
+ *
+ * All indexes are walked through the same bulk-read ring, in one memory
+ * context that is reset between them, and their results go to a single
+ * tuplestore.  Indexes that are locked by someone else are skipped rather
+ * than waited for, as in the background worker.
+ *
+ * As VACUUM does, the indexes of tables the caller has no MAINTAIN
+ * privilege on are skipped with a warning.  The system catalogs are left
+ * out of a schema or database, as in the background worker.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/reclaim_all.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/catalog.h"
+#include "catalog/index.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "common/int.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/tuplestore.h"
+
+#include "pg_index_reclaim.h"
+
+/* Blocks sampled from each index to estimate what it would give back */
+#define RECLAIM_ALL_SAMPLE_BLOCKS	64
+
+typedef struct ReclaimTarget
+{
+	Oid			indexoid;
+	double		estimate;		/* pages merging would free */
+} ReclaimTarget;
+
+/*
+ * qsort comparator putting the most profitable index first
+ */
+static int
+reclaim_target_cmp(const void *a, const void *b)
+{
+	const ReclaimTarget *ta = (const ReclaimTarget *) a;
+	const ReclaimTarget *tb = (const ReclaimTarget *) b;
+
+	if (ta->estimate > tb->estimate)
+		return -1;
+	if (ta->estimate < tb->estimate)
+		return 1;
+	return pg_cmp_u32(ta->indexoid, tb->indexoid);
+}
+
+/*
+ * Check that the caller may reclaim space in the indexes of a table,
+ * warning if not, as vacuum_is_permitted_for_relation() does
+ */
+static bool
+reclaim_all_permitted(Oid heapoid, const char *relname)
+{
+	if (pg_class_aclcheck(heapoid, GetUserId(), ACL_MAINTAIN) == ACLCHECK_OK)
+		return true;
+
+	ereport(WARNING,
+			(errmsg("permission denied to reclaim space in \"%s\", skipping it",
+					relname)));
+	return false;
+}
+
+/*
+ * List the OIDs of the indexes of a table, or else of the permanent B-tree
+ * indexes of a schema or of the whole database, leaving out those the
+ * caller may not reclaim space in
+ */
+static List *
+reclaim_all_list_indexes(Oid tableoid, Oid nspoid)
+{
+	List	   *indexes = NIL;
+	Relation	classRel;
+	TableScanDesc scan;
+	HeapTuple	tuple;
+
+	if (OidIsValid(tableoid))
+	{
+		Relation	heaprel;
+
+		if (!reclaim_all_permitted(tableoid, get_rel_name(tableoid)))
+			return NIL;
+
+		heaprel = table_open(tableoid, AccessShareLock);
+
+		indexes = RelationGetIndexList(heaprel);
+		table_close(heaprel, AccessShareLock);
+		return indexes;
+	}
+
+	classRel = table_open(RelationRelationId, AccessShareLock);
+	scan = table_beginscan_catalog(classRel, 0, NULL);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Form_pg_class classForm = (Form_pg_class) GETSTRUCT(tuple);
+		Oid			heapoid;
+
+		if (classForm->relkind != RELKIND_INDEX ||
+			classForm->relam != BTREE_AM_OID ||
+			classForm->relpersistence == RELPERSISTENCE_TEMP ||
+			IsCatalogRelationOid(classForm->oid))
+			continue;
+		if (OidIsValid(nspoid) && classForm->relnamespace != nspoid)
+			continue;
+
+		heapoid = IndexGetRelation(classForm->oid, true);
+		if (!OidIsValid(heapoid) ||
+			!reclaim_all_permitted(heapoid, NameStr(classForm->relname)))
+			continue;
+
+		indexes = lappend_oid(indexes, classForm->oid);
+	}
+
+	table_endscan(scan);
+	table_close(classRel, AccessShareLock);
+
+	return indexes;
+}
+
+/*
+ * Open an index to work on, without waiting for its lock or its table's
+ *
+ * As for a single index, the table is locked first, with a
+ * ShareUpdateExclusiveLock that keeps VACUUM out while pages are merged.
+ * Returns NULL if the table or the index is locked by someone else, the
+ * index has been dropped in the meantime, or is not a valid B-tree index.
+ * Close it with reclaim_all_close().
+ */
+static Relation
+reclaim_all_open(Oid indexoid)
+{
+	Oid			heapoid;
+	Relation	rel;
+
+	heapoid = IndexGetRelation(indexoid, true);
+	if (!OidIsValid(heapoid) ||
+		!ConditionalLockRelationOid(heapoid, ShareUpdateExclusiveLock))
+		return NULL;
+	if (!ConditionalLockRelationOid(indexoid, ShareUpdateExclusiveLock))
+	{
+		UnlockRelationOid(heapoid, ShareUpdateExclusiveLock);
+		return NULL;
+	}
+
+	rel = try_relation_open(indexoid, NoLock);
+	if (rel == NULL ||
+		rel->rd_rel->relkind != RELKIND_INDEX ||
+		rel->rd_rel->relam != BTREE_AM_OID ||
+		RELATION_IS_OTHER_TEMP(rel) ||
+		!rel->rd_index->indisvalid ||
+		!rel->rd_index->indisready)
+	{
+		if (rel != NULL)
+			relation_close(rel, NoLock);
+		UnlockRelationOid(indexoid, ShareUpdateExclusiveLock);
+		UnlockRelationOid(heapoid, ShareUpdateExclusiveLock);
+		return NULL;
+	}
+
+	return rel;
+}
+
+static void
+reclaim_all_close(Relation rel)
+{
+	Oid			heapoid = rel->rd_index->indrelid;
+
+	relation_close(rel, ShareUpdateExclusiveLock);
+	UnlockRelationOid(heapoid, ShareUpdateExclusiveLock);
+}
+
+static bool
+reclaim_batch_spent(const ReclaimBatch *batch)
+{
+	return (batch->max_pages >= 0 && batch->pages >= batch->max_pages) ||
+		(batch->max_wal_bytes >= 0 && batch->wal_bytes >= batch->max_wal_bytes);
+}
+
+/*
+ * SQL-callable function reclaiming space in many indexes
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_all);
+Datum
+pg_index_reclaim_all(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Oid			tableoid = PG_ARGISNULL(0) ? InvalidOid : PG_GETARG_OID(0);
+	int			max_pct_to_merge = PG_GETARG_INT32(2);
+	int			max_merges = PG_GETARG_INT32(3);
+	Oid			nspoid = InvalidOid;
+	ReclaimBatch batch;
+	ReclaimTarget *targets;
+	int			ntargets = 0;
+	List	   *indexes;
+	ListCell   *lc;
+	MemoryContext workcxt;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	/* Validate parameters */
+	if (max_pct_to_merge < 1 || max_pct_to_merge > 100)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_pct_to_merge must be between 1 and 100")));
+	if (max_merges < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_merges must be at least 1")));
+
+	memset(&batch, 0, sizeof(batch));
+	batch.max_pages = PG_ARGISNULL(4) ? -1 : PG_GETARG_INT64(4);
+	batch.max_wal_bytes = PG_ARGISNULL(5) ? -1 : PG_GETARG_INT64(5);
+	if ((!PG_ARGISNULL(4) && batch.max_pages < 0) ||
+		(!PG_ARGISNULL(5) && batch.max_wal_bytes < 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_pages and max_wal_bytes must not be negative")));
+
+	if (!PG_ARGISNULL(1))
+		nspoid = get_namespace_oid(NameStr(*PG_GETARG_NAME(1)), false);
+
+	/* Set up return structure */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	indexes = reclaim_all_list_indexes(tableoid, nspoid);
+	targets = (ReclaimTarget *) palloc(sizeof(ReclaimTarget) *
+									   Max(list_length(indexes), 1));
+
+	workcxt = AllocSetContextCreate(CurrentMemoryContext,
+									"pg_index_reclaim batch",
+									ALLOCSET_DEFAULT_SIZES);
+	batch.strategy = GetAccessStrategy(BAS_BULKREAD);
+
+	/* Estimate what each index would give back */
+	foreach(lc, indexes)
+	{
+		Oid			indexoid = lfirst_oid(lc);
+		Relation	rel;
+		double		estimate;
+
+		CHECK_FOR_INTERRUPTS();
+
+		rel = reclaim_all_open(indexoid);
+		if (rel == NULL)
+			continue;
+
+		oldcontext = MemoryContextSwitchTo(workcxt);
+		estimate = reclaim_estimate_pages(rel, max_pct_to_merge,
+										  RECLAIM_ALL_SAMPLE_BLOCKS);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(workcxt);
+
+		elog(DEBUG1, "pg_index_reclaim: Index \"%s\" would free about %.0f pages",
+			 RelationGetRelationName(rel), estimate);
+		reclaim_all_close(rel);
+
+		if (estimate <= 0)
+			continue;
+
+		targets[ntargets].indexoid = indexoid;
+		targets[ntargets].estimate = estimate;
+		ntargets++;
+	}
+
+	qsort(targets, ntargets, sizeof(ReclaimTarget), reclaim_target_cmp);
+
+	/* Spend the budget on the most profitable indexes first */
+	for (i = 0; i < ntargets && !reclaim_batch_spent(&batch); i++)
+	{
+		Relation	rel;
+		int64		pages_merged = 0;
+		int64		space_reclaimed = 0;
+		Datum		values[4];
+		bool		nulls[4];
+
+		CHECK_FOR_INTERRUPTS();
+
+		rel = reclaim_all_open(targets[i].indexoid);
+		if (rel == NULL)
+			continue;
+
+		oldcontext = MemoryContextSwitchTo(workcxt);
+		reclaim_index(rel, max_pct_to_merge, max_merges, 0, NULL, &batch,
+					  &pages_merged, &space_reclaimed);
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(workcxt);
+
+		reclaim_all_close(rel);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(targets[i].indexoid);
+		values[1] = Int64GetDatum((int64) rint(targets[i].estimate));
+		values[2] = Int64GetDatum(pages_merged);
+		values[3] = Int64GetDatum(space_reclaimed);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	FreeAccessStrategy(batch.strategy);
+	MemoryContextDelete(workcxt);
+	pfree(targets);
+	list_free(indexes);
+
+	return (Datum) 0;
+}
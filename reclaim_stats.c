@@ -0,0 +1,271 @@
+/*-------------------------------------------------------------------------
+ *
+ * reclaim_stats.c
+ *	  Cumulative per-index statistics of merge runs
+ *
+ * Every reclaim_index() call, from reclaim_space_execute() or from the
+ * background worker, adds its counters to the entry of its index: merges
+ * and the pages they deleted, bytes moved and WAL written, time spent
+ * waiting for buffer locks, throttled, in analysis and in merging, and in
+ * each phase of those if pg_index_reclaim.track_timing is on, and the
+ * merges execute_merge() declined, by reason.  They are shown by the
+ * pg_stat_index_reclaim view.
+ *
+ * The entries live in a fixed-size array in a segment of the DSM registry,
+ * keyed by database and index OID, and are updated once per call under a
+ * single LWLock.  They are not persistent: they are not written to the
+ * statistics file, so a server restart loses all of them.  When the array
+ * is full, the entry that was updated least recently is recycled, and the
+ * history of its index is lost as well.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/reclaim_stats.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/dsm_registry.h"
+#include "storage/lwlock.h"
+#include "utils/builtins.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "pg_index_reclaim.h"
+
+#define RECLAIM_STATS_ENTRIES	1024
+
+typedef struct ReclaimStatsEntry
+{
+	Oid			dbid;
+	Oid			indexoid;		/* InvalidOid if the entry is free */
+	TimestampTz last_reclaim;
+	ReclaimIndexCounters counters;
+} ReclaimStatsEntry;
+
+typedef struct ReclaimStats
+{
+	LWLock		lock;			/* protects everything below */
+	TimestampTz stats_reset;
+	ReclaimStatsEntry entries[RECLAIM_STATS_ENTRIES];
+} ReclaimStats;
+
+static ReclaimStats *reclaim_stats = NULL;
+
+static void
+reclaim_stats_init_shmem(void *ptr)
+{
+	ReclaimStats *stats = (ReclaimStats *) ptr;
+
+	LWLockInitialize(&stats->lock, LWLockNewTrancheId("pg_index_reclaim_stats"));
+	stats->stats_reset = GetCurrentTimestamp();
+	memset(stats->entries, 0, sizeof(stats->entries));
+}
+
+/*
+ * Attach to the statistics, creating them on first use
+ */
+static ReclaimStats *
+reclaim_stats_attach(void)
+{
+	bool		found;
+
+	if (reclaim_stats == NULL)
+		reclaim_stats = GetNamedDSMSegment("pg_index_reclaim_stats",
+										   sizeof(ReclaimStats),
+										   reclaim_stats_init_shmem,
+										   &found);
+
+	return reclaim_stats;
+}
+
+/*
+ * Attach to the statistics ahead of the reports of a merge run
+ *
+ * Attaching may fail, and reclaim_stats_report() is also called while the
+ * error of a failed merge unwinds, where it must not fail in turn.
+ */
+void
+reclaim_stats_prepare(void)
+{
+	(void) reclaim_stats_attach();
+}
+
+/*
+ * Add the counters of one reclaim_index() call to the entry of its index
+ */
+void
+reclaim_stats_report(Relation rel, const ReclaimIndexCounters *counters)
+{
+	ReclaimStats *stats = reclaim_stats_attach();
+	ReclaimStatsEntry *entry = NULL;
+	ReclaimStatsEntry *victim = NULL;
+	ReclaimIndexCounters *c;
+	int			i;
+
+	LWLockAcquire(&stats->lock, LW_EXCLUSIVE);
+
+	/* Find the entry of the index, or else a free or the oldest one */
+	for (i = 0; i < RECLAIM_STATS_ENTRIES; i++)
+	{
+		ReclaimStatsEntry *e = &stats->entries[i];
+
+		if (e->indexoid == RelationGetRelid(rel) && e->dbid == MyDatabaseId)
+		{
+			entry = e;
+			break;
+		}
+		if (e->indexoid == InvalidOid)
+		{
+			if (victim == NULL || victim->indexoid != InvalidOid)
+				victim = e;
+		}
+		else if (victim == NULL ||
+				 (victim->indexoid != InvalidOid &&
+				  e->last_reclaim < victim->last_reclaim))
+			victim = e;
+	}
+
+	if (entry == NULL)
+	{
+		entry = victim;
+		memset(entry, 0, sizeof(ReclaimStatsEntry));
+		entry->dbid = MyDatabaseId;
+		entry->indexoid = RelationGetRelid(rel);
+	}
+
+	entry->last_reclaim = GetCurrentTimestamp();
+
+	c = &entry->counters;
+	c->calls += counters->calls;
+	c->merges += counters->merges;
+	c->pages_deleted += counters->pages_deleted;
+	c->bytes_moved += counters->bytes_moved;
+	c->wal_bytes += counters->wal_bytes;
+	c->lock_wait_time += counters->lock_wait_time;
+	c->throttle_time += counters->throttle_time;
+	c->analysis_time += counters->analysis_time;
+	c->merge_time += counters->merge_time;
+	c->descent_time += counters->descent_time;
+	c->lock_time += counters->lock_time;
+	c->scan_time += counters->scan_time;
+	c->pairing_time += counters->pairing_time;
+	c->rewrite_time += counters->rewrite_time;
+	c->wal_time += counters->wal_time;
+	for (i = 0; i < MERGE_ABORT_NREASONS; i++)
+		c->aborts[i] += counters->aborts[i];
+
+	LWLockRelease(&stats->lock);
+}
+
+/*
+ * SQL-callable function returning the statistics of all indexes
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_stats);
+Datum
+pg_index_reclaim_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ReclaimStats *stats;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	/* Set up return structure */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	stats = reclaim_stats_attach();
+	LWLockAcquire(&stats->lock, LW_SHARED);
+
+	for (i = 0; i < RECLAIM_STATS_ENTRIES; i++)
+	{
+		ReclaimStatsEntry *entry = &stats->entries[i];
+		ReclaimIndexCounters *c = &entry->counters;
+		Datum		values[28];
+		bool		nulls[28];
+		int			j = 0;
+
+		if (entry->indexoid == InvalidOid)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = ObjectIdGetDatum(entry->dbid);
+		values[j++] = ObjectIdGetDatum(entry->indexoid);
+		values[j++] = Int64GetDatum(c->calls);
+		values[j++] = Int64GetDatum(c->merges);
+		values[j++] = Int64GetDatum(c->pages_deleted);
+		values[j++] = Int64GetDatum(c->bytes_moved);
+		values[j++] = Int64GetDatum(c->wal_bytes);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_SIBLING_MISMATCH]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_PARENT_MISMATCH]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_OUT_OF_SPACE]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_HALF_DEAD]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_DELETED]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_NOT_LEAF] +
+									c->aborts[MERGE_ABORT_NEW_PAGE]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_NO_ITEMS]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_LOCK_BUSY]);
+		values[j++] = Int64GetDatum(c->aborts[MERGE_ABORT_ERROR]);
+		values[j++] = Float8GetDatum(c->lock_wait_time);
+		values[j++] = Float8GetDatum(c->throttle_time);
+		values[j++] = Float8GetDatum(c->analysis_time);
+		values[j++] = Float8GetDatum(c->merge_time);
+		values[j++] = Float8GetDatum(c->descent_time);
+		values[j++] = Float8GetDatum(c->lock_time);
+		values[j++] = Float8GetDatum(c->scan_time);
+		values[j++] = Float8GetDatum(c->pairing_time);
+		values[j++] = Float8GetDatum(c->rewrite_time);
+		values[j++] = Float8GetDatum(c->wal_time);
+		values[j++] = TimestampTzGetDatum(entry->last_reclaim);
+		values[j++] = TimestampTzGetDatum(stats->stats_reset);
+		Assert(j == 28);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(&stats->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL-callable function discarding all statistics
+ */
+PG_FUNCTION_INFO_V1(pg_index_reclaim_stats_reset);
+Datum
+pg_index_reclaim_stats_reset(PG_FUNCTION_ARGS)
+{
+	ReclaimStats *stats = reclaim_stats_attach();
+
+	LWLockAcquire(&stats->lock, LW_EXCLUSIVE);
+	memset(stats->entries, 0, sizeof(stats->entries));
+	stats->stats_reset = GetCurrentTimestamp();
+	LWLockRelease(&stats->lock);
+
+	PG_RETURN_VOID();
+}
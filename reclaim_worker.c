@@ -0,0 +1,346 @@
+/*-------------------------------------------------------------------------
+ *
+ * reclaim_worker.c
+ *	  Background worker that reclaims index space continuously
+ *
+ * When pg_index_reclaim is listed in shared_preload_libraries, a background
+ * worker connects to pg_index_reclaim.worker_database and, every
+ * pg_index_reclaim.worker_naptime seconds, runs the analyze/merge loop over
+ * each B-tree index of that database, with at most
+ * pg_index_reclaim.worker_max_merges merges per index and round.  Indexes
+ * without merge candidates cost one read of the index and nothing else.
+ * The indexes of system catalogs are left alone: they are small, and every
+ * backend's catalog lookups go through them.  An error on one index is
+ * reported and the round goes on with the next, as in autovacuum, so that
+ * an index that keeps failing does not starve those after it.
+ *
+ * All I/O is throttled with the cost-based delay machinery VACUUM uses: the
+ * buffer manager charges vacuum_cost_page_hit, _miss and _dirty to the
+ * cost balance while VacuumCostActive is set, and vacuum_delay_point(false),
+ * called as outside ANALYZE, sleeps for worker_cost_delay once the balance
+ * reaches worker_cost_limit.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/reclaim_worker.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/catalog.h"
+#include "catalog/index.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "commands/vacuum.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "pg_index_reclaim.h"
+
+/* GUC variables */
+static char *reclaim_worker_database = NULL;
+static int	reclaim_worker_naptime = 60;
+static int	reclaim_worker_max_pct = 20;
+static int	reclaim_worker_max_merges = 10;
+static double reclaim_worker_cost_delay = 2;
+static int	reclaim_worker_cost_limit = 200;
+
+/*
+ * Define the worker's GUCs, and register the worker if we are being
+ * loaded through shared_preload_libraries
+ */
+void
+reclaim_worker_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomStringVariable("pg_index_reclaim.worker_database",
+							   "Database whose indexes the background worker reclaims.",
+							   NULL,
+							   &reclaim_worker_database,
+							   "postgres",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.worker_naptime",
+							"Time to sleep between rounds of the background worker.",
+							NULL,
+							&reclaim_worker_naptime,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.worker_max_pct_to_merge",
+							"Maximum page usage percentage the background worker merges.",
+							NULL,
+							&reclaim_worker_max_pct,
+							20,
+							1,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.worker_max_merges",
+							"Maximum number of merges per index in one round of the background worker.",
+							NULL,
+							&reclaim_worker_max_merges,
+							10,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_index_reclaim.worker_cost_delay",
+							 "Cost-based delay of the background worker, in milliseconds.",
+							 "Zero disables throttling.",
+							 &reclaim_worker_cost_delay,
+							 2,
+							 0,
+							 100,
+							 PGC_SIGHUP,
+							 GUC_UNIT_MS,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_index_reclaim.worker_cost_limit",
+							"Cost amount available before the background worker sleeps.",
+							NULL,
+							&reclaim_worker_cost_limit,
+							200,
+							1,
+							10000,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_index_reclaim");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_index_reclaim_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_index_reclaim worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_index_reclaim worker");
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * List the OIDs of the permanent B-tree indexes of the database, leaving out
+ * those of system catalogs
+ *
+ * The list is allocated in mcxt, so that it survives the transaction.
+ */
+static List *
+list_btree_indexes(MemoryContext mcxt)
+{
+	List	   *indexes = NIL;
+	Relation	classRel;
+	TableScanDesc scan;
+	HeapTuple	tuple;
+
+	StartTransactionCommand();
+
+	classRel = table_open(RelationRelationId, AccessShareLock);
+	scan = table_beginscan_catalog(classRel, 0, NULL);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Form_pg_class classForm = (Form_pg_class) GETSTRUCT(tuple);
+		MemoryContext oldcxt;
+
+		if (classForm->relkind != RELKIND_INDEX ||
+			classForm->relam != BTREE_AM_OID ||
+			classForm->relpersistence == RELPERSISTENCE_TEMP ||
+			IsCatalogRelationOid(classForm->oid))
+			continue;
+
+		oldcxt = MemoryContextSwitchTo(mcxt);
+		indexes = lappend_oid(indexes, classForm->oid);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	table_endscan(scan);
+	table_close(classRel, AccessShareLock);
+
+	CommitTransactionCommand();
+
+	return indexes;
+}
+
+/*
+ * Run one throttled batch of merges on an index, in its own transaction
+ *
+ * Indexes whose table or index is locked by someone else, that have been
+ * dropped in the meantime or are not valid are skipped; the next round
+ * retries them.  No lock is ever waited for, so the worker can't queue up
+ * behind DDL or deadlock with it.
+ */
+static void
+reclaim_worker_index(Oid indexoid)
+{
+	Oid			heapoid;
+	Relation	rel;
+	int64		pages_merged = 0;
+	int64		space_reclaimed = 0;
+
+	StartTransactionCommand();
+
+	/*
+	 * Don't queue up behind DDL, VACUUM or a concurrent reclaim.  The table
+	 * comes first, as everywhere else; its ShareUpdateExclusiveLock keeps
+	 * VACUUM out while we merge.
+	 */
+	heapoid = IndexGetRelation(indexoid, true);
+	if (!OidIsValid(heapoid) ||
+		!ConditionalLockRelationOid(heapoid, ShareUpdateExclusiveLock) ||
+		!ConditionalLockRelationOid(indexoid, ShareUpdateExclusiveLock))
+	{
+		CommitTransactionCommand();
+		return;
+	}
+
+	rel = try_relation_open(indexoid, NoLock);
+	if (rel == NULL ||
+		rel->rd_rel->relam != BTREE_AM_OID ||
+		!rel->rd_index->indisvalid ||
+		!rel->rd_index->indisready)
+	{
+		if (rel != NULL)
+			relation_close(rel, NoLock);
+		CommitTransactionCommand();
+		return;
+	}
+
+	pgstat_report_activity(STATE_RUNNING,
+						   psprintf("reclaiming space in index \"%s\"",
+									RelationGetRelationName(rel)));
+
+	vacuum_cost_delay = reclaim_worker_cost_delay;
+	vacuum_cost_limit = reclaim_worker_cost_limit;
+	VacuumCostActive = (vacuum_cost_delay > 0);
+	VacuumCostBalance = 0;
+
+	reclaim_index(rel, reclaim_worker_max_pct, reclaim_worker_max_merges, 0, NULL, NULL,
+				  &pages_merged, &space_reclaimed);
+
+	VacuumCostActive = false;
+
+	if (pages_merged > 0)
+		elog(DEBUG1, "pg_index_reclaim worker: merged " INT64_FORMAT " pages of index \"%s\", reclaiming " INT64_FORMAT " bytes",
+			 pages_merged, RelationGetRelationName(rel), space_reclaimed);
+
+	relation_close(rel, NoLock);
+	CommitTransactionCommand();
+}
+
+/*
+ * Main entry point of the background worker
+ */
+void
+pg_index_reclaim_worker_main(Datum main_arg)
+{
+	MemoryContext roundcxt;
+	uint32		wait_event_main;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(reclaim_worker_database, NULL, 0);
+
+	/* Shown in pg_stat_activity while the worker naps between rounds */
+	wait_event_main = WaitEventExtensionNew("IndexReclaimWorkerMain");
+
+	roundcxt = AllocSetContextCreate(TopMemoryContext,
+									 "pg_index_reclaim worker round",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		List	   *indexes;
+		ListCell   *lc;
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 reclaim_worker_naptime * 1000L,
+						 wait_event_main);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		MemoryContextReset(roundcxt);
+		indexes = list_btree_indexes(roundcxt);
+
+		foreach(lc, indexes)
+		{
+			CHECK_FOR_INTERRUPTS();
+
+			if (ConfigReloadPending)
+			{
+				ConfigReloadPending = false;
+				ProcessConfigFile(PGC_SIGHUP);
+			}
+
+			PG_TRY();
+			{
+				reclaim_worker_index(lfirst_oid(lc));
+			}
+			PG_CATCH();
+			{
+				/* Report the error and go on with the next index */
+				HOLD_INTERRUPTS();
+				EmitErrorReport();
+				AbortCurrentTransaction();
+				FlushErrorState();
+				VacuumCostActive = false;
+				MemoryContextSwitchTo(TopMemoryContext);
+				RESUME_INTERRUPTS();
+			}
+			PG_END_TRY();
+		}
+
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+}
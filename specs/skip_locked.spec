@@ -0,0 +1,81 @@
+# With pg_index_reclaim.skip_locked, a merge that finds a page of its run
+# locked by another session is deferred instead of waiting for it.
+#
+# s2 holds a share lock on a leaf in the middle of the only run of sparse
+# leaves: its index scan compares keys with an operator that blocks on an
+# advisory lock of s1, and the scan holds the leaf locked meanwhile.
+
+setup
+{
+	CREATE EXTENSION pg_index_reclaim;
+
+	CREATE FUNCTION lock_test_eq(a int4, b int4) RETURNS bool
+	LANGUAGE plpgsql AS $$
+	BEGIN
+		IF current_setting('reclaim_test.block', true) = 'on' THEN
+			PERFORM pg_advisory_lock_shared(4242);
+			PERFORM pg_advisory_unlock_shared(4242);
+		END IF;
+		RETURN a = b;
+	END
+	$$;
+
+	CREATE OPERATOR #< (LEFTARG = int4, RIGHTARG = int4, FUNCTION = int4lt);
+	CREATE OPERATOR #<= (LEFTARG = int4, RIGHTARG = int4, FUNCTION = int4le);
+	CREATE OPERATOR #= (LEFTARG = int4, RIGHTARG = int4, FUNCTION = lock_test_eq);
+	CREATE OPERATOR #>= (LEFTARG = int4, RIGHTARG = int4, FUNCTION = int4ge);
+	CREATE OPERATOR #> (LEFTARG = int4, RIGHTARG = int4, FUNCTION = int4gt);
+	CREATE OPERATOR CLASS lock_test_ops FOR TYPE int4 USING btree AS
+		OPERATOR 1 #<, OPERATOR 2 #<=, OPERATOR 3 #=, OPERATOR 4 #>=,
+		OPERATOR 5 #>, FUNCTION 1 btint4cmp(int4, int4);
+
+	-- Full leaves around three sparse ones
+	CREATE TABLE lock_test (k int4) WITH (autovacuum_enabled = off);
+	INSERT INTO lock_test SELECT generate_series(1, 2000);
+	CREATE INDEX lock_test_idx ON lock_test (k lock_test_ops);
+	DELETE FROM lock_test WHERE k BETWEEN 400 AND 1500 AND k % 100 <> 0;
+}
+
+setup
+{
+	VACUUM lock_test;
+}
+
+teardown
+{
+	DROP TABLE lock_test;
+	DROP OPERATOR FAMILY lock_test_ops USING btree;
+	DROP OPERATOR #< (int4, int4);
+	DROP OPERATOR #<= (int4, int4);
+	DROP OPERATOR #= (int4, int4);
+	DROP OPERATOR #>= (int4, int4);
+	DROP OPERATOR #> (int4, int4);
+	DROP FUNCTION lock_test_eq(int4, int4);
+	DROP EXTENSION pg_index_reclaim;
+}
+
+session s1
+step s1_lock	{ SELECT pg_advisory_lock(4242); }
+step s1_unlock	{ SELECT pg_advisory_unlock(4242); }
+
+session s2
+setup
+{
+	SET enable_seqscan = off;
+	SET enable_bitmapscan = off;
+	SET reclaim_test.block = on;
+}
+step s2_scan	{ SELECT count(*) = 1 AS found FROM lock_test WHERE k #= 900; }
+
+session s3
+setup
+{
+	SET pg_index_reclaim.skip_locked = on;
+}
+step s3_execute	{ SELECT pages_merged = 0 AS deferred FROM reclaim_space_execute('lock_test_idx'::regclass, 50); }
+step s3_stats	{ SELECT merges = 0 AS none_merged, aborted_lock_busy > 0 AS lock_busy FROM pg_stat_index_reclaim WHERE indexrelid = 'lock_test_idx'::regclass; }
+step s3_merge	{ SELECT pages_merged > 0 AS merged FROM reclaim_space_execute('lock_test_idx'::regclass, 50); }
+
+# The run is deferred, and retried, without waiting for s2; once s2 is
+# done, it is merged
+permutation s1_lock s2_scan s3_execute s3_stats s1_unlock s3_merge(s2_scan)
@@ -4,6 +4,7 @@
 
 -- Create extension
 CREATE EXTENSION pg_index_reclaim;
+CREATE EXTENSION amcheck;
 
 -- Create test table with data
 -- Using a smaller dataset for regression testing (10000 rows instead of 1M)
@@ -17,6 +18,9 @@ CREATE INDEX test_reclaim_idx ON test_reclaim(a, b);
 -- Check initial index size
 SELECT pg_relation_size('test_reclaim_idx') > 0 AS has_size;
 
+-- Remember where the WAL was before the bloat was created
+SELECT pg_current_wal_lsn() AS before_delete \gset
+
 -- Delete most rows to create bloat (keep only ~3% of rows)
 DELETE FROM test_reclaim WHERE b > 0.03;
 
@@ -35,6 +39,112 @@ SELECT
     bool_or(can_merge) AS some_can_merge
 FROM reclaim_space('test_reclaim_idx'::regclass, 50);
 
+-- The physical-order scan must find exactly the pairs the sibling walk finds
+SELECT count(*) AS mismatches FROM (
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, sequential => true))
+    UNION ALL
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, sequential => true)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50))
+) d;
+
+-- A key range without bounds walks the whole leaf level
+SELECT count(*) AS mismatches FROM (
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space_range('test_reclaim_idx'::regclass, NULL::float8, NULL::float8, 50))
+    UNION ALL
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space_range('test_reclaim_idx'::regclass, NULL::float8, NULL::float8, 50)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50))
+) d;
+
+-- A bounded range finds a subset of those pairs, and none past the last key
+SELECT count(*) AS outside FROM (
+    SELECT left_page_block, right_page_block, can_merge
+    FROM reclaim_space_range('test_reclaim_idx'::regclass, 0.25::float8, 0.5::float8, 50)
+    EXCEPT ALL
+    SELECT left_page_block, right_page_block, can_merge
+    FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+) d;
+SELECT count(*) FROM reclaim_space_range('test_reclaim_idx'::regclass, 2.0::float8, NULL::float8, 50);
+SELECT pages_merged
+FROM reclaim_space_execute_range('test_reclaim_idx'::regclass, 2.0::float8, NULL::float8, 50);
+
+-- The bounds must be of the type of the first column
+SELECT count(*) FROM reclaim_space_range('test_reclaim_idx'::regclass, 1, 2);
+
+-- A parallel physical-order scan must find the same pairs as well
+SET min_parallel_index_scan_size = 0;
+SET max_parallel_maintenance_workers = 2;
+SELECT count(*) AS mismatches FROM (
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, sequential => true))
+    UNION ALL
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, sequential => true)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50))
+) d;
+RESET min_parallel_index_scan_size;
+RESET max_parallel_maintenance_workers;
+
+-- Incremental analysis since before the DELETE must find the same pairs
+SELECT count(*) AS mismatches FROM (
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, since_lsn => :'before_delete'))
+    UNION ALL
+    (SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50, since_lsn => :'before_delete')
+     EXCEPT ALL
+     SELECT left_page_block, right_page_block, can_merge
+     FROM reclaim_space('test_reclaim_idx'::regclass, 50))
+) d;
+
+-- The summary must agree with the per-pair rows
+SELECT s.leaf_pages > 0 AS has_leaves,
+       array_length(s.fill_histogram, 1) AS buckets,
+       (SELECT sum(h) FROM unnest(s.fill_histogram) h) = s.leaf_pages AS histogram_ok,
+       s.mergeable_pairs = (SELECT count(*)
+                            FROM reclaim_space('test_reclaim_idx'::regclass, 50)
+                            WHERE can_merge) AS pairs_ok,
+       s.reclaimable_pages BETWEEN 1 AND s.mergeable_pairs AS estimate_ok,
+       s.reclaimable_bytes = s.reclaimable_pages * current_setting('block_size')::bigint AS bytes_ok
+FROM reclaim_space_summary('test_reclaim_idx'::regclass, 50) s;
+
+-- A sampled summary extrapolates, within its bounds
+SELECT leaf_pages > 0 AS has_leaves,
+       reclaimable_pages BETWEEN reclaimable_pages_low AND reclaimable_pages_high AS bounds_ok
+FROM reclaim_space_summary('test_reclaim_idx'::regclass, 50, sample_fraction => 0.5);
+SELECT reclaimable_pages_low = reclaimable_pages AND
+       reclaimable_pages_high = reclaimable_pages AS exact_bounds
+FROM reclaim_space_summary('test_reclaim_idx'::regclass, 50);
+
+-- Rows are produced as the leaf walk finds them, so a caller can stop early
+SELECT count(*) AS first_candidates
+FROM (SELECT reclaim_space('test_reclaim_idx'::regclass, 50) LIMIT 3) s;
+
+-- Nothing has been vacuumed since now
+SELECT count(*) AS candidates
+FROM reclaim_space('test_reclaim_idx'::regclass, 50, since_lsn => pg_current_wal_lsn());
+
 -- Execute reclaim - first pass
 SELECT pages_merged >= 0 AS valid_result, space_reclaimed >= 0 AS valid_space
 FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
@@ -55,29 +165,185 @@ FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
 SELECT pages_merged >= 0 AS valid_result, space_reclaimed >= 0 AS valid_space
 FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
 
--- Vacuum to clean up half-dead pages left by reclaim
+-- The merged index must pass amcheck, with all heap tuples found in it
+SELECT bt_index_parent_check('test_reclaim_idx'::regclass, true);
+
+-- Every pass is accounted for in the cumulative statistics
+SELECT calls, merges > 0 AS merged, pages_deleted >= merges AS pages_ok,
+       bytes_moved > 0 AS moved, wal_bytes > 0 AS logged
+FROM pg_stat_index_reclaim
+WHERE indexrelid = 'test_reclaim_idx'::regclass;
+
+-- Nothing else holds the pages, so skip_locked defers no merge
+SET pg_index_reclaim.skip_locked = on;
+SELECT pages_merged >= 0 AS valid_result
+FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
+SELECT aborted_lock_busy
+FROM pg_stat_index_reclaim
+WHERE indexrelid = 'test_reclaim_idx'::regclass;
+RESET pg_index_reclaim.skip_locked;
+
+-- A WAL rate limit this high never makes merges sleep for long
+SET pg_index_reclaim.max_wal_rate = '1GB';
+SET pg_index_reclaim.max_replica_lag = '10s';
+SELECT pages_merged >= 0 AS valid_result
+FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
+SELECT throttle_time < 1000 AS throttle_ok
+FROM pg_stat_index_reclaim
+WHERE indexrelid = 'test_reclaim_idx'::regclass;
+RESET pg_index_reclaim.max_wal_rate;
+RESET pg_index_reclaim.max_replica_lag;
+
+-- A low WAL rate limit makes every merge sleep for the WAL it wrote
+CREATE TABLE test_throttle AS SELECT i FROM generate_series(1, 20000) i;
+CREATE INDEX test_throttle_idx ON test_throttle(i);
+DELETE FROM test_throttle WHERE i % 10 <> 0;
+VACUUM test_throttle;
+SET pg_index_reclaim.max_wal_rate = '256kB';
+SELECT pages_merged > 0 AS merged
+FROM reclaim_space_execute('test_throttle_idx'::regclass, 50, max_merges => 2);
+RESET pg_index_reclaim.max_wal_rate;
+SELECT throttle_time > 0 AS throttled
+FROM pg_stat_index_reclaim
+WHERE indexrelid = 'test_throttle_idx'::regclass;
+DROP TABLE test_throttle;
+
+-- With a hot page age this large, every page counts as hot, and merges
+-- that would leave the merged page more than half full are not done.  On
+-- two equal indexes with every leaf about 40% full, pairs fit on one page
+-- but fill it to 80%: only the index that is not hot gets them merged.
+CREATE TABLE test_hot AS SELECT i FROM generate_series(1, 20000) i;
+CREATE INDEX test_hot_idx ON test_hot(i);
+CREATE INDEX test_cold_idx ON test_hot(i);
+DELETE FROM test_hot WHERE i % 20 >= 9;
+VACUUM test_hot;
+SET pg_index_reclaim.hot_page_age = '1TB';
+SELECT pages_merged AS hot_merged
+FROM reclaim_space_execute('test_hot_idx'::regclass, 50) \gset
+RESET pg_index_reclaim.hot_page_age;
+SELECT pages_merged AS cold_merged
+FROM reclaim_space_execute('test_cold_idx'::regclass, 50) \gset
+SELECT :hot_merged < :cold_merged AS fewer_when_hot;
+DROP TABLE test_hot;
+
+-- Per-phase times are collected with track_timing
+SET pg_index_reclaim.track_timing = on;
+SELECT pages_merged >= 0 AS valid_result
+FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
+SELECT scan_time > 0 AS scan_timed,
+       descent_time >= 0 AND lock_time >= 0 AND pairing_time >= 0 AND
+       rewrite_time >= 0 AND wal_time >= 0 AS phases_ok
+FROM pg_stat_index_reclaim
+WHERE indexrelid = 'test_reclaim_idx'::regclass;
+RESET pg_index_reclaim.track_timing;
+
+-- Nothing is running in other sessions, and finished commands leave no row
+SELECT count(*) AS running FROM pg_stat_progress_index_reclaim;
+
+-- Internal levels: the root is alone on level 1, and there is no level 5
+SELECT count(*) FROM reclaim_space('test_reclaim_idx'::regclass, 50, level => 1);
+SELECT count(*) FROM reclaim_space('test_reclaim_idx'::regclass, 50, level => 5);
+SELECT pages_merged
+FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50, level => 1);
+SELECT count(*) FROM reclaim_space('test_reclaim_idx'::regclass, 50, true, level => 1);
+
+-- Merges on level 1 need an index with at least three levels: wide keys
+-- keep the fan-out low
+CREATE TABLE test_deep AS
+SELECT i, lpad(i::text, 250, '0') AS t
+FROM generate_series(1, 20000) i;
+CREATE INDEX test_deep_idx ON test_deep(t);
+DELETE FROM test_deep WHERE i % 50 <> 0;
+VACUUM test_deep;
+SELECT pages_merged > 0 AS merged
+FROM reclaim_space_execute('test_deep_idx'::regclass, 50, 1000);
+SELECT pages_merged > 0 AS merged
+FROM reclaim_space_execute('test_deep_idx'::regclass, 50, 1000, level => 1);
+SELECT bt_index_parent_check('test_deep_idx'::regclass, true);
+-- Deleted pages can be reused once a later transaction has committed
+SELECT pg_current_xact_id() IS NOT NULL AS xid_assigned;
+SELECT pages_moved > 0 AS moved
+FROM reclaim_space_compact('test_deep_idx'::regclass);
+SELECT bt_index_parent_check('test_deep_idx'::regclass, true);
+DROP TABLE test_deep;
+
+-- Many indexes at once: a zero budget merges nothing, and the page budget
+-- is shared by all indexes of the table
+SELECT count(*) FROM reclaim_space_all('test_reclaim'::regclass, max_pages => 0);
+SELECT coalesce(sum(pages_merged), 0) <= 1 AS within_budget
+FROM reclaim_space_all('test_reclaim'::regclass, max_pct_to_merge => 50, max_pages => 1);
+SELECT * FROM reclaim_space_all(max_wal_bytes => -1);
+
+-- Compaction: with the low keys gone, VACUUM frees the leaves at the start
+-- of the file while the live ones and the root stay at its end.  They are
+-- moved down, and a second call that moves nothing truncates the blocks
+-- they left once those can be reused
+CREATE TABLE test_compact AS SELECT i FROM generate_series(1, 20000) i;
+CREATE INDEX test_compact_idx ON test_compact(i);
+DELETE FROM test_compact WHERE i <= 18000;
+VACUUM test_compact;
+SELECT pg_current_xact_id() IS NOT NULL AS xid_assigned;
+SELECT pg_relation_size('test_compact_idx') AS size_before_compact \gset
+SELECT pages_moved > 0 AS moved
+FROM reclaim_space_compact('test_compact_idx'::regclass);
+SELECT bt_index_parent_check('test_compact_idx'::regclass, true);
+SELECT pg_current_xact_id() IS NOT NULL AS xid_assigned;
+SELECT pages_moved, pages_truncated > 0 AS truncated
+FROM reclaim_space_compact('test_compact_idx'::regclass, max_moves => 0);
+SELECT pg_relation_size('test_compact_idx') < :size_before_compact AS shrunk;
+SELECT bt_index_parent_check('test_compact_idx'::regclass, true);
+SET enable_seqscan = off;
+SELECT count(*) AS remaining FROM test_compact WHERE i > 0;
+RESET enable_seqscan;
+DROP TABLE test_compact;
+
+-- Vacuum, which must cope with the pages reclaim deleted
 VACUUM test_reclaim;
 
--- Verify index is still valid by running amcheck if available
--- (Skip if amcheck is not installed)
-DO $$
-BEGIN
-    IF EXISTS (SELECT 1 FROM pg_extension WHERE extname = 'amcheck') THEN
-        PERFORM bt_index_check('test_reclaim_idx'::regclass);
-        RAISE NOTICE 'Index check passed';
-    ELSE
-        RAISE NOTICE 'amcheck not installed, skipping index check';
-    END IF;
-EXCEPTION WHEN undefined_function THEN
-    RAISE NOTICE 'amcheck not available, skipping index check';
-END;
-$$;
+-- The index must still be valid after VACUUM has been over it
+SELECT bt_index_parent_check('test_reclaim_idx'::regclass, true);
 
 -- Verify data is still accessible through the index
 SET enable_seqscan = off;
 SELECT count(*) > 0 AS has_remaining_rows FROM test_reclaim WHERE a > 0;
 RESET enable_seqscan;
 
+-- Merged pages must keep the index in key order: the keys read through the
+-- index must be all the keys of the table, as a sequential scan sorts them
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SET enable_sort = off;
+CREATE TEMP TABLE index_keys AS
+SELECT k.a, k.pos
+FROM unnest(ARRAY(SELECT a FROM test_reclaim ORDER BY a, b)) WITH ORDINALITY AS k(a, pos);
+RESET enable_seqscan;
+RESET enable_sort;
+SET enable_indexscan = off;
+SET enable_indexonlyscan = off;
+SELECT count(*) FILTER (WHERE i.a IS DISTINCT FROM s.a) AS out_of_order
+FROM index_keys i
+FULL JOIN (SELECT a, row_number() OVER (ORDER BY a, b) AS pos
+           FROM test_reclaim) s USING (pos);
+RESET enable_bitmapscan;
+RESET enable_indexscan;
+RESET enable_indexonlyscan;
+DROP TABLE index_keys;
+
+-- Only roles with the MAINTAIN privilege on a table may change its indexes
+CREATE ROLE regress_reclaim_user;
+SET ROLE regress_reclaim_user;
+SELECT * FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
+SELECT * FROM reclaim_space_compact('test_reclaim_idx'::regclass);
+SELECT count(*) FROM reclaim_space_all('test_reclaim'::regclass);
+RESET ROLE;
+GRANT MAINTAIN ON test_reclaim TO regress_reclaim_user;
+SET ROLE regress_reclaim_user;
+SELECT pages_merged >= 0 AS valid_result
+FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50);
+RESET ROLE;
+REVOKE MAINTAIN ON test_reclaim FROM regress_reclaim_user;
+DROP ROLE regress_reclaim_user;
+
 -- Test error handling: non-btree index should fail
 CREATE TABLE test_hash (a int);
 CREATE INDEX test_hash_idx ON test_hash USING hash(a);
@@ -87,7 +353,20 @@ SELECT * FROM reclaim_space('test_hash_idx'::regclass, 50);
 SELECT * FROM reclaim_space('test_reclaim_idx'::regclass, 0);
 SELECT * FROM reclaim_space('test_reclaim_idx'::regclass, 101);
 
+-- Test error handling: invalid merge budget
+SELECT * FROM reclaim_space_execute('test_reclaim_idx'::regclass, 50, 0);
+
+-- Test error handling: incremental analysis is not a physical-order scan
+SELECT * FROM reclaim_space('test_reclaim_idx'::regclass, 50, true, pg_current_wal_lsn());
+
+-- Test error handling: invalid sampling fraction
+SELECT * FROM reclaim_space_summary('test_reclaim_idx'::regclass, 50, 0);
+
+-- Test error handling: invalid move budget
+SELECT * FROM reclaim_space_compact('test_reclaim_idx'::regclass, -1);
+
 -- Clean up
 DROP TABLE test_reclaim;
 DROP TABLE test_hash;
 DROP EXTENSION pg_index_reclaim;
+DROP EXTENSION amcheck;
@@ -0,0 +1,165 @@
+/*-------------------------------------------------------------------------
+ *
+ * wal_changes.c
+ *	  Find the leaf pages of an index that lost tuples since a given LSN
+ *
+ * VACUUM and index tuple deletion only make leaf pages sparser by
+ * removing tuples, and both leave a WAL record behind that names the page:
+ * XLOG_BTREE_VACUUM and XLOG_BTREE_DELETE.  Reading the WAL written since a
+ * watermark therefore yields exactly the pages that can have become merge
+ * candidates since, at a cost proportional to the WAL volume rather than
+ * to the size of the index.  This works as long as the WAL is still
+ * around; if it has been recycled, the caller has to fall back to a full
+ * analysis.
+ *
+ * Copyright (c) 2025, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *	  contrib/pg_index_reclaim/wal_changes.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/nbtxlog.h"
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "access/xlogrecovery.h"
+#include "access/xlogutils.h"
+#include "common/int.h"
+#include "lib/qunique.h"
+#include "miscadmin.h"
+#include "utils/rel.h"
+
+#include "pg_index_reclaim.h"
+
+/*
+ * qsort/bsearch comparator for block numbers
+ */
+int
+blocknumber_cmp(const void *a, const void *b)
+{
+	return pg_cmp_u32(*(const BlockNumber *) a, *(const BlockNumber *) b);
+}
+
+/*
+ * Collect the leaf pages of rel that VACUUM or tuple deletion changed after
+ * since_lsn
+ *
+ * Returns a sorted array of distinct block numbers, and its length in
+ * *nblocks.  Errors out if the WAL at since_lsn is no longer available.
+ */
+BlockNumber *
+collect_vacuumed_blocks(Relation rel, XLogRecPtr since_lsn, int *nblocks)
+{
+	XLogRecPtr	end_lsn;
+	XLogReaderState *xlogreader;
+	ReadLocalXLogPageNoWaitPrivate *private_data;
+	BlockNumber *blocks;
+	int			nalloc = 64;
+	int			n = 0;
+
+	blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * nalloc);
+
+	if (!RecoveryInProgress())
+		end_lsn = GetFlushRecPtr(NULL);
+	else
+		end_lsn = GetXLogReplayRecPtr(NULL);
+
+	if (since_lsn >= end_lsn)
+	{
+		*nblocks = 0;
+		return blocks;
+	}
+
+	private_data = (ReadLocalXLogPageNoWaitPrivate *)
+		palloc0(sizeof(ReadLocalXLogPageNoWaitPrivate));
+	xlogreader = XLogReaderAllocate(wal_segment_size, NULL,
+									XL_ROUTINE(.page_read = &read_local_xlog_page_no_wait,
+											   .segment_open = &wal_segment_open,
+											   .segment_close = &wal_segment_close),
+									private_data);
+	if (xlogreader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	if (XLogRecPtrIsInvalid(XLogFindNextRecord(xlogreader, since_lsn)))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not find a valid WAL record at or after %X/%X",
+						LSN_FORMAT_ARGS(since_lsn)),
+				 errhint("The WAL may already have been removed; analyze the whole index instead.")));
+
+	for (;;)
+	{
+		XLogRecord *record;
+		char	   *errormsg;
+		uint8		info;
+		int			block_id;
+
+		CHECK_FOR_INTERRUPTS();
+
+		record = XLogReadRecord(xlogreader, &errormsg);
+		if (record == NULL)
+		{
+			if (private_data->end_of_wal)
+				break;
+			if (errormsg)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read WAL at %X/%X: %s",
+								LSN_FORMAT_ARGS(xlogreader->EndRecPtr), errormsg)));
+			else
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read WAL at %X/%X",
+								LSN_FORMAT_ARGS(xlogreader->EndRecPtr))));
+		}
+
+		if (xlogreader->EndRecPtr > end_lsn)
+			break;
+
+		if (XLogRecGetRmid(xlogreader) != RM_BTREE_ID)
+			continue;
+		info = XLogRecGetInfo(xlogreader) & ~XLR_INFO_MASK;
+		if (info != XLOG_BTREE_VACUUM && info != XLOG_BTREE_DELETE)
+			continue;
+
+		for (block_id = 0; block_id <= XLogRecMaxBlockId(xlogreader); block_id++)
+		{
+			RelFileLocator rlocator;
+			ForkNumber	forknum;
+			BlockNumber blkno;
+
+			if (!XLogRecGetBlockTagExtended(xlogreader, block_id,
+											&rlocator, &forknum, &blkno, NULL))
+				continue;
+			if (forknum != MAIN_FORKNUM ||
+				!RelFileLocatorEquals(rlocator, rel->rd_locator))
+				continue;
+
+			if (n >= nalloc)
+			{
+				nalloc *= 2;
+				blocks = (BlockNumber *) repalloc(blocks, sizeof(BlockNumber) * nalloc);
+			}
+			blocks[n++] = blkno;
+		}
+	}
+
+	XLogReaderFree(xlogreader);
+	pfree(private_data);
+
+	qsort(blocks, n, sizeof(BlockNumber), blocknumber_cmp);
+	*nblocks = qunique(blocks, n, sizeof(BlockNumber), blocknumber_cmp);
+
+	elog(DEBUG1, "pg_index_reclaim: WAL from %X/%X to %X/%X changed %d leaf pages of index \"%s\"",
+		 LSN_FORMAT_ARGS(since_lsn), LSN_FORMAT_ARGS(end_lsn), *nblocks,
+		 RelationGetRelationName(rel));
+
+	return blocks;
+}